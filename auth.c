@@ -22,11 +22,13 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #ifdef __OpenBSD__
 #include <login_cap.h>
 #include <bsd_auth.h>
 #else
 #include <shadow.h>
+#include <crypt.h>
 #endif
 
 #include "xbluck.h"
@@ -56,17 +58,86 @@ egetpwuid(uid_t uid) {
 	return pw;
 }
 
+#ifndef CRYPT_SALT_OK
+/* $id$ methods known to be in this libc's crypt(3) */
+static const char *const methods[] = {
+#if defined(__OpenBSD__)
+	"2a", "2b",
+#elif defined(__GLIBC__)
+	"1", "5", "6",
+#else
+	"1", "2a", "2b", "2x", "2y", "5", "6",
+#endif
+};
+
+static bool
+hash_chars(const char *s, const char *extra) {
+	for (; *s; ++s) {
+		if (!isalnum((unsigned char)*s) && *s != '.' && *s != '/' && !strchr(extra, *s))
+			return false;
+	}
+	return true;
+}
+
+static bool
+known_method(const char *id, size_t len) {
+	size_t i;
+	for (i = 0; i < LENGTH(methods); ++i) {
+		if (strlen(methods[i]) == len && !strncmp(methods[i], id, len))
+			return true;
+	}
+	return false;
+}
+#endif
+
+/*
+ * Whether crypt(3) can check passwords against hash, judged from its
+ * form, so that no key derivation, which can take a good part of a
+ * second, runs before the screen is locked. Without libxcrypt to say
+ * which methods it has, a method not known to be in this libc, and
+ * DES, which is cheap, are tried on the empty password instead, and
+ * fail if crypt does. A locked account's "!" or "*" is not a hash.
+ */
+bool
+hash_is_valid(const char *hash) {
+#ifdef CRYPT_SALT_OK
+	int ret = crypt_checksalt(hash);
+	return ret == CRYPT_SALT_OK || ret == CRYPT_SALT_METHOD_LEGACY;
+#else
+	const char *p, *h;
+
+	if (hash[0] == '$') {
+		/* $id$[param$]salt$hash */
+		for (p = hash + 1; isalnum((unsigned char)*p); ++p)
+			;
+		if (p == hash + 1 || *p != '$' || !p[1] || !hash_chars(p + 1, "$=,"))
+			return false;
+		if (known_method(hash + 1, p - hash - 1))
+			return true;
+	} else if (hash[0] == '_') {
+		if (strlen(hash) != 20 || !hash_chars(hash + 1, ""))
+			return false;
+	} else if (strlen(hash) != 13 || !hash_chars(hash, "")) {
+		return false;
+	}
+	/* crypt fails with NULL, or a token starting with '*' */
+	return (h = crypt("", hash)) && h[0] == hash[0];
+#endif
+}
+
 bool
 password_is_valid() {
 	const char *hash;
 	bool valid = false;
 
 	if (auth.hash) {
+		uint64_t t = now_us();
 		if (!(hash = crypt(auth.input, auth.hash))) {
 			warn("crypt");
 		} else {
 			valid = strcmp(hash, auth.hash) == 0;
 		}
+		hist_add(&stats.crypt, now_us() - t);
 	} else {
 #ifdef __OpenBSD__
 		struct passwd *pw = egetpwuid(getuid());
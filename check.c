@@ -0,0 +1,647 @@
+/*
+ * Copyright © 2017 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "xbluck.h"
+
+/*
+ * make check. Every filter, and chains that take each of the paths of
+ * apply_filters, run on a fixed synthetic frame, and are checked:
+ *
+ *  - against a golden frame in golden/, which must match exactly, so
+ *    any change to the output shows; `make golden` rewrites them, to
+ *    be looked at and committed along with a FILTER_VERSION bump;
+ *  - against the chain as given, run stage by stage on XRGB with the
+ *    plain filter functions, within the tolerance its path documents:
+ *    none for grey runs, flips and strips, ±2 for fused blurpix, and
+ *    so on, see the cases;
+ *  - against itself under every variant of the plan, which must give
+ *    the same bytes, see tune.c;
+ *  - run in strips with the halo capture_strips uses, which must give
+ *    the whole frame's bytes wherever strip_halo allows strips.
+ *
+ * Noise is random, so it has no golden frame; it is checked to stay
+ * within its level instead, with rand() seeded the same for each run.
+ * The blur --render asks of the server is checked against a model of
+ * pixman's convolution, which Xvfb and Xorg both use.
+ *
+ * Then every stage is timed alone on a larger frame, the best of a few
+ * runs, and fails if it takes more nanoseconds a pixel than its budget
+ * below times the -b scale, for slower build machines.
+ */
+
+#define CHECK_W 48
+#define CHECK_H 32
+#define BENCH_W 1024
+#define BENCH_H 768
+#define BENCH_RUNS 5
+#define STRIP_ROWS_CHECK 8 /* small, for several strips on CHECK_H rows */
+#define MAXSTAGES 8
+#define RENDER_TOL 2
+
+enum { PATH_XRGB, PATH_LINEAR, PATH_DEEP };
+
+struct case_t {
+	const char *name;
+	int path;
+	int tol;      /* against the chain run stage by stage, or -1 for none */
+	int planned;  /* stages plan_filters must leave, or 0 for any */
+	bool random;
+	struct filter_t f[MAXSTAGES];
+};
+
+struct budget_t {
+	const char *name;
+	int path;
+	double ns;    /* per pixel */
+	struct filter_t f[MAXSTAGES];
+};
+
+static const unsigned render_radii[] = { 2, 3, 6, 20 };
+
+struct options_t conf;
+int state;
+
+static const struct kernel_t sharpen = { 3, 3, 0, 0, { 0, -1, 0, -1, 5, -1, 0, -1, 0 } };
+static const struct kernel_t motion = { 9, 1, 0, 0, { 1, 1, 1, 1, 1, 1, 1, 1, 1 } };
+static const struct kernel_t box = { 3, 3, 0, 0, { 1, 2, 1, 2, 4, 2, 1, 2, 1 } };
+static const struct kernel_t emboss = { 3, 3, 1, 128, { -2, -1, 0, -1, 1, 1, 0, 1, 2 } };
+static const struct kernel_t darken = { 3, 3, 0, -40, { 1, 2, 1, 2, 4, 2, 1, 2, 1 } };
+static const struct matrix_t swap = { {
+	{ 0, 0, 1, 0 },
+	{ 0, 1, 0, 0 },
+	{ .5, 0, .5, 10 },
+} };
+
+#define F(name, ...) { &filterdef_##name, { __VA_ARGS__ } }
+#define US(a, b) .us = { a, b }
+
+static const struct case_t cases[] = {
+	/* each filter alone */
+	{ "gaussian-3", PATH_XRGB, 0, 0, false, { F(gaussian, .u = 3) } },
+	{ "gaussian-20", PATH_XRGB, 0, 0, false, { F(gaussian, .u = 20) } },
+	{ "pixelate-5", PATH_XRGB, 0, 0, false, { F(pixelate, .u = 5) } },
+	{ "colourise", PATH_XRGB, 0, 0, false, { F(colourise, .u = 0x80203040) } },
+	{ "noise", PATH_XRGB, -1, 0, true, { F(noise, .u = 24) } },
+	{ "tile-3-2", PATH_XRGB, 0, 0, false, { F(tile, US(3, 2)) } },
+	{ "invert", PATH_XRGB, 0, 0, false, { F(invert, 0) } },
+	{ "null", PATH_XRGB, 0, 0, false, { F(null, 0) } },
+	{ "flip", PATH_XRGB, 0, 0, false, { F(flip, 0) } },
+	{ "flop", PATH_XRGB, 0, 0, false, { F(flop, 0) } },
+	{ "edge", PATH_XRGB, 0, 0, false, { F(edge, 0) } },
+	{ "shift-3", PATH_XRGB, 0, 0, false, { F(shift, .u = 3) } },
+	{ "greyscale", PATH_XRGB, 0, 0, false, { F(greyscale, 0) } },
+	{ "kernel-sharpen", PATH_XRGB, 0, 0, false, { F(kernel, .k = &sharpen) } },
+	{ "kernel-motion", PATH_XRGB, 0, 0, false, { F(kernel, .k = &motion) } },
+	{ "kernel-box", PATH_XRGB, 0, 0, false, { F(kernel, .k = &box) } },
+	{ "kernel-emboss", PATH_XRGB, 0, 0, false, { F(kernel, .k = &emboss) } },
+	{ "kernel-darken", PATH_XRGB, 0, 0, false, { F(kernel, .k = &darken) } },
+	{ "matrix-sepia", PATH_XRGB, 0, 0, false, { F(matrix, .m = &matrix_sepia) } },
+	{ "matrix-swap", PATH_XRGB, 0, 0, false, { F(matrix, .m = &swap) } },
+	/* blurpix is only planned in; fused, within ±2 of its two stages */
+	{ "blurpix-6-8", PATH_XRGB, 0, 0, false, { F(blurpix, US(6, 8)) } },
+	{ "blur-pixelate", PATH_XRGB, 2, 1, false,
+	  { F(gaussian, .u = 6), F(pixelate, .u = 8) } },
+	/* the luma plane, the same bytes as on XRGB; nothing to fuse,
+	 * as blurpix has no mono form */
+	{ "grey-run", PATH_XRGB, 0, 6, false,
+	  { F(greyscale, 0), F(gaussian, .u = 4), F(edge, 0), F(pixelate, .u = 4),
+	    F(flip, 0), F(invert, 0) } },
+	/* 16-bit planes, within a level a stage, see apply_filters */
+	{ "planar-run", PATH_XRGB, 3, 3, false,
+	  { F(gaussian, .u = 3), F(tile, US(2, 2)), F(pixelate, .u = 4) } },
+	/* colour stages folded into one matrix, and moved past a blur */
+	{ "matrix-fold", PATH_XRGB, 1, 1, false,
+	  { F(greyscale, 0), F(invert, 0), F(colourise, .u = 0x80203040) } },
+	{ "matrix-commute", PATH_XRGB, 1, 2, false,
+	  { F(greyscale, 0), F(gaussian, .u = 5), F(invert, 0) } },
+	/* an offset fades with a blur's edges, but not with pixelate's */
+	{ "invert-blur-invert", PATH_XRGB, 2, 3, false,
+	  { F(invert, 0), F(gaussian, .u = 5), F(invert, 0) } },
+	{ "invert-pixelate-invert", PATH_XRGB, 2, 1, false,
+	  { F(invert, 0), F(pixelate, .u = 4), F(invert, 0) } },
+	{ "repeats", PATH_XRGB, 0, 2, false,
+	  { F(flip, 0), F(flip, 0), F(pixelate, .u = 4), F(pixelate, .u = 4), F(invert, 0) } },
+	{ "shift-chain", PATH_XRGB, 0, 0, false,
+	  { F(shift, .u = 5), F(flop, 0), F(shift, .u = 2) } },
+	/* in linear light, on XRGB and on planes */
+	{ "linear-gaussian", PATH_LINEAR, 0, 0, false, { F(gaussian, .u = 5) } },
+	{ "linear-pixelate", PATH_LINEAR, 0, 0, false, { F(pixelate, .u = 4) } },
+	{ "linear-tile", PATH_LINEAR, 0, 0, false, { F(tile, US(4, 3)) } },
+	{ "linear-run", PATH_LINEAR, 1, 0, false,
+	  { F(gaussian, .u = 3), F(pixelate, .u = 4) } },
+	/* a depth 30 frame on 16-bit planes, within an 8-bit level a
+	 * stage and one for the input, see apply_planar */
+	{ "deep-chain", PATH_DEEP, 16, 0, false,
+	  { F(gaussian, .u = 4), F(pixelate, .u = 2), F(invert, 0) } },
+	{ "deep-noise", PATH_DEEP, -1, 0, true, { F(noise, .u = 24) } },
+};
+
+/* about three times the worst of a few runs on a shared single-core
+ * x86-64 VM with AVX2, so that noise does not fail them but a lost
+ * SIMD path or a stage walking the frame the slow way does */
+static const struct budget_t budgets[] = {
+	{ "gaussian-5", PATH_XRGB, 30, { F(gaussian, .u = 5) } },
+	{ "gaussian-20", PATH_XRGB, 120, { F(gaussian, .u = 20) } },
+	{ "pixelate-8", PATH_XRGB, 6, { F(pixelate, .u = 8) } },
+	{ "colourise", PATH_XRGB, 25, { F(colourise, .u = 0x80203040) } },
+	{ "noise", PATH_XRGB, 90, { F(noise, .u = 24) } },
+	{ "tile-4-4", PATH_XRGB, 15, { F(tile, US(4, 4)) } },
+	{ "invert", PATH_XRGB, 1, { F(invert, 0) } },
+	{ "flip", PATH_XRGB, 2, { F(flip, 0) } },
+	{ "flop", PATH_XRGB, 2, { F(flop, 0) } },
+	{ "edge", PATH_XRGB, 12, { F(edge, 0) } },
+	{ "shift-3", PATH_XRGB, 1, { F(shift, .u = 3) } },
+	{ "greyscale", PATH_XRGB, 8, { F(greyscale, 0) } },
+	{ "kernel-sharpen", PATH_XRGB, 30, { F(kernel, .k = &sharpen) } },
+	{ "kernel-motion", PATH_XRGB, 15, { F(kernel, .k = &motion) } },
+	{ "matrix-sepia", PATH_XRGB, 2, { F(matrix, .m = &matrix_sepia) } },
+	{ "blurpix-6-8", PATH_XRGB, 25, { F(blurpix, US(6, 8)) } },
+	{ "grey-gaussian-5", PATH_XRGB, 40, { F(greyscale, 0), F(gaussian, .u = 5) } },
+	{ "planar-gaussian-5", PATH_XRGB, 50, { F(gaussian, .u = 5), F(gaussian, .u = 5) } },
+	{ "linear-gaussian-5", PATH_LINEAR, 40, { F(gaussian, .u = 5) } },
+	{ "deep-gaussian-5", PATH_DEEP, 60, { F(gaussian, .u = 5) } },
+};
+
+static struct pixfmt_t deep;
+static bool update;
+static int failed;
+
+static int
+nstages(const struct filter_t *f) {
+	int n = 0;
+	while (n < MAXSTAGES && f[n].def)
+		++n;
+	return n;
+}
+
+/* gradients across, a checkerboard and, below the middle, texture */
+static void
+synth(uint32_t *img, int w, int h, int path) {
+	uint32_t seed = 12345;
+	int x, y;
+
+	for (y = 0; y < h; ++y)
+	for (x = 0; x < w; ++x) {
+		uint32_t r = x * 1023 / (w - 1);
+		uint32_t g = (x + y) * 1023 / (w + h - 2);
+		uint32_t b = ((x / 8 + y / 8) & 1) ? 900 : 100;
+		seed = seed * 1103515245 + 12345;
+		if (y >= h / 2)
+			r ^= seed >> 22 & 0xFF;
+		if (path == PATH_DEEP)
+			img[y * w + x] = r << 20 | g << 10 | b;
+		else
+			img[y * w + x] = r >> 2 << 16 | g >> 2 << 8 | b >> 2;
+	}
+}
+
+/*
+ * Run the chain as xbluck does: planned, then through apply_filters,
+ * or on the planes for a deep frame. The result is the caller's.
+ */
+static uint32_t *
+run(const struct filter_t *chain, int n, const uint32_t *src, int w, int h, int path, bool plan) {
+	struct filter_t f[MAXSTAGES];
+	struct arena_t arena;
+	uint32_t *out;
+
+	memcpy(f, chain, n * sizeof(*f));
+	if (plan)
+		n = plan_filters(f, n);
+	srand(1);
+	arena_init(&arena, w, h, f, n);
+	if (path == PATH_DEEP) {
+		arena_planes(&arena);
+		format_decode16(&deep, arena.plane, (const uint8_t*)src, w, h);
+		apply_planar(&arena, f, n);
+		format_encode16(&deep, arena.img, arena.plane, w, h);
+	} else {
+		memcpy(arena.img, src, (size_t)w * h * sizeof(uint32_t));
+		apply_filters(&arena, f, n);
+	}
+	out = malloc((size_t)w * h * sizeof(uint32_t));
+	if (!out)
+		err(1, "malloc");
+	memcpy(out, arena.img, (size_t)w * h * sizeof(uint32_t));
+	frame_free(arena_finish(&arena), (size_t)w * h * sizeof(uint32_t));
+	return out;
+}
+
+/* the chain as given, each stage's own XRGB function, 8 bits between */
+static uint32_t *
+run_stages(const struct filter_t *f, int n, const uint32_t *src, int w, int h, int path) {
+	struct arena_t arena;
+	uint32_t *out;
+	int i;
+
+	out = malloc((size_t)w * h * sizeof(uint32_t));
+	if (!out)
+		err(1, "malloc");
+	srand(1);
+	arena_init(&arena, w, h, f, n);
+	if (path == PATH_DEEP)
+		format_decode(&deep, arena.img, (const uint8_t*)src, w, h);
+	else
+		memcpy(arena.img, src, (size_t)w * h * sizeof(uint32_t));
+	for (i = 0; i < n; ++i)
+		f[i].def->function(arena.img, w, h, f[i].param, &arena);
+	if (path == PATH_DEEP)
+		format_encode(&deep, (uint8_t*)out, arena.img, w, h);
+	else
+		memcpy(out, arena.img, (size_t)w * h * sizeof(uint32_t));
+	frame_free(arena_finish(&arena), (size_t)w * h * sizeof(uint32_t));
+	return out;
+}
+
+/* the largest difference of a channel, in units of the path's depth */
+static int
+maxdiff(const uint32_t *a, const uint32_t *b, size_t n, int path) {
+	int bits = path == PATH_DEEP ? 10 : 8;
+	int mask = (1 << bits) - 1;
+	int c, d, max = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+	for (c = 0; c < 3; ++c) {
+		d = abs((int)(a[i] >> c * bits & mask) - (int)(b[i] >> c * bits & mask));
+		max = d > max ? d : max;
+	}
+	return max;
+}
+
+static void
+fail(const char *name, const char *fmt, ...) {
+	va_list ap;
+	fprintf(stderr, "FAIL %s: ", name);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	++failed;
+}
+
+/* golden frames are binary PPM, with 16-bit samples for deep ones */
+static void
+golden_path(char *path, size_t len, const char *name) {
+	snprintf(path, len, "golden/%s.ppm", name);
+}
+
+static void
+golden_write(const char *name, const uint32_t *img, int w, int h, int path) {
+	int bits = path == PATH_DEEP ? 10 : 8;
+	int mask = (1 << bits) - 1;
+	char file[PATH_MAX];
+	size_t i;
+	int c;
+	FILE *fp;
+
+	golden_path(file, sizeof(file), name);
+	if (!(fp = fopen(file, "wb")))
+		err(1, "fopen %s", file);
+	fprintf(fp, "P6\n%d %d\n%d\n", w, h, mask);
+	for (i = 0; i < (size_t)w * h; ++i)
+	for (c = 2; c >= 0; --c) {
+		int v = img[i] >> c * bits & mask;
+		if (bits > 8)
+			fputc(v >> 8, fp);
+		fputc(v & 0xFF, fp);
+	}
+	if (fclose(fp))
+		err(1, "fclose %s", file);
+}
+
+/* the golden frame in the layout of img, or NULL */
+static uint32_t *
+golden_read(const char *name, int w, int h, int path) {
+	int bits = path == PATH_DEEP ? 10 : 8;
+	char file[PATH_MAX];
+	uint32_t *img;
+	int gw, gh, max, c, v;
+	size_t i;
+	FILE *fp;
+
+	golden_path(file, sizeof(file), name);
+	if (!(fp = fopen(file, "rb")))
+		return NULL;
+	if (fscanf(fp, "P6 %d %d %d", &gw, &gh, &max) != 3 || fgetc(fp) == EOF
+	 || gw != w || gh != h || max != (1 << bits) - 1) {
+		fclose(fp);
+		return NULL;
+	}
+	img = calloc((size_t)w * h, sizeof(uint32_t));
+	if (!img)
+		err(1, "calloc");
+	for (i = 0; i < (size_t)w * h; ++i)
+	for (c = 2; c >= 0; --c) {
+		v = fgetc(fp);
+		if (bits > 8)
+			v = v << 8 | fgetc(fp);
+		img[i] |= (uint32_t)(v & ((1 << bits) - 1)) << c * bits;
+	}
+	if (ferror(fp) || feof(fp)) {
+		free(img);
+		img = NULL;
+	}
+	fclose(fp);
+	return img;
+}
+
+/* every variant of the plan, against the default one */
+static void
+check_variants(const struct case_t *t, int n, const uint32_t *src, const uint32_t *out) {
+	static const int tiles[] = { 0, 16, 40 };
+	struct conv_plan_t p;
+	size_t i;
+
+	for (p.simd = CONV_SCALAR; p.simd <= conv_simd_max(); ++p.simd)
+	for (i = 0; i < LENGTH(tiles); ++i)
+	for (p.walk = WALK_BLOCKS; p.walk <= WALK_ROWS; ++p.walk)
+	for (p.noise = NOISE_DIV; p.noise <= NOISE_LUT; ++p.noise) {
+		uint32_t *v;
+		p.tile = tiles[i];
+		conv_set_plan(&p);
+		v = run(t->f, n, src, CHECK_W, CHECK_H, t->path, true);
+		if (memcmp(v, out, (size_t)CHECK_W * CHECK_H * sizeof(uint32_t))) {
+			fail(t->name, "simd=%s tile=%d walk=%d noise=%d differs from the default plan",
+			     conv_simd_name[p.simd], p.tile, p.walk, p.noise);
+			free(v);
+			return;
+		}
+		free(v);
+	}
+}
+
+/* in strips of the frame with their halo, as capture_strips runs it */
+static void
+check_strips(const struct case_t *t, int n, const uint32_t *src, const uint32_t *out) {
+	struct filter_t f[MAXSTAGES];
+	int w = CHECK_W, h = CHECK_H;
+	int halo, align, rows, y, m;
+
+	memcpy(f, t->f, n * sizeof(*f));
+	m = plan_filters(f, n);
+	if (t->path == PATH_DEEP || t->random || (halo = strip_halo(f, m, &align)) < 0)
+		return;
+	rows = ROUNDUP(STRIP_ROWS_CHECK, align);
+	for (y = 0; y < h; y += rows) {
+		int top = y - halo > 0 ? y - halo : 0;
+		int bot = y + rows + halo < h ? y + rows + halo : h;
+		int k = rows < h - y ? rows : h - y;
+		uint32_t *s = run(f, m, src + (size_t)top * w, w, bot - top, t->path, false);
+		if (memcmp(s + (size_t)(y - top) * w, out + (size_t)y * w, (size_t)k * w * sizeof(uint32_t))) {
+			fail(t->name, "strip at row %d (halo %d) differs from the whole frame", y, halo);
+			free(s);
+			return;
+		}
+		free(s);
+	}
+}
+
+/* noise moves each channel by less than its level */
+static void
+check_random(const struct case_t *t, const uint32_t *src, const uint32_t *out) {
+	int level = t->f[0].param.u, d;
+	if (t->path == PATH_DEEP)
+		level *= 4;
+	if ((d = maxdiff(src, out, (size_t)CHECK_W * CHECK_H, t->path)) >= level)
+		fail(t->name, "moved a channel by %d, level %d", d, level);
+}
+
+static void
+check_case(const struct case_t *t, const uint32_t *src) {
+	struct conv_plan_t plan = { conv_simd_max(), 0, WALK_BLOCKS, NOISE_DIV };
+	struct filter_t f[MAXSTAGES];
+	size_t len = (size_t)CHECK_W * CHECK_H;
+	uint32_t *out, *ref, *gold;
+	int n = nstages(t->f);
+	int failures = failed;
+	int m, d;
+
+	conf.linear = t->path == PATH_LINEAR;
+	conv_set_plan(&plan);
+	out = run(t->f, n, src, CHECK_W, CHECK_H, t->path, true);
+
+	memcpy(f, t->f, n * sizeof(*f));
+	if (t->planned && (m = plan_filters(f, n)) != t->planned)
+		fail(t->name, "planned to %d stages, not %d", m, t->planned);
+
+	if (t->random) {
+		check_random(t, src, out);
+	} else if (update) {
+		golden_write(t->name, out, CHECK_W, CHECK_H, t->path);
+	} else if (!(gold = golden_read(t->name, CHECK_W, CHECK_H, t->path))) {
+		fail(t->name, "no golden frame of %dx%d, see make golden", CHECK_W, CHECK_H);
+	} else {
+		if ((d = maxdiff(out, gold, len, t->path)))
+			fail(t->name, "differs from its golden frame by up to %d", d);
+		free(gold);
+	}
+
+	if (t->tol >= 0) {
+		memcpy(f, t->f, n * sizeof(*f));
+		ref = run_stages(f, n, src, CHECK_W, CHECK_H, t->path);
+		if ((d = maxdiff(out, ref, len, t->path)) > t->tol)
+			fail(t->name, "differs from its stages by %d, more than %d", d, t->tol);
+		free(ref);
+	}
+
+	check_variants(t, n, src, out);
+	conv_set_plan(&plan);
+	check_strips(t, n, src, out);
+	free(out);
+
+	printf("%-4s %s\n", failed > failures ? "FAIL" : "ok", t->name);
+}
+
+/*
+ * What render_root gets from the server for one blur: pixman's
+ * convolution fetch, as in bits_image_fetch_pixel_convolution, run
+ * once across and once down. The taps are the 16.16 ones render_root
+ * sends, each channel's sum is rounded off at 16 bits and clipped,
+ * and pixels outside the picture are transparent black.
+ */
+static void
+render_pass(uint32_t *dst, const uint32_t *src, int w, int h,
+            const int32_t *tap, int klen, bool down) {
+	int rad = klen / 2;
+	int x, y, k, c;
+
+	for (y = 0; y < h; ++y)
+	for (x = 0; x < w; ++x) {
+		int64_t sum[3] = { 0, 0, 0 };
+		uint32_t px = 0;
+		for (k = 0; k < klen; ++k) {
+			int sx = down ? x : x - rad + k;
+			int sy = down ? y - rad + k : y;
+			if (sx < 0 || sx >= w || sy < 0 || sy >= h)
+				continue;
+			for (c = 0; c < 3; ++c)
+				sum[c] += (int64_t)(src[sy * w + sx] >> c * 8 & 0xFF) * tap[k];
+		}
+		for (c = 0; c < 3; ++c) {
+			int64_t v = (sum[c] + 0x8000) >> 16;
+			px |= (uint32_t)(v < 0 ? 0 : v > 0xFF ? 0xFF : v) << c * 8;
+		}
+		dst[y * w + x] = px;
+	}
+}
+
+static uint32_t *
+render_model(const uint32_t *src, int w, int h, unsigned rad) {
+	double wt[2 * CONV_MAXRAD + 1];
+	int32_t tap[2 * CONV_MAXRAD + 1];
+	uint32_t *out, *tmp;
+	int k, klen = gaussian_weights(wt, rad);
+
+	for (k = 0; k < klen; ++k)
+		tap[k] = wt[k] * 65536 + 0.5;
+	out = malloc((size_t)w * h * sizeof(uint32_t));
+	tmp = malloc((size_t)w * h * sizeof(uint32_t));
+	if (!out || !tmp)
+		err(1, "malloc");
+	render_pass(tmp, src, w, h, tap, klen, false);
+	render_pass(out, tmp, w, h, tap, klen, true);
+	free(tmp);
+	return out;
+}
+
+/*
+ * --render against filter_gaussian: the server rounds to 8 bits after
+ * each pass and its taps to 16 bits, so it may be RENDER_TOL levels
+ * off; both weigh the edges down the same way.
+ */
+static void
+check_render(unsigned rad, const uint32_t *src) {
+	struct filter_t f = F(gaussian, .u = rad);
+	uint32_t *out, *model;
+	int d;
+
+	out = run(&f, 1, src, CHECK_W, CHECK_H, PATH_XRGB, false);
+	model = render_model(src, CHECK_W, CHECK_H, rad);
+	if ((d = maxdiff(out, model, (size_t)CHECK_W * CHECK_H, PATH_XRGB)) > RENDER_TOL)
+		fail("render", "gaussian %u differs from RENDER's by %d, more than %d",
+		     rad, d, RENDER_TOL);
+	printf("%-4s render-gaussian-%u\n", d > RENDER_TOL ? "FAIL" : "ok", rad);
+	free(out);
+	free(model);
+}
+
+/* the best of a few runs, against the budget times scale; a deep
+ * frame's conversions to and from the planes count as well */
+static void
+check_budget(const struct budget_t *b, const uint32_t *src, double scale) {
+	struct conv_plan_t plan = { conv_simd_max(), 0, WALK_BLOCKS, NOISE_DIV };
+	size_t len = (size_t)BENCH_W * BENCH_H;
+	struct arena_t arena;
+	uint64_t t, best = UINT64_MAX;
+	double ns;
+	int i, n = nstages(b->f);
+
+	conf.linear = b->path == PATH_LINEAR;
+	conv_set_plan(&plan);
+	arena_init(&arena, BENCH_W, BENCH_H, b->f, n);
+	if (b->path == PATH_DEEP)
+		arena_planes(&arena);
+	for (i = 0; i < BENCH_RUNS; ++i) {
+		memcpy(arena.img, src, len * sizeof(uint32_t));
+		t = now_us();
+		if (b->path == PATH_DEEP) {
+			format_decode16(&deep, arena.plane, (const uint8_t*)arena.img, BENCH_W, BENCH_H);
+			apply_planar(&arena, b->f, n);
+			format_encode16(&deep, arena.img, arena.plane, BENCH_W, BENCH_H);
+		} else {
+			apply_filters(&arena, b->f, n);
+		}
+		t = now_us() - t;
+		best = t < best ? t : best;
+	}
+	frame_free(arena_finish(&arena), len * sizeof(uint32_t));
+
+	ns = best * 1000.0 / len / n;
+	printf("%-4s %-20s %6.2f ns/pixel, budget %6.2f\n",
+	       ns > b->ns * scale ? "FAIL" : "ok", b->name, ns, b->ns * scale);
+	if (ns > b->ns * scale)
+		++failed;
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "usage: %s [-u] [-b scale]\n", program_invocation_name);
+	fprintf(stderr, "\t-u       : rewrite the golden frames\n");
+	fprintf(stderr, "\t-b scale : multiply the time budgets by scale\n");
+	fprintf(stderr, "\t           default: 1\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv) {
+	double scale = 1;
+	uint32_t *src, *deepsrc, *bench, *deepbench;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ub:")) != -1) {
+		switch (opt) {
+		case 'u':
+			update = true;
+			break;
+		case 'b':
+			if ((scale = atof(optarg)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	linear_init();
+	format_init(&deep, 30, 32, 32, false, 0x3FF00000, 0xFFC00, 0x3FF);
+	src = malloc((size_t)CHECK_W * CHECK_H * sizeof(uint32_t));
+	deepsrc = malloc((size_t)CHECK_W * CHECK_H * sizeof(uint32_t));
+	bench = malloc((size_t)BENCH_W * BENCH_H * sizeof(uint32_t));
+	deepbench = malloc((size_t)BENCH_W * BENCH_H * sizeof(uint32_t));
+	if (!src || !deepsrc || !bench || !deepbench)
+		err(1, "malloc");
+	synth(src, CHECK_W, CHECK_H, PATH_XRGB);
+	synth(deepsrc, CHECK_W, CHECK_H, PATH_DEEP);
+	synth(bench, BENCH_W, BENCH_H, PATH_XRGB);
+	synth(deepbench, BENCH_W, BENCH_H, PATH_DEEP);
+
+	for (i = 0; i < LENGTH(cases); ++i)
+		check_case(&cases[i], cases[i].path == PATH_DEEP ? deepsrc : src);
+	for (i = 0; i < LENGTH(render_radii); ++i)
+		check_render(render_radii[i], src);
+	for (i = 0; i < LENGTH(budgets) && !update; ++i)
+		check_budget(&budgets[i], budgets[i].path == PATH_DEEP ? deepbench : bench, scale);
+
+	free(src);
+	free(deepsrc);
+	free(bench);
+	free(deepbench);
+	if (failed)
+		errx(1, "%d check(s) failed", failed);
+	return 0;
+}
@@ -11,7 +11,18 @@ static const int default_border = 5;
 static const char default_logfile[] = "";
 static const char default_hash[] = "";
 
-#define FILTER(name, param) { filter_##name, filter_check_##name, { param } }
+#define FILTER(name, param) { &filterdef_##name, { param } }
+/*
+ * A kernel stage points to its kernel, for example:
+ *
+ * static const struct kernel_t sharpen = {
+ * 	.w = 3, .h = 3,
+ * 	.tap = { 0, -1, 0, -1, 5, -1, 0, -1, 0 },
+ * };
+ *
+ * and FILTER(kernel, .k = &sharpen) in the chain below. Likewise a
+ * colour matrix, such as FILTER(matrix, .m = &matrix_sepia).
+ */
 static const struct filter_t default_filters[] = {
 	FILTER(pixelate, 2),
 	FILTER(noise, 0x10),
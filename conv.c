@@ -0,0 +1,873 @@
+/*
+ * Copyright © 2017 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "xbluck.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONV_X86
+#endif
+
+/*
+ * Separable convolution of XRGB frames. A kernel of integer taps and a
+ * divisor is turned into fixed-point weights, rounded up, so that each
+ * output is a sum of products and a shift. The shift is as large as
+ * the 32-bit sums allow, which keeps the result within one of the
+ * exact quotient. Taps that fall outside the frame are skipped.
+ *
+ * The 16 variants do the same on one 16-bit channel plane, for the
+ * spatial runs of apply_filters, with a smaller shift for the wider
+ * values. The 15 variants work on 15-bit planes, converted by table a
+ * row at a time from and to XRGB, see conv_rows_lut: with values and
+ * weights both below 2^15, the SIMD code multiplies and adds two taps
+ * at once with a 16-bit multiply-add. From radius 9 up, that makes a
+ * blur in linear light no dearer than one on sRGB codes; below, the
+ * table lookups, a fixed cost per pixel, still add 15-30%.
+ *
+ * The matrix variants apply an affine colour matrix to every pixel,
+ * with coefficients in 16-bit fixed point, MATRIX_SHIFT bits of
+ * fraction. The offset column is the weight of a constant 256 lane
+ * next to blue, so that the SIMD code gets each channel from two
+ * 16-bit multiply-adds.
+ *
+ * Every variant does the same integer arithmetic and gives the same
+ * output. The widest one the CPU supports is picked on first use,
+ * unless conv_set_plan picked one; XBLUCK_NOSIMD in the environment
+ * forces the scalar code. The plan also sets the width of the column
+ * tiles that the vertical passes walk, all rows of one tile before the
+ * next, so that the rows under the kernel can stay in cache. Its other
+ * members are for filter.c, which reads them with conv_get_plan.
+ */
+
+#define CONV_STRIP 128 /* columns per strip of the scalar vertical pass */
+#define MATRIX_SHIFT 12
+
+static void
+init_weights(struct conv_t *conv, const uint32_t *kern, int klen, uint32_t div, uint32_t max,
+             uint32_t wmax) {
+	uint64_t sum;
+	uint32_t top;
+	int i;
+
+	conv->rad = klen / 2;
+	for (conv->shift = 24; conv->shift > 0; --conv->shift) {
+		for (sum = 0, top = 0, i = 0; i < klen; ++i) {
+			conv->wt[i] = (((uint64_t)kern[i] << conv->shift) + div - 1) / div;
+			sum += conv->wt[i];
+			top = conv->wt[i] > top ? conv->wt[i] : top;
+		}
+		if (sum * max <= INT32_MAX && top <= wmax)
+			break;
+	}
+	DEBUG(2, "klen=%d div=%u max=%u shift=%d", klen, div, max, conv->shift);
+}
+
+void
+conv_init(struct conv_t *conv, const uint32_t *kern, int klen, uint32_t div) {
+	init_weights(conv, kern, klen, div, 0xFF, UINT32_MAX);
+}
+
+void
+conv_init16(struct conv_t *conv, const uint32_t *kern, int klen, uint32_t div) {
+	init_weights(conv, kern, klen, div, 0xFFFF, UINT32_MAX);
+}
+
+void
+conv_init15(struct conv_t *conv, const uint32_t *kern, int klen, uint32_t div) {
+	init_weights(conv, kern, klen, div, 0x7FFF, 0x7FFF);
+}
+
+static inline uint32_t
+pack(uint32_t r, uint32_t g, uint32_t b, int shift) {
+	r >>= shift;
+	g >>= shift;
+	b >>= shift;
+	return (r > 0xFF ? 0xFF : r) << 16 | (g > 0xFF ? 0xFF : g) << 8 | (b > 0xFF ? 0xFF : b);
+}
+
+/* horizontal taps for dst[x0..x1), with bounds checks */
+static void
+rows_scalar(uint32_t *dst, const uint32_t *row, int w, int x0, int x1, const struct conv_t *conv) {
+	int x, i, klen = 2 * conv->rad + 1;
+	for (x = x0; x < x1; ++x) {
+		uint32_t r = 0, g = 0, b = 0;
+		int i0 = conv->rad - x > 0 ? conv->rad - x : 0;
+		int i1 = w - x + conv->rad < klen ? w - x + conv->rad : klen;
+		for (i = i0; i < i1; ++i) {
+			uint32_t pix = row[x - conv->rad + i];
+			r += (pix >> 16 & 0xFF) * conv->wt[i];
+			g += (pix >>  8 & 0xFF) * conv->wt[i];
+			b += (pix >>  0 & 0xFF) * conv->wt[i];
+		}
+		dst[x] = pack(r, g, b, conv->shift);
+	}
+}
+
+static void
+cols_scalar(uint32_t *dst, const uint32_t *const *rows, const uint32_t *wt, int n, int x0, int x1, int shift) {
+	uint32_t sr[CONV_STRIP], sg[CONV_STRIP], sb[CONV_STRIP];
+	int x, s, i;
+
+	for (s = x0; s < x1; s += CONV_STRIP) {
+		int sw = x1 - s < CONV_STRIP ? x1 - s : CONV_STRIP;
+		for (x = 0; x < sw; ++x)
+			sr[x] = sg[x] = sb[x] = 0;
+		for (i = 0; i < n; ++i) {
+			const uint32_t *row = rows[i] + s;
+			for (x = 0; x < sw; ++x) {
+				sr[x] += (row[x] >> 16 & 0xFF) * wt[i];
+				sg[x] += (row[x] >>  8 & 0xFF) * wt[i];
+				sb[x] += (row[x] >>  0 & 0xFF) * wt[i];
+			}
+		}
+		for (x = 0; x < sw; ++x)
+			dst[s + x] = pack(sr[x], sg[x], sb[x], shift);
+	}
+}
+
+static void
+rows16_scalar(uint16_t *dst, const uint16_t *row, int w, int x0, int x1, const struct conv_t *conv) {
+	int x, i, klen = 2 * conv->rad + 1;
+	for (x = x0; x < x1; ++x) {
+		uint32_t v = 0;
+		int i0 = conv->rad - x > 0 ? conv->rad - x : 0;
+		int i1 = w - x + conv->rad < klen ? w - x + conv->rad : klen;
+		for (i = i0; i < i1; ++i)
+			v += row[x - conv->rad + i] * conv->wt[i];
+		v >>= conv->shift;
+		dst[x] = v > 0xFFFF ? 0xFFFF : v;
+	}
+}
+
+static void
+cols16_scalar(uint16_t *dst, const uint16_t *const *rows, const uint32_t *wt, int n, int x0, int x1, int shift) {
+	uint32_t sv[CONV_STRIP];
+	int x, s, i;
+
+	for (s = x0; s < x1; s += CONV_STRIP) {
+		int sw = x1 - s < CONV_STRIP ? x1 - s : CONV_STRIP;
+		for (x = 0; x < sw; ++x)
+			sv[x] = 0;
+		for (i = 0; i < n; ++i) {
+			const uint16_t *row = rows[i] + s;
+			for (x = 0; x < sw; ++x)
+				sv[x] += row[x] * wt[i];
+		}
+		for (x = 0; x < sw; ++x) {
+			uint32_t v = sv[x] >> shift;
+			dst[s + x] = v > 0xFFFF ? 0xFFFF : v;
+		}
+	}
+}
+
+static void
+rows15_scalar(uint16_t *dst, const uint16_t *row, int w, int x0, int x1, const struct conv_t *conv) {
+	int x, i, klen = 2 * conv->rad + 1;
+	for (x = x0; x < x1; ++x) {
+		uint32_t v = 0;
+		int i0 = conv->rad - x > 0 ? conv->rad - x : 0;
+		int i1 = w - x + conv->rad < klen ? w - x + conv->rad : klen;
+		for (i = i0; i < i1; ++i)
+			v += row[x - conv->rad + i] * conv->wt[i];
+		v >>= conv->shift;
+		dst[x] = v > 0x7FFF ? 0x7FFF : v;
+	}
+}
+
+static void
+cols15_scalar(uint16_t *dst, const uint16_t *const *rows, const uint32_t *wt, int n, int x0, int x1, int shift) {
+	int x, i;
+	for (x = x0; x < x1; ++x) {
+		uint32_t v = 0;
+		for (i = 0; i < n; ++i)
+			v += rows[i][x] * wt[i];
+		v >>= shift;
+		dst[x] = v > 0x7FFF ? 0x7FFF : v;
+	}
+}
+
+static inline uint32_t
+matrix_chan(int32_t r, int32_t g, int32_t b, const int16_t *wt) {
+	int32_t v = (r * wt[0] + g * wt[1] + b * wt[2] + 256 * wt[3]) >> MATRIX_SHIFT;
+	return v < 0 ? 0 : v > 0xFF ? 0xFF : v;
+}
+
+static void
+matrix_scalar(uint32_t *img, size_t i, size_t n, int16_t (*wt)[4]) {
+	for (; i < n; ++i) {
+		int32_t r = (img[i] >> 16) & 0xFF;
+		int32_t g = (img[i] >> 8) & 0xFF;
+		int32_t b = img[i] & 0xFF;
+		img[i] = matrix_chan(r, g, b, wt[0]) << 16
+		       | matrix_chan(r, g, b, wt[1]) << 8
+		       | matrix_chan(r, g, b, wt[2]);
+	}
+}
+
+#ifdef CONV_X86
+/* 32-bit lane multiply, which SSE2 only has for even lanes */
+__attribute__((target("sse2")))
+static inline __m128i
+mul32_sse2(__m128i a, __m128i b) {
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+	                          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i
+pack_sse2(__m128i r, __m128i g, __m128i b, __m128i shift) {
+	__m128i max = _mm_set1_epi32(0xFF);
+	__m128i m;
+	r = _mm_srl_epi32(r, shift);
+	g = _mm_srl_epi32(g, shift);
+	b = _mm_srl_epi32(b, shift);
+	m = _mm_cmpgt_epi32(r, max);
+	r = _mm_or_si128(_mm_andnot_si128(m, r), _mm_and_si128(m, max));
+	m = _mm_cmpgt_epi32(g, max);
+	g = _mm_or_si128(_mm_andnot_si128(m, g), _mm_and_si128(m, max));
+	m = _mm_cmpgt_epi32(b, max);
+	b = _mm_or_si128(_mm_andnot_si128(m, b), _mm_and_si128(m, max));
+	return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8)), b);
+}
+
+#define ACCUM_SSE2(pix, wt) do { \
+	__m128i _p = (pix), _w = (wt); \
+	r = _mm_add_epi32(r, mul32_sse2(_mm_and_si128(_mm_srli_epi32(_p, 16), ff), _w)); \
+	g = _mm_add_epi32(g, mul32_sse2(_mm_and_si128(_mm_srli_epi32(_p, 8), ff), _w)); \
+	b = _mm_add_epi32(b, mul32_sse2(_mm_and_si128(_p, ff), _w)); \
+} while (0)
+
+__attribute__((target("sse2")))
+static int
+rows_sse2(uint32_t *dst, const uint32_t *row, int x0, int x1, const struct conv_t *conv) {
+	__m128i ff = _mm_set1_epi32(0xFF);
+	__m128i shift = _mm_cvtsi32_si128(conv->shift);
+	int x, i, klen = 2 * conv->rad + 1;
+	for (x = x0; x + 4 <= x1; x += 4) {
+		__m128i r = _mm_setzero_si128(), g = r, b = r;
+		const uint32_t *p = row + x - conv->rad;
+		for (i = 0; i < klen; ++i)
+			ACCUM_SSE2(_mm_loadu_si128((const __m128i*)(p + i)), _mm_set1_epi32(conv->wt[i]));
+		_mm_storeu_si128((__m128i*)(dst + x), pack_sse2(r, g, b, shift));
+	}
+	return x;
+}
+
+__attribute__((target("sse2")))
+static int
+cols_sse2(uint32_t *dst, const uint32_t *const *rows, const uint32_t *wt, int n, int x1, int s) {
+	__m128i ff = _mm_set1_epi32(0xFF);
+	__m128i shift = _mm_cvtsi32_si128(s);
+	int x, i;
+	for (x = 0; x + 4 <= x1; x += 4) {
+		__m128i r = _mm_setzero_si128(), g = r, b = r;
+		for (i = 0; i < n; ++i)
+			ACCUM_SSE2(_mm_loadu_si128((const __m128i*)(rows[i] + x)), _mm_set1_epi32(wt[i]));
+		_mm_storeu_si128((__m128i*)(dst + x), pack_sse2(r, g, b, shift));
+	}
+	return x;
+}
+
+/* four 16-bit values widened to 32-bit lanes */
+__attribute__((target("sse2")))
+static inline __m128i
+load16_sse2(const uint16_t *p) {
+	return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+}
+
+/* clamped to 16 bits and stored; SSE2 only packs with signed saturation */
+__attribute__((target("sse2")))
+static inline void
+store16_sse2(uint16_t *p, __m128i v, __m128i shift) {
+	__m128i max = _mm_set1_epi32(0xFFFF);
+	__m128i bias = _mm_set1_epi32(0x8000);
+	__m128i m;
+	v = _mm_srl_epi32(v, shift);
+	m = _mm_cmpgt_epi32(v, max);
+	v = _mm_or_si128(_mm_andnot_si128(m, v), _mm_and_si128(m, max));
+	v = _mm_packs_epi32(_mm_sub_epi32(v, bias), _mm_sub_epi32(v, bias));
+	_mm_storel_epi64((__m128i*)p, _mm_add_epi16(v, _mm_set1_epi16(-0x8000)));
+}
+
+__attribute__((target("sse2")))
+static int
+rows16_sse2(uint16_t *dst, const uint16_t *row, int x0, int x1, const struct conv_t *conv) {
+	__m128i shift = _mm_cvtsi32_si128(conv->shift);
+	int x, i, klen = 2 * conv->rad + 1;
+	for (x = x0; x + 4 <= x1; x += 4) {
+		__m128i v = _mm_setzero_si128();
+		const uint16_t *p = row + x - conv->rad;
+		for (i = 0; i < klen; ++i)
+			v = _mm_add_epi32(v, mul32_sse2(load16_sse2(p + i), _mm_set1_epi32(conv->wt[i])));
+		store16_sse2(dst + x, v, shift);
+	}
+	return x;
+}
+
+__attribute__((target("sse2")))
+static int
+cols16_sse2(uint16_t *dst, const uint16_t *const *rows, const uint32_t *wt, int n, int x1, int s) {
+	__m128i shift = _mm_cvtsi32_si128(s);
+	int x, i;
+	for (x = 0; x + 4 <= x1; x += 4) {
+		__m128i v = _mm_setzero_si128();
+		for (i = 0; i < n; ++i)
+			v = _mm_add_epi32(v, mul32_sse2(load16_sse2(rows[i] + x), _mm_set1_epi32(wt[i])));
+		store16_sse2(dst + x, v, shift);
+	}
+	return x;
+}
+
+/*
+ * Taps i and i + 1 of eight 15-bit values: interleaved, so that each
+ * 32-bit lane of the multiply-add is the sum of the two products. The
+ * signed pack clamps to 0x7FFF.
+ */
+__attribute__((target("sse2")))
+static int
+rows15_sse2(uint16_t *dst, const uint16_t *row, int x0, int x1, const struct conv_t *conv) {
+	__m128i shift = _mm_cvtsi32_si128(conv->shift);
+	__m128i zero = _mm_setzero_si128();
+	int x, i, klen = 2 * conv->rad + 1;
+	for (x = x0; x + 8 <= x1; x += 8) {
+		__m128i lo = zero, hi = zero;
+		const uint16_t *p = row + x - conv->rad;
+		for (i = 0; i < klen; i += 2) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+			__m128i b = i + 1 < klen ? _mm_loadu_si128((const __m128i*)(p + i + 1)) : zero;
+			__m128i wt = _mm_set1_epi32(conv->wt[i] | (i + 1 < klen ? conv->wt[i + 1] << 16 : 0));
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wt));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wt));
+		}
+		_mm_storeu_si128((__m128i*)(dst + x),
+		                 _mm_packs_epi32(_mm_srl_epi32(lo, shift), _mm_srl_epi32(hi, shift)));
+	}
+	return x;
+}
+
+__attribute__((target("sse2")))
+static int
+cols15_sse2(uint16_t *dst, const uint16_t *const *rows, const uint32_t *wt, int n, int x1, int s) {
+	__m128i shift = _mm_cvtsi32_si128(s);
+	__m128i zero = _mm_setzero_si128();
+	int x, i;
+	for (x = 0; x + 8 <= x1; x += 8) {
+		__m128i lo = zero, hi = zero;
+		for (i = 0; i < n; i += 2) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(rows[i] + x));
+			__m128i b = i + 1 < n ? _mm_loadu_si128((const __m128i*)(rows[i + 1] + x)) : zero;
+			__m128i w = _mm_set1_epi32(wt[i] | (i + 1 < n ? wt[i + 1] << 16 : 0));
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+		}
+		_mm_storeu_si128((__m128i*)(dst + x),
+		                 _mm_packs_epi32(_mm_srl_epi32(lo, shift), _mm_srl_epi32(hi, shift)));
+	}
+	return x;
+}
+
+/* a channel of eight pixels, from their (r, g) and (b, 256) pairs */
+__attribute__((target("sse2")))
+static inline __m128i
+matrix_chan_sse2(__m128i rg0, __m128i rg1, __m128i bo0, __m128i bo1, __m128i wrg, __m128i wbo) {
+	__m128i v0 = _mm_add_epi32(_mm_madd_epi16(rg0, wrg), _mm_madd_epi16(bo0, wbo));
+	__m128i v1 = _mm_add_epi32(_mm_madd_epi16(rg1, wrg), _mm_madd_epi16(bo1, wbo));
+	v0 = _mm_packs_epi32(_mm_srai_epi32(v0, MATRIX_SHIFT), _mm_srai_epi32(v1, MATRIX_SHIFT));
+	return _mm_min_epi16(_mm_max_epi16(v0, _mm_setzero_si128()), _mm_set1_epi16(0xFF));
+}
+
+__attribute__((target("sse2")))
+static size_t
+matrix_sse2(uint32_t *img, size_t n, int16_t (*wt)[4]) {
+	__m128i ff = _mm_set1_epi32(0xFF), one = _mm_set1_epi16(256);
+	__m128i wrg[3], wbo[3];
+	size_t i;
+	int c;
+
+	for (c = 0; c < 3; ++c) {
+		wrg[c] = _mm_set1_epi32((uint16_t)wt[c][0] | (uint32_t)(uint16_t)wt[c][1] << 16);
+		wbo[c] = _mm_set1_epi32((uint16_t)wt[c][2] | (uint32_t)(uint16_t)wt[c][3] << 16);
+	}
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i p0 = _mm_loadu_si128((const __m128i*)(img + i));
+		__m128i p1 = _mm_loadu_si128((const __m128i*)(img + i + 4));
+		__m128i r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), ff),
+		                            _mm_and_si128(_mm_srli_epi32(p1, 16), ff));
+		__m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), ff),
+		                            _mm_and_si128(_mm_srli_epi32(p1, 8), ff));
+		__m128i b = _mm_packs_epi32(_mm_and_si128(p0, ff), _mm_and_si128(p1, ff));
+		__m128i rg0 = _mm_unpacklo_epi16(r, g), rg1 = _mm_unpackhi_epi16(r, g);
+		__m128i bo0 = _mm_unpacklo_epi16(b, one), bo1 = _mm_unpackhi_epi16(b, one);
+
+		r = matrix_chan_sse2(rg0, rg1, bo0, bo1, wrg[0], wbo[0]);
+		g = matrix_chan_sse2(rg0, rg1, bo0, bo1, wrg[1], wbo[1]);
+		b = _mm_or_si128(matrix_chan_sse2(rg0, rg1, bo0, bo1, wrg[2], wbo[2]), _mm_slli_epi16(g, 8));
+		_mm_storeu_si128((__m128i*)(img + i), _mm_unpacklo_epi16(b, r));
+		_mm_storeu_si128((__m128i*)(img + i + 4), _mm_unpackhi_epi16(b, r));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+pack_avx2(__m256i r, __m256i g, __m256i b, __m128i shift) {
+	__m256i max = _mm256_set1_epi32(0xFF);
+	r = _mm256_min_epu32(_mm256_srl_epi32(r, shift), max);
+	g = _mm256_min_epu32(_mm256_srl_epi32(g, shift), max);
+	b = _mm256_min_epu32(_mm256_srl_epi32(b, shift), max);
+	return _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_slli_epi32(g, 8)), b);
+}
+
+#define ACCUM_AVX2(pix, wt) do { \
+	__m256i _p = (pix), _w = (wt); \
+	r = _mm256_add_epi32(r, _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(_p, 16), ff), _w)); \
+	g = _mm256_add_epi32(g, _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(_p, 8), ff), _w)); \
+	b = _mm256_add_epi32(b, _mm256_mullo_epi32(_mm256_and_si256(_p, ff), _w)); \
+} while (0)
+
+__attribute__((target("avx2")))
+static int
+rows_avx2(uint32_t *dst, const uint32_t *row, int x0, int x1, const struct conv_t *conv) {
+	__m256i ff = _mm256_set1_epi32(0xFF);
+	__m128i shift = _mm_cvtsi32_si128(conv->shift);
+	int x, i, klen = 2 * conv->rad + 1;
+	for (x = x0; x + 8 <= x1; x += 8) {
+		__m256i r = _mm256_setzero_si256(), g = r, b = r;
+		const uint32_t *p = row + x - conv->rad;
+		for (i = 0; i < klen; ++i)
+			ACCUM_AVX2(_mm256_loadu_si256((const __m256i*)(p + i)), _mm256_set1_epi32(conv->wt[i]));
+		_mm256_storeu_si256((__m256i*)(dst + x), pack_avx2(r, g, b, shift));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static int
+cols_avx2(uint32_t *dst, const uint32_t *const *rows, const uint32_t *wt, int n, int x1, int s) {
+	__m256i ff = _mm256_set1_epi32(0xFF);
+	__m128i shift = _mm_cvtsi32_si128(s);
+	int x, i;
+	for (x = 0; x + 8 <= x1; x += 8) {
+		__m256i r = _mm256_setzero_si256(), g = r, b = r;
+		for (i = 0; i < n; ++i)
+			ACCUM_AVX2(_mm256_loadu_si256((const __m256i*)(rows[i] + x)), _mm256_set1_epi32(wt[i]));
+		_mm256_storeu_si256((__m256i*)(dst + x), pack_avx2(r, g, b, shift));
+	}
+	return x;
+}
+__attribute__((target("avx2")))
+static inline __m256i
+load16_avx2(const uint16_t *p) {
+	return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p));
+}
+
+__attribute__((target("avx2")))
+static inline void
+store16_avx2(uint16_t *p, __m256i v, __m128i shift) {
+	v = _mm256_min_epu32(_mm256_srl_epi32(v, shift), _mm256_set1_epi32(0xFFFF));
+	v = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), _MM_SHUFFLE(3, 1, 2, 0));
+	_mm_storeu_si128((__m128i*)p, _mm256_castsi256_si128(v));
+}
+
+__attribute__((target("avx2")))
+static int
+rows16_avx2(uint16_t *dst, const uint16_t *row, int x0, int x1, const struct conv_t *conv) {
+	__m128i shift = _mm_cvtsi32_si128(conv->shift);
+	int x, i, klen = 2 * conv->rad + 1;
+	for (x = x0; x + 8 <= x1; x += 8) {
+		__m256i v = _mm256_setzero_si256();
+		const uint16_t *p = row + x - conv->rad;
+		for (i = 0; i < klen; ++i)
+			v = _mm256_add_epi32(v, _mm256_mullo_epi32(load16_avx2(p + i), _mm256_set1_epi32(conv->wt[i])));
+		store16_avx2(dst + x, v, shift);
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static int
+cols16_avx2(uint16_t *dst, const uint16_t *const *rows, const uint32_t *wt, int n, int x1, int s) {
+	__m128i shift = _mm_cvtsi32_si128(s);
+	int x, i;
+	for (x = 0; x + 8 <= x1; x += 8) {
+		__m256i v = _mm256_setzero_si256();
+		for (i = 0; i < n; ++i)
+			v = _mm256_add_epi32(v, _mm256_mullo_epi32(load16_avx2(rows[i] + x), _mm256_set1_epi32(wt[i])));
+		store16_avx2(dst + x, v, shift);
+	}
+	return x;
+}
+/* as rows15_sse2; unpacking within 128-bit lanes, the pack puts the
+ * sixteen values back in order */
+__attribute__((target("avx2")))
+static int
+rows15_avx2(uint16_t *dst, const uint16_t *row, int x0, int x1, const struct conv_t *conv) {
+	__m128i shift = _mm_cvtsi32_si128(conv->shift);
+	__m256i zero = _mm256_setzero_si256();
+	int x, i, klen = 2 * conv->rad + 1;
+	for (x = x0; x + 16 <= x1; x += 16) {
+		__m256i lo = zero, hi = zero;
+		const uint16_t *p = row + x - conv->rad;
+		for (i = 0; i < klen; i += 2) {
+			__m256i a = _mm256_loadu_si256((const __m256i*)(p + i));
+			__m256i b = i + 1 < klen ? _mm256_loadu_si256((const __m256i*)(p + i + 1)) : zero;
+			__m256i wt = _mm256_set1_epi32(conv->wt[i] | (i + 1 < klen ? conv->wt[i + 1] << 16 : 0));
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wt));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wt));
+		}
+		_mm256_storeu_si256((__m256i*)(dst + x),
+		                    _mm256_packs_epi32(_mm256_srl_epi32(lo, shift), _mm256_srl_epi32(hi, shift)));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static int
+cols15_avx2(uint16_t *dst, const uint16_t *const *rows, const uint32_t *wt, int n, int x1, int s) {
+	__m128i shift = _mm_cvtsi32_si128(s);
+	__m256i zero = _mm256_setzero_si256();
+	int x, i;
+	for (x = 0; x + 16 <= x1; x += 16) {
+		__m256i lo = zero, hi = zero;
+		for (i = 0; i < n; i += 2) {
+			__m256i a = _mm256_loadu_si256((const __m256i*)(rows[i] + x));
+			__m256i b = i + 1 < n ? _mm256_loadu_si256((const __m256i*)(rows[i + 1] + x)) : zero;
+			__m256i w = _mm256_set1_epi32(wt[i] | (i + 1 < n ? wt[i + 1] << 16 : 0));
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+		}
+		_mm256_storeu_si256((__m256i*)(dst + x),
+		                    _mm256_packs_epi32(_mm256_srl_epi32(lo, shift), _mm256_srl_epi32(hi, shift)));
+	}
+	return x;
+}
+
+/*
+ * As matrix_sse2, on sixteen pixels. The packs and unpacks stay within
+ * 128-bit lanes, so pixels come out in the order they went in.
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+matrix_chan_avx2(__m256i rg0, __m256i rg1, __m256i bo0, __m256i bo1, __m256i wrg, __m256i wbo) {
+	__m256i v0 = _mm256_add_epi32(_mm256_madd_epi16(rg0, wrg), _mm256_madd_epi16(bo0, wbo));
+	__m256i v1 = _mm256_add_epi32(_mm256_madd_epi16(rg1, wrg), _mm256_madd_epi16(bo1, wbo));
+	v0 = _mm256_packs_epi32(_mm256_srai_epi32(v0, MATRIX_SHIFT), _mm256_srai_epi32(v1, MATRIX_SHIFT));
+	return _mm256_min_epi16(_mm256_max_epi16(v0, _mm256_setzero_si256()), _mm256_set1_epi16(0xFF));
+}
+
+__attribute__((target("avx2")))
+static size_t
+matrix_avx2(uint32_t *img, size_t n, int16_t (*wt)[4]) {
+	__m256i ff = _mm256_set1_epi32(0xFF), one = _mm256_set1_epi16(256);
+	__m256i wrg[3], wbo[3];
+	size_t i;
+	int c;
+
+	for (c = 0; c < 3; ++c) {
+		wrg[c] = _mm256_set1_epi32((uint16_t)wt[c][0] | (uint32_t)(uint16_t)wt[c][1] << 16);
+		wbo[c] = _mm256_set1_epi32((uint16_t)wt[c][2] | (uint32_t)(uint16_t)wt[c][3] << 16);
+	}
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i p0 = _mm256_loadu_si256((const __m256i*)(img + i));
+		__m256i p1 = _mm256_loadu_si256((const __m256i*)(img + i + 8));
+		__m256i r = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 16), ff),
+		                               _mm256_and_si256(_mm256_srli_epi32(p1, 16), ff));
+		__m256i g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 8), ff),
+		                               _mm256_and_si256(_mm256_srli_epi32(p1, 8), ff));
+		__m256i b = _mm256_packs_epi32(_mm256_and_si256(p0, ff), _mm256_and_si256(p1, ff));
+		__m256i rg0 = _mm256_unpacklo_epi16(r, g), rg1 = _mm256_unpackhi_epi16(r, g);
+		__m256i bo0 = _mm256_unpacklo_epi16(b, one), bo1 = _mm256_unpackhi_epi16(b, one);
+
+		r = matrix_chan_avx2(rg0, rg1, bo0, bo1, wrg[0], wbo[0]);
+		g = matrix_chan_avx2(rg0, rg1, bo0, bo1, wrg[1], wbo[1]);
+		b = _mm256_or_si256(matrix_chan_avx2(rg0, rg1, bo0, bo1, wrg[2], wbo[2]), _mm256_slli_epi16(g, 8));
+		_mm256_storeu_si256((__m256i*)(img + i), _mm256_unpacklo_epi16(b, r));
+		_mm256_storeu_si256((__m256i*)(img + i + 8), _mm256_unpackhi_epi16(b, r));
+	}
+	return i;
+}
+#endif
+
+/*
+ * The vector variants handle whole vectors of the interior and return
+ * where they stopped; the scalar code does the rest.
+ */
+static int (*rows_simd)(uint32_t*, const uint32_t*, int, int, const struct conv_t*);
+static int (*cols_simd)(uint32_t*, const uint32_t *const*, const uint32_t*, int, int, int);
+static int (*rows16_simd)(uint16_t*, const uint16_t*, int, int, const struct conv_t*);
+static int (*cols16_simd)(uint16_t*, const uint16_t *const*, const uint32_t*, int, int, int);
+static int (*rows15_simd)(uint16_t*, const uint16_t*, int, int, const struct conv_t*);
+static int (*cols15_simd)(uint16_t*, const uint16_t *const*, const uint32_t*, int, int, int);
+static size_t (*matrix_simd)(uint32_t*, size_t, int16_t (*)[4]);
+static struct conv_plan_t plan;
+static int simd_max = -1;
+static bool selected;
+
+const char *const conv_simd_name[] = {
+	[CONV_SCALAR] = "none",
+	[CONV_SSE2] = "sse2",
+	[CONV_AVX2] = "avx2",
+};
+
+/* the widest variants the CPU has */
+int
+conv_simd_max(void) {
+	if (simd_max >= 0)
+		return simd_max;
+	simd_max = CONV_SCALAR;
+#ifdef CONV_X86
+	__builtin_cpu_init();
+	if (getenv("XBLUCK_NOSIMD"))
+		return simd_max;
+	if (__builtin_cpu_supports("avx2"))
+		simd_max = CONV_AVX2;
+	else if (__builtin_cpu_supports("sse2"))
+		simd_max = CONV_SSE2;
+#endif
+	return simd_max;
+}
+
+void
+conv_set_plan(const struct conv_plan_t *p) {
+	plan = *p;
+	if (plan.simd > conv_simd_max())
+		plan.simd = conv_simd_max();
+	selected = true;
+	rows_simd = NULL;
+	cols_simd = NULL;
+	rows16_simd = NULL;
+	cols16_simd = NULL;
+	rows15_simd = NULL;
+	cols15_simd = NULL;
+	matrix_simd = NULL;
+#ifdef CONV_X86
+	if (plan.simd == CONV_AVX2) {
+		rows_simd = rows_avx2;
+		cols_simd = cols_avx2;
+		rows16_simd = rows16_avx2;
+		cols16_simd = cols16_avx2;
+		rows15_simd = rows15_avx2;
+		cols15_simd = cols15_avx2;
+		matrix_simd = matrix_avx2;
+	} else if (plan.simd == CONV_SSE2) {
+		rows_simd = rows_sse2;
+		cols_simd = cols_sse2;
+		rows16_simd = rows16_sse2;
+		cols16_simd = cols16_sse2;
+		rows15_simd = rows15_sse2;
+		cols15_simd = cols15_sse2;
+		matrix_simd = matrix_sse2;
+	}
+#endif
+}
+
+static void
+conv_select(void) {
+	struct conv_plan_t p = { conv_simd_max(), 0, WALK_BLOCKS, NOISE_DIV };
+	conv_set_plan(&p);
+	DEBUG(1, "simd=%s", conv_simd_name[plan.simd]);
+}
+
+/* for the stages outside the core that have variants too */
+const struct conv_plan_t *
+conv_get_plan(void) {
+	if (!selected)
+		conv_select();
+	return &plan;
+}
+
+void
+conv_rows(uint32_t *dst, const uint32_t *src, int w, int h, const struct conv_t *conv) {
+	int y, rad = conv->rad;
+
+	if (!selected)
+		conv_select();
+	for (y = 0; y < h; ++y) {
+		const uint32_t *row = src + (size_t)y * w;
+		uint32_t *out = dst + (size_t)y * w;
+		int x = rad < w ? rad : w;
+		rows_scalar(out, row, w, 0, x, conv);
+		if (rows_simd && w - rad > x)
+			x = rows_simd(out, row, x, w - rad, conv);
+		rows_scalar(out, row, w, x, w, conv);
+	}
+}
+
+void
+conv_cols(uint32_t *dst, const uint32_t *src, int w, int h, const struct conv_t *conv) {
+	const uint32_t *rows[2 * CONV_MAXRAD + 1];
+	int y, i, n, x, x0, tw, klen = 2 * conv->rad + 1;
+
+	if (!selected)
+		conv_select();
+	tw = plan.tile ? plan.tile : w;
+	for (x0 = 0; x0 < w; x0 += tw) {
+		int x1 = tw < w - x0 ? tw : w - x0;
+		for (y = 0; y < h; ++y) {
+			const uint32_t *wt = conv->wt;
+			uint32_t *out = dst + (size_t)y * w + x0;
+			for (n = 0, i = 0; i < klen; ++i) {
+				int dy = y - conv->rad + i;
+				if (dy < 0)
+					++wt;
+				else if (dy < h)
+					rows[n++] = src + (size_t)dy * w + x0;
+			}
+			x = cols_simd ? cols_simd(out, rows, wt, n, x1, conv->shift) : 0;
+			for (i = 0; i < n; ++i)
+				rows[i] += x;
+			cols_scalar(out + x, rows, wt, n, 0, x1 - x, conv->shift);
+		}
+	}
+}
+
+void
+conv_rows16(uint16_t *dst, const uint16_t *src, int w, int h, const struct conv_t *conv) {
+	int y, rad = conv->rad;
+
+	if (!selected)
+		conv_select();
+	for (y = 0; y < h; ++y) {
+		const uint16_t *row = src + (size_t)y * w;
+		uint16_t *out = dst + (size_t)y * w;
+		int x = rad < w ? rad : w;
+		rows16_scalar(out, row, w, 0, x, conv);
+		if (rows16_simd && w - rad > x)
+			x = rows16_simd(out, row, x, w - rad, conv);
+		rows16_scalar(out, row, w, x, w, conv);
+	}
+}
+
+void
+conv_cols16(uint16_t *dst, const uint16_t *src, int w, int h, const struct conv_t *conv) {
+	const uint16_t *rows[2 * CONV_MAXRAD + 1];
+	int y, i, n, x, x0, tw, klen = 2 * conv->rad + 1;
+
+	if (!selected)
+		conv_select();
+	tw = plan.tile ? plan.tile : w;
+	for (x0 = 0; x0 < w; x0 += tw) {
+		int x1 = tw < w - x0 ? tw : w - x0;
+		for (y = 0; y < h; ++y) {
+			const uint32_t *wt = conv->wt;
+			uint16_t *out = dst + (size_t)y * w + x0;
+			for (n = 0, i = 0; i < klen; ++i) {
+				int dy = y - conv->rad + i;
+				if (dy < 0)
+					++wt;
+				else if (dy < h)
+					rows[n++] = src + (size_t)dy * w + x0;
+			}
+			x = cols16_simd ? cols16_simd(out, rows, wt, n, x1, conv->shift) : 0;
+			for (i = 0; i < n; ++i)
+				rows[i] += x;
+			cols16_scalar(out + x, rows, wt, n, 0, x1 - x, conv->shift);
+		}
+	}
+}
+
+/*
+ * A blur of an XRGB frame on 15-bit channels: each row is converted
+ * through lut into three channel rows in buf just before its horizontal
+ * pass, and each row of the vertical pass back through another just
+ * after it, so only the intermediate, three w×h planes in tmp, is held
+ * as planes. buf holds 3w values.
+ */
+void
+conv_rows_lut(uint16_t *tmp, const uint32_t *src, int w, int h, const struct conv_t *conv,
+              const uint16_t *lut, uint16_t *buf) {
+	size_t plane = (size_t)w * h;
+	int x, y, c, rad = conv->rad;
+
+	if (!selected)
+		conv_select();
+	for (y = 0; y < h; ++y) {
+		const uint32_t *row = src + (size_t)y * w;
+		for (x = 0; x < w; ++x) {
+			buf[x] = lut[row[x] >> 16 & 0xFF];
+			buf[w + x] = lut[row[x] >> 8 & 0xFF];
+			buf[2 * w + x] = lut[row[x] & 0xFF];
+		}
+		for (c = 0; c < 3; ++c) {
+			uint16_t *out = tmp + c * plane + (size_t)y * w;
+			const uint16_t *in = buf + c * w;
+			x = rad < w ? rad : w;
+			rows15_scalar(out, in, w, 0, x, conv);
+			if (rows15_simd && w - rad > x)
+				x = rows15_simd(out, in, x, w - rad, conv);
+			rows15_scalar(out, in, w, x, w, conv);
+		}
+	}
+}
+
+void
+conv_cols_lut(uint32_t *dst, const uint16_t *tmp, int w, int h, const struct conv_t *conv,
+              const uint8_t *lut, uint16_t *buf) {
+	const uint16_t *rows[2 * CONV_MAXRAD + 1];
+	size_t plane = (size_t)w * h;
+	int y, i, n, x, x0, tw, c, klen = 2 * conv->rad + 1;
+
+	if (!selected)
+		conv_select();
+	tw = plan.tile ? plan.tile : w;
+	for (x0 = 0; x0 < w; x0 += tw) {
+		int x1 = tw < w - x0 ? tw : w - x0;
+		for (y = 0; y < h; ++y) {
+			uint32_t *out = dst + (size_t)y * w + x0;
+			for (c = 0; c < 3; ++c) {
+				const uint32_t *wt = conv->wt;
+				uint16_t *cbuf = buf + c * x1;
+				for (n = 0, i = 0; i < klen; ++i) {
+					int dy = y - conv->rad + i;
+					if (dy < 0)
+						++wt;
+					else if (dy < h)
+						rows[n++] = tmp + c * plane + (size_t)dy * w + x0;
+				}
+				x = cols15_simd ? cols15_simd(cbuf, rows, wt, n, x1, conv->shift) : 0;
+				cols15_scalar(cbuf, rows, wt, n, x, x1, conv->shift);
+			}
+			for (x = 0; x < x1; ++x)
+				out[x] = (uint32_t)lut[buf[x]] << 16
+				       | (uint32_t)lut[buf[x1 + x]] << 8
+				       | lut[buf[2 * x1 + x]];
+		}
+	}
+}
+
+/* rounded to nearest: half a unit is added through the offset */
+void
+conv_matrix(uint32_t *img, size_t n, const struct matrix_t *mat) {
+	int16_t wt[3][4];
+	size_t i;
+	int c, k;
+
+	if (!selected)
+		conv_select();
+	for (c = 0; c < 3; ++c) {
+		for (k = 0; k < 3; ++k)
+			wt[c][k] = lround(mat->m[c][k] * (1 << MATRIX_SHIFT));
+		wt[c][3] = lround((mat->m[c][3] + 0.5) * (1 << MATRIX_SHIFT) / 256);
+	}
+	i = matrix_simd ? matrix_simd(img, n, wt) : 0;
+	matrix_scalar(img, i, n, wt);
+}
@@ -0,0 +1,77 @@
+# Generate apply_default_filters() from default_filters[] in config.h.
+#
+# Every stage is expanded with its parameter as a literal, so the
+# compiler can specialise the kernels for it. Runs of point-wise
+# filters are fused into a single pass, and into the block writes of
+# a pixelate stage directly in front of them. A kernel or matrix may be
+# only known to config.h, so its stage is passed from conf.filters,
+# which is default_filters[] as it is whenever this chain runs.
+
+function pointwise(name) {
+	return name == "invert" || name == "colourise" || name == "noise" \
+	    || name == "greyscale" || name == "null"
+}
+
+BEGIN {
+	n = 0
+}
+
+/default_filters\[\][ \t]*=[ \t]*\{/ {
+	inchain = 1
+	next
+}
+
+inchain && /^[ \t]*\}[ \t]*;/ {
+	inchain = 0
+	next
+}
+
+inchain && /FILTER[ \t]*\(/ {
+	line = $0
+	sub(/^[ \t]*FILTER[ \t]*\([ \t]*/, "", line)
+	name = line
+	sub(/[ \t]*,.*$/, "", name)
+	param = line
+	sub(/^[^,]*,[ \t]*/, "", param)
+	sub(/[ \t]*\)[ \t]*,?[ \t]*$/, "", param)
+	names[n] = name
+	params[n] = param
+	++n
+}
+
+END {
+	print "/* generated from config.h by defchain.awk */"
+	print "static void"
+	print "apply_default_filters(struct arena_t *arena) {"
+	print "\tint w = arena->w;"
+	print "\tint h = arena->h;"
+	print "\t(void)w;"
+	print "\t(void)h;"
+	print "\tDEBUG(1, \"img=%p w=%d h=%d\", (void*)arena->img, w, h);"
+	for (i = 0; i < n; ) {
+		name = names[i]
+		if (name == "pixelate" || pointwise(name)) {
+			ops = ""
+			j = i + (name == "pixelate")
+			for (; j < n && pointwise(names[j]); ++j) {
+				if (names[j] != "null")
+					ops = ops "\t\tPOINT(" names[j] ", " params[j] ")\n"
+			}
+			if (name == "pixelate") {
+				print "\tPIXELATE(arena->img, w, h, " params[i] ","
+				print ops "\t);"
+			} else if (ops != "") {
+				print "\tPOINTWISE(arena->img, w, h,"
+				print ops "\t);"
+			}
+			i = j
+		} else if (name == "kernel" || name == "matrix") {
+			print "\tfilter_" name "(arena->img, w, h, conf.filters[" i "].param, arena);"
+			++i
+		} else {
+			print "\tSTAGE(" name ", " params[i] ");"
+			++i
+		}
+	}
+	print "}"
+}
@@ -0,0 +1,135 @@
+#!/bin/sh
+#
+# Copyright © 2017 Lars Lindqvist <lars.lindqvist at yandex.ru>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3, as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# End-to-end lock latency under Xvfb, one CSV row per lock.
+#
+# usage: e2e-bench.sh [xbluck options...]
+#
+# Xvfb is started once per resolution, and split into side by side
+# RANDR monitors. The password is typed with xdotool, through XTest,
+# after the first frame. Needs Xvfb, xrandr and xdotool.
+#
+# Every time is self-reported: xbluck appends marks to the file named
+# by XBLUCK_BENCH, in µs since it started, and nothing here is timed
+# from the outside. So:
+#
+#   grab    both grab replies have come back
+#   map     the checked map_window has come back; not that it is shown
+#   frame   a round trip after the first image is sent, so the server
+#           has taken it; not that it has reached the display
+#   key     xbluck reads the KeyPress, not when xdotool sent it, so
+#           key_border_us and unlock_us leave out XTest delivery
+#   border  a round trip after the border is redrawn
+#   unlock  the grabs are let go, from the last key
+#
+# The time before main, and Xvfb's own drawing, are in none of them.
+#
+#   RESOLUTIONS  default "1920x1080 3840x2160"
+#   MONITORS     monitors per screen, default "1 2"
+#   RUNS         locks per configuration, default 5
+#   OUT          CSV appended to, default e2e-bench.csv
+#   DISPLAYNUM   display of the Xvfb, default 99
+
+PRG=${PRG:-./xbluck}
+RESOLUTIONS=${RESOLUTIONS:-"1920x1080 3840x2160"}
+MONITORS=${MONITORS:-"1 2"}
+RUNS=${RUNS:-5}
+OUT=${OUT:-e2e-bench.csv}
+DISPLAYNUM=${DISPLAYNUM:-99}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+CHAIN="$*"
+
+tmp=$(mktemp -d) || exit 1
+xvfb=
+trap '[ -n "$xvfb" ] && kill $xvfb 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+die() {
+	echo "$0: $*" >&2
+	exit 1
+}
+
+# wait up to 10s for a line starting with $1 in $2
+wait_for() {
+	i=0
+	until grep -q "^$1" "$2" 2>/dev/null; do
+		[ $i -lt 100 ] || return 1
+		sleep 0.1
+		i=$((i + 1))
+	done
+}
+
+monitors() {
+	xrandr --listmonitors | awk '$2 ~ /^bench/ { sub(/^[+*]*/, "", $2); print $2 }' |
+	while read -r m; do
+		xrandr --delmonitor "$m"
+	done
+	[ "$1" -gt 1 ] || return 0
+	mw=$(($2 / $1))
+	k=0
+	while [ $k -lt "$1" ]; do
+		xrandr --setmonitor bench$k "$mw/$mw"x"$3/$3+$((k * mw))+0" none || return 1
+		k=$((k + 1))
+	done
+}
+
+[ -x "$PRG" ] || die "$PRG: not built"
+[ -s "$OUT" ] || echo "commit,resolution,monitors,chain,run,grab_us,map_us,frame_us,key_border_us,unlock_us" > "$OUT"
+
+for res in $RESOLUTIONS; do
+	w=${res%x*}
+	h=${res#*x}
+	Xvfb :$DISPLAYNUM -screen 0 "$res"x24 -nolisten tcp 2> "$tmp/xvfb.log" &
+	xvfb=$!
+	export DISPLAY=:$DISPLAYNUM
+	i=0
+	until xrandr -q > /dev/null 2>&1; do
+		[ $i -lt 50 ] || die "Xvfb did not start: $(cat "$tmp/xvfb.log")"
+		sleep 0.1
+		i=$((i + 1))
+	done
+
+	for n in $MONITORS; do
+		monitors "$n" "$w" "$h" || die "could not set up $n monitors"
+		run=1
+		while [ $run -le "$RUNS" ]; do
+			rm -f "$tmp/marks"
+			# at -D any three bytes unlock; the hash keeps auth off the system
+			XBLUCK_BENCH="$tmp/marks" "$PRG" -D -T 0 --hash 00xbluckbench $CHAIN \
+				> /dev/null 2>&1 &
+			pid=$!
+			wait_for frame "$tmp/marks" || die "no frame, see $PRG -D $CHAIN"
+			xdotool type --delay 50 abc
+			xdotool key Return
+			wait $pid
+			awk -F, -v pre="$COMMIT,$res,$n,\"$CHAIN\",$run" '
+				$1 == "grab" { grab = $2 }
+				$1 == "map" { map = $2 }
+				$1 == "frame" && !frame { frame = $2 }
+				$1 == "key" { key = $2; pending = 1 }
+				$1 == "border" && pending { sum += $2 - key; ++nkey; pending = 0 }
+				$1 == "unlock" { unlock = $2 - key }
+				END {
+					printf "%s,%d,%d,%d,%d,%d\n", pre, grab, map, frame,
+					       nkey ? sum / nkey : 0, unlock
+				}' "$tmp/marks" >> "$OUT"
+			run=$((run + 1))
+		done
+	done
+
+	kill $xvfb
+	wait $xvfb 2>/dev/null
+	xvfb=
+done
@@ -20,9 +20,12 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <math.h>
 
 #include "xbluck.h"
 
+extern struct options_t conf;
+
 static void
 __check_param(bool valid, const char *fmt, ...) {
 	if (!valid) {
@@ -38,154 +41,1012 @@ __check_param(bool valid, const char *fmt, ...) {
 #define CHECK_PARAM(valid, fmt, ...) \
 __check_param(valid, "%s:" fmt "\n", __func__, ##__VA_ARGS__)
 
+#define FILTERDEF(name, flags) \
+const struct filterdef_t filterdef_##name = { \
+	#name, filter_##name, filter_check_##name, filter_need_##name, NULL, NULL, flags, NULL \
+}
+
+/*
+ * Filters that can also run on the luma plane of a grey frame, or on
+ * the 16-bit channel planes of a spatial run, see apply_filters. On a
+ * grey frame, the mono function must give the same result as the XRGB
+ * one.
+ */
+#define FILTERMONO(name) \
+static void filter_mono_##name(uint8_t *img, int w, int h, union fparam_t param, struct arena_t *arena)
+
+#define FILTERPLANAR(name) \
+static void filter_planar_##name(uint16_t *img, int w, int h, union fparam_t param, struct arena_t *arena)
+
+#define FILTERDEF_EXT(id, fl, ...) \
+const struct filterdef_t filterdef_##id = { \
+	.name = #id, \
+	.function = filter_##id, \
+	.checker = filter_check_##id, \
+	.need = filter_need_##id, \
+	.flags = fl, \
+	__VA_ARGS__ \
+}
+
 #define CLAMP(val) ((val) > 0xFF ? 0xFF : (val) < 0 ? 0 : (val))
+#define CLAMP16(val) ((val) > 0xFFFF ? 0xFFFF : (val) < 0 ? 0 : (val))
 #define CHANR(val) ((val >> 16) & 0xFF)
 #define CHANG(val) ((val >>  8) & 0xFF)
 #define CHANB(val) ((val >>  0) & 0xFF)
 #define MKRGB(r, g, b) (((CLAMP(r) & 0xFF) << 16) | ((CLAMP(g) & 0xFF) <<  8) | ((CLAMP(b) & 0xFF) <<  0))
 
+/*
+ * With --linear, the channel planes hold linear light rather than sRGB
+ * codes, so that spatial stages average light, not gamma, and the block
+ * averages of pixelate and tile sum linear light on XRGB frames. The
+ * conversion is by table, 256 entries into 16 bits and 65536 back to
+ * 8, so no pow() runs per pixel. A lone blur uses 15-bit tables, for
+ * the cheaper multiply-adds of conv_rows_lut. Every sRGB code survives
+ * either round trip.
+ */
+static uint16_t srgb_to_lin[256];
+static uint8_t lin_to_srgb[65536];
+static uint16_t srgb_to_lin15[256];
+static uint8_t lin15_to_srgb[32768];
+
+static double
+srgb_decode(double v) {
+	return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static double
+srgb_encode(double v) {
+	return v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1 / 2.4) - 0.055;
+}
+
+void
+linear_init(void) {
+	int i;
+	for (i = 0; i < 256; ++i) {
+		srgb_to_lin[i] = srgb_decode(i / 255.0) * 0xFFFF + 0.5;
+		srgb_to_lin15[i] = srgb_decode(i / 255.0) * 0x7FFF + 0.5;
+	}
+	for (i = 0; i < 65536; ++i)
+		lin_to_srgb[i] = srgb_encode(i / 65535.0) * 0xFF + 0.5;
+	for (i = 0; i < 32768; ++i)
+		lin15_to_srgb[i] = srgb_encode(i / 32767.0) * 0xFF + 0.5;
+}
+
+/*
+ * Run the point-wise statements ops, which read and write pix, over
+ * every pixel of the frame.
+ */
+#define POINTWISE(img, w, h, ops) do { \
+	uint32_t *_p = (img); \
+	uint32_t *_end = _p + (size_t)(w) * (h); \
+	for (; _p < _end; ++_p) { \
+		uint32_t pix = *_p; \
+		ops \
+		*_p = pix; \
+	} \
+} while (0)
+
+/*
+ * Replace every whole siz×siz block with its average. The point-wise
+ * statements ops are fused into the block writes, and also run over
+ * the right and bottom margins that no whole block covers.
+ */
+#define PIXELATE(img, w, h, siz, ops) do { \
+	uint32_t *_img = (img), *_row; \
+	int _x, _y, _dx, _dy; \
+	for (_y = 0; _y <= (h) - (siz); _y += (siz)) \
+	for (_x = 0; _x <= (w) - (siz); _x += (siz)) { \
+		int64_t _r = 0, _g = 0, _b = 0; \
+		uint32_t _blk; \
+		for (_dy = _y; _dy < _y + (siz); ++_dy) { \
+			_row = _img + _dy * (w); \
+			for (_dx = _x; _dx < _x + (siz); ++_dx) { \
+				_r += CHANR(_row[_dx]); \
+				_g += CHANG(_row[_dx]); \
+				_b += CHANB(_row[_dx]); \
+			} \
+		} \
+		_r /= (siz) * (siz); \
+		_g /= (siz) * (siz); \
+		_b /= (siz) * (siz); \
+		_blk = MKRGB(_r, _g, _b); \
+		for (_dy = _y; _dy < _y + (siz); ++_dy) { \
+			_row = _img + _dy * (w); \
+			for (_dx = _x; _dx < _x + (siz); ++_dx) { \
+				uint32_t pix = _blk; \
+				ops \
+				_row[_dx] = pix; \
+			} \
+		} \
+	} \
+	for (_y = 0; _y < (h); ++_y) { \
+		_row = _img + _y * (w); \
+		_x = _y < (h) / (siz) * (siz) ? (w) / (siz) * (siz) : 0; \
+		for (; _x < (w); ++_x) { \
+			uint32_t pix = _row[_x]; \
+			ops \
+			_row[_x] = pix; \
+		} \
+	} \
+} while (0)
+
+static inline uint32_t
+px_null(uint32_t pix, union fparam_t param) {
+	(void)param;
+	return pix;
+}
+
+static inline uint32_t
+px_invert(uint32_t pix, union fparam_t param) {
+	(void)param;
+	return pix ^ 0xFFFFFF;
+}
+
+static inline uint32_t
+px_colourise(uint32_t pix, union fparam_t param) {
+	double aa = ((param.u >> 24) & 0xFF) / 255.0;
+	uint32_t rr = CHANR(param.u) * aa;
+	uint32_t gg = CHANG(param.u) * aa;
+	uint32_t bb = CHANB(param.u) * aa;
+	int64_t r = CHANR(pix) * aa + rr;
+	int64_t g = CHANG(pix) * aa + gg;
+	int64_t b = CHANB(pix) * aa + bb;
+	return MKRGB(r, g, b);
+}
+
+static inline uint32_t
+px_noise(uint32_t pix, union fparam_t param) {
+	int n = param.u;
+	uint32_t base = rand();
+	int32_t r = CHANR(pix) + (CHANR(base) % n) * ((base & 0x01000000) ? 1 : -1);
+	int32_t g = CHANG(pix) + (CHANG(base) % n) * ((base & 0x02000000) ? 1 : -1);
+	int32_t b = CHANB(pix) + (CHANB(base) % n) * ((base & 0x04000000) ? 1 : -1);
+	return MKRGB(r, g, b);
+}
+
+/* px_noise with the residues from a table, see noise_table */
+static inline uint32_t
+px_noise_lut(uint32_t pix, const uint8_t *mod) {
+	uint32_t base = rand();
+	int32_t r = CHANR(pix) + mod[CHANR(base)] * ((base & 0x01000000) ? 1 : -1);
+	int32_t g = CHANG(pix) + mod[CHANG(base)] * ((base & 0x02000000) ? 1 : -1);
+	int32_t b = CHANB(pix) + mod[CHANB(base)] * ((base & 0x04000000) ? 1 : -1);
+	return MKRGB(r, g, b);
+}
+
+/* rounded, so that a grey pixel keeps its level and greyscale is
+ * idempotent; the weights sum to 1 within a few ulp */
+static inline uint8_t
+luma(uint32_t pix) {
+	return CLAMP(
+	      CHANR(pix) * .30
+	    + CHANG(pix) * .58
+	    + CHANB(pix) * .12
+	    + .5
+	);
+}
+
+static inline uint32_t
+px_greyscale(uint32_t pix, union fparam_t param) {
+	(void)param;
+	int64_t grey = luma(pix);
+	return MKRGB(grey, grey, grey);
+}
+
+static void
+arena_swap(struct arena_t *arena) {
+	uint32_t *tmp = arena->img;
+	arena->img = arena->alt;
+	arena->alt = tmp;
+}
+
+static void
+arena_swap_grey(struct arena_t *arena) {
+	uint8_t *tmp = arena->grey;
+	arena->grey = arena->greyalt;
+	arena->greyalt = tmp;
+}
+
+/*
+ * With WALK_ROWS in the plan, the block stages sum each row into all
+ * the blocks it crosses before going on to the next row, so the frame
+ * is read and written in order rather than a block at a time, which
+ * may suit wide blocks or frames better; edge keeps three rows of luma
+ * rather than a plane. The sums, and so the output, are the same, and
+ * tune_filters picks whichever is faster.
+ */
+static bool
+walk_rows(void) {
+	return conv_get_plan()->walk == WALK_ROWS;
+}
+
+static uint32_t
+binomial(uint32_t *kern, int klen) {
+	uint32_t div = 0;
+	int i;
+
+	kern[0] = 1;
+	for (i = 1; i < klen; ++i) {
+		kern[i] = kern[i-1] * (klen - i) / i;
+		div += kern[i];
+	}
+	return div;
+}
+
+/* the gaussian kernel as fractions, for blurs done elsewhere */
+int
+gaussian_weights(double *wt, unsigned rad) {
+	int klen = 2 * rad + 1;
+	uint32_t kern[klen];
+	uint32_t div = binomial(kern, klen);
+	int i;
+
+	for (i = 0; i < klen; ++i)
+		wt[i] = (double)kern[i] / div;
+	return klen;
+}
+
+#define GAUSS_STRIP 128    /* columns per strip of the vertical pass, */
+#define GAUSS_MAXSTRIP 512 /* or the plan's tile, up to this many */
+
 FILTERCHK(gaussian) {
 	CHECK_PARAM(param.u >= 2, "radius=%u: must be ≥ 2", param.u);
-	CHECK_PARAM(param.u < 30, "radius=%u: integer overflow", param.u);
+	CHECK_PARAM(param.u <= CONV_MAXRAD, "radius=%u: integer overflow", param.u);
 }
+FILTERNEED(gaussian) {
+	(void)param;
+	if (conf.linear)
+		return (struct need_t){ .scratch = (size_t)3 * (w * h + w) * sizeof(uint16_t) };
+	return (struct need_t){ .alt = true };
+}
+/* in linear light, on 15-bit channels converted a row at a time */
 FILTERFUNC(gaussian) {
 	DEBUG(1, "img=%p w=%d h=%d r=%d", (void*)img, w, h, param.u);
-	uint32_t *ins, *row;
-	int64_t r, g, b;
+	int klen = 2 * param.u + 1;
+	uint32_t kern[klen];
+	uint32_t div = binomial(kern, klen);
+	struct conv_t conv;
+
+	if (conf.linear) {
+		uint16_t *planes = arena->scratch;
+		uint16_t *buf = planes + (size_t)3 * w * h;
+		conv_init15(&conv, kern, klen, div);
+		conv_rows_lut(planes, img, w, h, &conv, srgb_to_lin15, buf);
+		conv_cols_lut(img, planes, w, h, &conv, lin15_to_srgb, buf);
+		return;
+	}
+	conv_init(&conv, kern, klen, div);
+	conv_rows(arena->alt, img, w, h, &conv);
+	conv_cols(img, arena->alt, w, h, &conv);
+}
+FILTERMONO(gaussian) {
+	DEBUG(1, "img=%p w=%d h=%d r=%d", (void*)img, w, h, param.u);
+	uint8_t *ins, *row;
+	uint32_t v;
 	int x, y, dx, dy;
 	int rad = param.u;
 	int klen = 2 * rad + 1;
 	uint32_t kern[klen];
 	int i;
 
-	uint32_t *tmp = malloc(w * h * sizeof(uint32_t));
-	uint32_t div = 0;
+	uint32_t sv[GAUSS_MAXSTRIP];
+	int tile = conv_get_plan()->tile;
+	int strip = !tile ? GAUSS_STRIP : tile < GAUSS_MAXSTRIP ? tile : GAUSS_MAXSTRIP;
+	int x0;
 
-	kern[0] = 1;
-	for (i = 1; i < klen; ++i) {
-		kern[i] = kern[i-1] * (klen - i) / i;
-		div += kern[i];
-	}
+	uint8_t *tmp = arena->greyalt;
+	uint32_t div = binomial(kern, klen);
+	struct conv_t conv;
+
+	/* the same fixed-point weights as the XRGB path */
+	conv_init(&conv, kern, klen, div);
 
 	for (ins = tmp, y = 0; y < h; y++) {
 		row = img + y * w;
 		for (x = 0; x < w; x++) {
-			r = g = b = 0;
+			v = 0;
 			for (dx = x - rad, i = 0; i < klen; ++i, ++dx) {
 				if (dx < 0 || dx >= w)
 					continue;
-
-				r += CHANR(row[dx]) * kern[i];
-				g += CHANG(row[dx]) * kern[i];
-				b += CHANB(row[dx]) * kern[i];
+				v += row[dx] * conv.wt[i];
 			}
-			r /= div;
-			g /= div;
-			b /= div;
-			*ins++ = MKRGB(r, g, b);
+			v >>= conv.shift;
+			*ins++ = v > 0xFF ? 0xFF : v;
 		}
 	}
 
-	for (ins = img, y = 0; y < h; y++) {
-		for (x = 0; x < w; x++) {
-			r = g = b = 0;
+	for (x0 = 0; x0 < w; x0 += strip) {
+		int sw = w - x0 < strip ? w - x0 : strip;
+		for (y = 0; y < h; y++) {
+			for (x = 0; x < sw; x++)
+				sv[x] = 0;
 			for (dy = y - rad, i = 0; i < klen; ++i, ++dy) {
 				if (dy < 0 || dy >= h)
 					continue;
-				
-				row = tmp + dy * w;
-				r += CHANR(row[x]) * kern[i];
-				g += CHANG(row[x]) * kern[i];
-				b += CHANB(row[x]) * kern[i];
+				row = tmp + dy * w + x0;
+				for (x = 0; x < sw; x++)
+					sv[x] += row[x] * conv.wt[i];
+			}
+			ins = img + y * w + x0;
+			for (x = 0; x < sw; x++) {
+				v = sv[x] >> conv.shift;
+				ins[x] = v > 0xFF ? 0xFF : v;
 			}
-			r /= div;
-			g /= div;
-			b /= div;
-			*ins++ = MKRGB(r, g, b);
 		}
 	}
-	free(tmp);
 }
+/* the same kernel, on the XRGB core's 16-bit plane variant */
+FILTERPLANAR(gaussian) {
+	DEBUG(1, "img=%p w=%d h=%d r=%d", (void*)img, w, h, param.u);
+	uint16_t *chan, *tmp = arena->plane + 3 * w * h;
+	int klen = 2 * param.u + 1;
+	uint32_t kern[klen];
+	uint32_t div = binomial(kern, klen);
+	struct conv_t conv;
+	int c;
+
+	conv_init16(&conv, kern, klen, div);
+	for (c = 0; c < 3; ++c) {
+		chan = img + c * w * h;
+		conv_rows16(tmp, chan, w, h, &conv);
+		conv_cols16(chan, tmp, w, h, &conv);
+	}
+}
+FILTERDEF_EXT(gaussian, FP_LINEAR | FP_SYMMETRIC | FP_FADES,
+              .mono = filter_mono_gaussian, .planar = filter_planar_gaussian,
+              .fused = &filterdef_blurpix);
 
 FILTERCHK(pixelate) {
 	CHECK_PARAM(param.u >= 2, "pixels=%u: must be ≥ 2", param.u);
 }
+FILTERNEED(pixelate) {
+	(void)h;
+	/* the sums of a row of blocks, see walk_rows */
+	return (struct need_t){ .scratch = (size_t)(w / param.u) * 3 * sizeof(uint64_t) };
+}
+/* adds row to the channel sums of nb blocks siz wide, see walk_rows */
+static void
+sum_blocks(uint64_t *sum, const uint32_t *row, int nb, int siz) {
+	int x = 0;
+	for (; nb--; sum += 3) {
+		int x1 = x + siz;
+		if (conf.linear) {
+			for (; x < x1; ++x) {
+				sum[0] += srgb_to_lin[CHANR(row[x])];
+				sum[1] += srgb_to_lin[CHANG(row[x])];
+				sum[2] += srgb_to_lin[CHANB(row[x])];
+			}
+			continue;
+		}
+		for (; x < x1; ++x) {
+			sum[0] += CHANR(row[x]);
+			sum[1] += CHANG(row[x]);
+			sum[2] += CHANB(row[x]);
+		}
+	}
+}
+
+/* the average of a block of n pixels from its channel sums */
+static uint32_t
+block_average(const uint64_t *sum, int64_t n) {
+	if (conf.linear)
+		return (uint32_t)lin_to_srgb[sum[0] / n] << 16
+		     | (uint32_t)lin_to_srgb[sum[1] / n] << 8
+		     | lin_to_srgb[sum[2] / n];
+	return MKRGB((int64_t)sum[0] / n, (int64_t)sum[1] / n, (int64_t)sum[2] / n);
+}
+
+static void
+pixelate_rows(uint32_t *img, int w, int h, int siz, uint64_t *sum) {
+	int nbx = w / siz;
+	int x, y, dy, bx;
+
+	for (y = 0; y <= h - siz; y += siz) {
+		uint32_t *top = img + y * w;
+		memset(sum, 0, nbx * 3 * sizeof(*sum));
+		for (dy = y; dy < y + siz; ++dy)
+			sum_blocks(sum, img + dy * w, nbx, siz);
+		for (bx = 0; bx < nbx; ++bx) {
+			uint32_t blk = block_average(sum + bx * 3, siz * siz);
+			for (x = bx * siz; x < (bx + 1) * siz; ++x)
+				top[x] = blk;
+		}
+		for (dy = y + 1; dy < y + siz; ++dy)
+			memcpy(img + dy * w, top, nbx * siz * sizeof(*img));
+	}
+}
 FILTERFUNC(pixelate) {
 	DEBUG(1, "img=%p w=%d h=%d siz=%d", (void*)img, w, h, param.u);
 	int siz = param.u;
-	uint32_t *row;
-	int x, y, dy, dx;
+	int x, y, dx, dy;
 
+	if (walk_rows()) {
+		pixelate_rows(img, w, h, siz, arena->scratch);
+		return;
+	}
+	if (!conf.linear) {
+		PIXELATE(img, w, h, siz, );
+		return;
+	}
 	for (y = 0; y <= h - siz; y += siz)
 	for (x = 0; x <= w - siz; x += siz) {
-		int64_t r = 0, g = 0, b = 0;
-		for (dy = y; dy < y + siz; ++dy) {
-			row = img + dy * w;
-			for (dx = x; dx < x + siz; ++dx) {
-				r += CHANR(row[dx]);
-				g += CHANG(row[dx]);
-				b += CHANB(row[dx]);
+		uint64_t r = 0, g = 0, b = 0;
+		uint32_t blk;
+		for (dy = y; dy < y + siz; ++dy)
+		for (dx = x; dx < x + siz; ++dx) {
+			uint32_t pix = img[dy * w + dx];
+			r += srgb_to_lin[CHANR(pix)];
+			g += srgb_to_lin[CHANG(pix)];
+			b += srgb_to_lin[CHANB(pix)];
+		}
+		blk = (uint32_t)lin_to_srgb[r / (siz * siz)] << 16
+		    | (uint32_t)lin_to_srgb[g / (siz * siz)] << 8
+		    | lin_to_srgb[b / (siz * siz)];
+		for (dy = y; dy < y + siz; ++dy)
+		for (dx = x; dx < x + siz; ++dx)
+			img[dy * w + dx] = blk;
+	}
+}
+FILTERMONO(pixelate) {
+	DEBUG(1, "img=%p w=%d h=%d siz=%d", (void*)img, w, h, param.u);
+	int siz = param.u;
+	int nbx = w / siz;
+	int x, y, dx, dy;
+
+	if (walk_rows()) {
+		uint64_t *sum = arena->scratch;
+		for (y = 0; y <= h - siz; y += siz) {
+			memset(sum, 0, nbx * sizeof(*sum));
+			for (dy = y; dy < y + siz; ++dy) {
+				const uint8_t *row = img + dy * w;
+				for (x = 0, dx = 0; dx < nbx; ++dx)
+				for (; x < (dx + 1) * siz; ++x)
+					sum[dx] += row[x];
+			}
+			for (dx = 0; dx < nbx; ++dx)
+				memset(img + y * w + dx * siz, sum[dx] / (siz * siz), siz);
+			for (dy = y + 1; dy < y + siz; ++dy)
+				memcpy(img + dy * w, img + y * w, nbx * siz);
+		}
+		return;
+	}
+	for (y = 0; y <= h - siz; y += siz)
+	for (x = 0; x <= w - siz; x += siz) {
+		int64_t v = 0;
+		for (dy = y; dy < y + siz; ++dy)
+		for (dx = x; dx < x + siz; ++dx)
+			v += img[dy * w + dx];
+		v /= siz * siz;
+		for (dy = y; dy < y + siz; ++dy)
+			memset(img + dy * w + x, v, siz);
+	}
+}
+FILTERPLANAR(pixelate) {
+	DEBUG(1, "img=%p w=%d h=%d siz=%d", (void*)img, w, h, param.u);
+	int siz = param.u;
+	int nbx = w / siz;
+	int x, y, dx, dy, c;
+	for (c = 0; c < 3; ++c) {
+		uint16_t *chan = img + c * w * h;
+		if (walk_rows()) {
+			uint64_t *sum = arena->scratch;
+			for (y = 0; y <= h - siz; y += siz) {
+				uint16_t *top = chan + y * w;
+				memset(sum, 0, nbx * sizeof(*sum));
+				for (dy = y; dy < y + siz; ++dy) {
+					const uint16_t *row = chan + dy * w;
+					for (x = 0, dx = 0; dx < nbx; ++dx)
+					for (; x < (dx + 1) * siz; ++x)
+						sum[dx] += row[x];
+				}
+				for (x = 0, dx = 0; dx < nbx; ++dx) {
+					uint16_t v = sum[dx] / (siz * siz);
+					for (; x < (dx + 1) * siz; ++x)
+						top[x] = v;
+				}
+				for (dy = y + 1; dy < y + siz; ++dy)
+					memcpy(chan + dy * w, top, nbx * siz * sizeof(*chan));
 			}
+			continue;
+		}
+		for (y = 0; y <= h - siz; y += siz)
+		for (x = 0; x <= w - siz; x += siz) {
+			uint64_t v = 0;
+			for (dy = y; dy < y + siz; ++dy)
+			for (dx = x; dx < x + siz; ++dx)
+				v += chan[dy * w + dx];
+			v /= siz * siz;
+			for (dy = y; dy < y + siz; ++dy)
+			for (dx = x; dx < x + siz; ++dx)
+				chan[dy * w + dx] = v;
+		}
+	}
+}
+FILTERDEF_EXT(pixelate, FP_LINEAR | FP_REDUCE | FP_IDEMPOTENT,
+              .mono = filter_mono_pixelate, .planar = filter_planar_pixelate);
+
+/*
+ * gaussian followed by pixelate, as planned by plan_filters. Only the
+ * block averages of the blurred frame are ever seen, so each block is
+ * computed directly as a weighted sum over the box-filtered binomial
+ * kernel, without materialising the blurred frame. Intermediates are
+ * not rounded, so the result may differ from running the two stages
+ * by ±2 per channel. Frames that pixelate leaves a margin on, small
+ * radii, where gaussian clamps between its passes often enough to
+ * matter, and radii whose sums could lose precision take the two stage
+ * path.
+ */
+static bool
+blurpix_fused(int w, int h, union fparam_t param) {
+	return param.us.u1 >= BLURPIX_MINRAD && param.us.u1 <= BLURPIX_MAXRAD
+	    && w % param.us.u2 == 0 && h % param.us.u2 == 0;
+}
+
+FILTERCHK(blurpix) {
+	filter_check_gaussian((union fparam_t){ .u = param.us.u1 });
+	filter_check_pixelate((union fparam_t){ .u = param.us.u2 });
+}
+FILTERNEED(blurpix) {
+	int nbx = w / param.us.u2;
+	int nby = h / param.us.u2;
+	if (!blurpix_fused(w, h, param)) {
+		struct need_t g = filter_need_gaussian(w, h, (union fparam_t){ .u = param.us.u1 });
+		struct need_t p = filter_need_pixelate(w, h, (union fparam_t){ .u = param.us.u2 });
+		return (struct need_t){
+			.alt = g.alt || p.alt,
+			.scratch = g.scratch > p.scratch ? g.scratch : p.scratch,
+		};
+	}
+	/* and a padded row of each channel, see walk_rows */
+	return (struct need_t){
+		.scratch = nbx * (nby + 1) * 3 * sizeof(double) + 3 * (w + 2 * param.us.u1),
+	};
+}
+FILTERFUNC(blurpix) {
+	DEBUG(1, "img=%p w=%d h=%d r=%d siz=%d", (void*)img, w, h, param.us.u1, param.us.u2);
+	int rad = param.us.u1;
+	int siz = param.us.u2;
+	int klen = 2 * rad + 1;
+	int clen = siz + klen - 1;
+	uint32_t kern[klen];
+	uint64_t cbox[clen];
+	uint32_t div;
+	int nbx = w / siz;
+	int nby = h / siz;
+	double *acc, *hsum;
+	uint8_t *cr, *cg, *cb;
+	bool rows = walk_rows();
+	int x, y, bx, by, d, i;
+
+	if (!blurpix_fused(w, h, param)) {
+		filter_gaussian(img, w, h, (union fparam_t){ .u = rad }, arena);
+		filter_pixelate(arena->img, w, h, (union fparam_t){ .u = siz }, arena);
+		return;
+	}
+
+	/* cbox[d]: weight of source pixel x0 - rad + d in the block at x0 */
+	div = binomial(kern, klen);
+	for (d = 0; d < clen; ++d) {
+		cbox[d] = 0;
+		for (i = d - siz + 1 < 0 ? 0 : d - siz + 1; i < klen && i <= d; ++i)
+			cbox[d] += kern[i];
+	}
+
+	acc = arena->scratch;
+	hsum = acc + nbx * nby * 3;
+	memset(acc, 0, nbx * nby * 3 * sizeof(double));
+	cr = (uint8_t*)(hsum + nbx * 3);
+	cg = cr + w + 2 * rad;
+	cb = cg + w + 2 * rad;
+	memset(cr, 0, 3 * (w + 2 * rad));
+
+	for (y = 0; y < h; ++y) {
+		uint32_t *row = img + y * w;
+		int top = y - rad - siz + 1;
+		int by0 = top <= 0 ? 0 : (top + siz - 1) / siz;
+		int by1 = (y + rad) / siz;
+
+		/* the same sums, from channels taken apart once per row,
+		 * with the zeros either side standing in for the edges */
+		for (x = 0; rows && x < w; ++x) {
+			cr[rad + x] = CHANR(row[x]);
+			cg[rad + x] = CHANG(row[x]);
+			cb[rad + x] = CHANB(row[x]);
 		}
-		r /= siz * siz;
-		g /= siz * siz;
-		b /= siz * siz;
-		for (dy = y; dy < y + siz; ++dy) {
-			row = img + dy * w;
-			for (dx = x; dx < x + siz; ++dx) {
-				row[dx] = MKRGB(r, g, b);
+		for (bx = 0; bx < nbx; ++bx) {
+			uint64_t r = 0, g = 0, b = 0;
+			if (rows) {
+				for (d = 0; d < clen; ++d) {
+					r += cr[bx * siz + d] * cbox[d];
+					g += cg[bx * siz + d] * cbox[d];
+					b += cb[bx * siz + d] * cbox[d];
+				}
+			} else {
+				for (x = bx * siz - rad, d = 0; d < clen; ++d, ++x) {
+					if (x < 0 || x >= w)
+						continue;
+					r += CHANR(row[x]) * cbox[d];
+					g += CHANG(row[x]) * cbox[d];
+					b += CHANB(row[x]) * cbox[d];
+				}
 			}
+			hsum[bx * 3 + 0] = r;
+			hsum[bx * 3 + 1] = g;
+			hsum[bx * 3 + 2] = b;
+		}
+
+		if (by1 >= nby)
+			by1 = nby - 1;
+		for (by = by0; by <= by1; ++by) {
+			double wgt = cbox[y - (by * siz - rad)];
+			double *a = acc + by * nbx * 3;
+			for (i = 0; i < nbx * 3; ++i)
+				a[i] += wgt * hsum[i];
 		}
 	}
+
+	for (by = 0; by < nby; ++by)
+	for (bx = 0; bx < nbx; ++bx) {
+		double norm = (double)div * div * siz * siz;
+		double *a = acc + (by * nbx + bx) * 3;
+		uint32_t pix = MKRGB((int64_t)(a[0] / norm),
+		                     (int64_t)(a[1] / norm),
+		                     (int64_t)(a[2] / norm));
+		for (y = by * siz; y < (by + 1) * siz; ++y)
+		for (x = bx * siz; x < (bx + 1) * siz; ++x)
+			img[y * w + x] = pix;
+	}
+}
+/* on the planes of a deep frame, as the two stages */
+FILTERPLANAR(blurpix) {
+	filter_planar_gaussian(img, w, h, (union fparam_t){ .u = param.us.u1 }, arena);
+	filter_planar_pixelate(img, w, h, (union fparam_t){ .u = param.us.u2 }, arena);
 }
+FILTERDEF_EXT(blurpix, FP_LINEAR | FP_REDUCE | FP_FADES,
+              .planar = filter_planar_blurpix);
 
 FILTERCHK(edge) {
 	(void)param;
 }
+FILTERNEED(edge) {
+	(void)param;
+	return (struct need_t){ .scratch = w * h * sizeof(uint8_t) };
+}
+/* the edge strength at x of the middle one of three rows of luma */
+static inline int
+sobel(const uint8_t *rp, const uint8_t *rc, const uint8_t *rn, int x) {
+	int dx, dy;
+	dx = abs((
+	     -rp[x - 1]
+	     -rp[x] * 2
+	     -rp[x + 1]
+	     +rn[x - 1]
+	     +rn[x] * 2
+	     +rn[x + 1]) / 8);
+	dy = abs((
+	     -rp[x - 1]
+	     -rc[x - 1] * 2
+	     -rn[x - 1]
+	     +rp[x + 1]
+	     +rc[x + 1] * 2
+	     +rn[x + 1]) / 8);
+	return (dx + dy) / 2;
+}
+/* with WALK_ROWS, the luma of a row is taken just before the row above
+ * it is written, into three rows that take turns */
 FILTERFUNC(edge) {
 	DEBUG(1, "img=%p w=%d w=%d", (void*)img, w, h);
 	(void)param;
 	int x, y;
+	bool rows = walk_rows() && h > 2;
 	uint8_t *grey, *dst;
 	uint32_t *src;
-	grey = malloc(w * h * sizeof(uint8_t));
+	grey = arena->scratch;
 
-	for (dst = grey, src = img, y = 0; y < h; ++y)
+	for (dst = grey, src = img, y = 0; y < (rows ? 2 : h); ++y)
 	for (x = 0; x < w; ++x, ++src, ++dst) {
-		*dst = CLAMP(
-		      CHANR(*src) * .30
-		    + CHANG(*src) * .58
-		    + CHANB(*src) * .12
-		);
+		*dst = luma(*src);
 	}
 	for (y = 1; y < h - 1; ++y) {
-		uint8_t *rp = grey + (y - 1) * w;
-		uint8_t *rc = rp + w;
-		uint8_t *rn = rc + w;
+		uint8_t *rp = grey + (rows ? (y - 1) % 3 : y - 1) * w;
+		uint8_t *rc = grey + (rows ? y % 3 : y) * w;
+		uint8_t *rn = grey + (rows ? (y + 1) % 3 : y + 1) * w;
+		for (x = 0; rows && x < w; ++x)
+			rn[x] = luma(img[(y + 1) * w + x]);
 		for (x = 1; x < w - 1; ++x) {
-			int dx, dy;
-			dx = abs((
-			     -rp[x - 1]
-			     -rp[x] * 2
-			     -rp[x + 1]
-			     +rn[x - 1]
-			     +rn[x] * 2
-			     +rn[x + 1]) / 8);
-			dy = abs((
-			     -rp[x - 1]
-			     -rc[x - 1] * 2
-			     -rn[x - 1]
-			     +rp[x + 1]
-			     +rc[x + 1] * 2
-			     +rn[x + 1]) / 8);
-			int avg = (dx + dy) / 2;
+			int avg = sobel(rp, rc, rn, x);
 			img[y * w + x] = MKRGB(avg, avg, avg);
+		}
+	}
+}
+FILTERMONO(edge) {
+	DEBUG(1, "img=%p w=%d w=%d", (void*)img, w, h);
+	(void)param;
+	int x, y;
+	bool rows = walk_rows() && h > 2;
+	uint8_t *grey = arena->scratch;
+
+	for (x = 0; x < (rows ? 2 : h) * w; ++x)
+		grey[x] = luma(img[x] * 0x010101);
+	for (y = 1; y < h - 1; ++y) {
+		uint8_t *rp = grey + (rows ? (y - 1) % 3 : y - 1) * w;
+		uint8_t *rc = grey + (rows ? y % 3 : y) * w;
+		uint8_t *rn = grey + (rows ? (y + 1) % 3 : y + 1) * w;
+		for (x = 0; rows && x < w; ++x)
+			rn[x] = luma(img[(y + 1) * w + x] * 0x010101);
+		for (x = 1; x < w - 1; ++x)
+			img[y * w + x] = sobel(rp, rc, rn, x);
+	}
+}
+FILTERDEF_EXT(edge, FP_SYMMETRIC,
+              .mono = filter_mono_edge);
+
+/*
+ * A user kernel. If it is the outer product of a column and a row of
+ * non-negative taps, as any 1-D kernel of non-negative taps is, and
+ * has no gain or bias, it runs on the convolution core like gaussian:
+ * one pass for a 1-D kernel and two for a 2-D one. Any other kernel
+ * is convolved directly, in fixed point. Each kernel row is applied
+ * to the channels of a source row, which are padded with zeros so
+ * that taps outside the frame add nothing, as in the core. Rows and
+ * columns that mirror each other around the anchor share a multiply.
+ */
+static int32_t
+kernel_div(const struct kernel_t *k) {
+	int32_t sum = 0;
+	int i;
+	if (k->div)
+		return k->div;
+	for (i = 0; i < k->w * k->h; ++i)
+		sum += k->tap[i];
+	return sum > 0 ? sum : 1;
+}
+
+static int32_t
+igcd(int32_t a, int32_t b) {
+	a = a < 0 ? -a : a;
+	b = b < 0 ? -b : b;
+	while (b) {
+		int32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* k as col × row, both non-negative, or false */
+static bool
+kernel_factor(const struct kernel_t *k, int32_t *col, int32_t *row) {
+	int32_t g = 0;
+	int x, y, x0 = 0, y0;
+
+	for (y0 = 0; y0 < k->h; ++y0) {
+		for (x0 = 0; x0 < k->w && !k->tap[y0 * k->w + x0]; ++x0)
+			;
+		if (x0 < k->w)
+			break;
+	}
+	for (x = 0; x < k->w; ++x)
+		g = igcd(g, k->tap[y0 * k->w + x]);
+	if (k->tap[y0 * k->w + x0] < 0)
+		g = -g;
+	for (x = 0; x < k->w; ++x) {
+		row[x] = k->tap[y0 * k->w + x] / g;
+		if (row[x] < 0)
+			return false;
+	}
+	for (y = 0; y < k->h; ++y) {
+		col[y] = k->tap[y * k->w + x0] / row[x0];
+		if (col[y] < 0)
+			return false;
+		for (x = 0; x < k->w; ++x) {
+			if (k->tap[y * k->w + x] != col[y] * row[x])
+				return false;
+		}
+	}
+	return true;
+}
+
+/* taps scaled by mul, centred on the anchor for the core */
+static void
+kernel_conv(struct conv_t *conv, const int32_t *tap, int n, uint32_t mul, uint32_t div) {
+	int a = (n - 1) / 2;
+	int rad = n - 1 - a;
+	uint32_t kern[2 * rad + 1];
+	int i;
+
+	memset(kern, 0, sizeof(kern));
+	for (i = 0; i < n; ++i)
+		kern[rad - a + i] = tap[i] * mul;
+	conv_init(conv, kern, 2 * rad + 1, div);
+}
+
+static void
+kernel_load(int32_t *chan, int stride, const uint32_t *row, int w, bool add) {
+	int x;
+	if (!add) {
+		for (x = 0; x < w; ++x) {
+			chan[x] = CHANR(row[x]);
+			chan[stride + x] = CHANG(row[x]);
+			chan[2 * stride + x] = CHANB(row[x]);
+		}
+		return;
+	}
+	for (x = 0; x < w; ++x) {
+		chan[x] += CHANR(row[x]);
+		chan[stride + x] += CHANG(row[x]);
+		chan[2 * stride + x] += CHANB(row[x]);
+	}
+}
+
+/* fixed-point taps for the direct path, and their shift, the largest
+ * for which no 32-bit accumulator can overflow, or 0 if none is */
+static int
+kernel_weights(const struct kernel_t *k, int32_t *wt) {
+	int32_t div = kernel_div(k);
+	int64_t bias = k->bias < 0 ? -k->bias : k->bias;
+	int64_t sum;
+	int i, shift;
+
+	for (shift = 16; shift > 0; --shift) {
+		for (sum = 0, i = 0; i < k->w * k->h; ++i) {
+			int64_t t = (int64_t)k->tap[i] * ((int64_t)1 << shift)
+			          + (k->tap[i] < 0 ? -div / 2 : div / 2);
+			wt[i] = t / div;
+			sum += wt[i] < 0 ? -wt[i] : wt[i];
+		}
+		if (sum * 2 * 0xFF + bias * ((int64_t)1 << shift) <= INT32_MAX)
+			return shift;
+	}
+	return 0;
+}
 
+static void
+kernel_direct(uint32_t *dst, const uint32_t *img, int w, int h,
+              const struct kernel_t *k, int32_t *scratch) {
+	int kw = k->w, kh = k->h;
+	int ax = (kw - 1) / 2, ay = (kh - 1) / 2;
+	int pw = w + kw - 1;
+	int32_t *acc = scratch, *chan = scratch + 3 * w;
+	int32_t wt[KERNEL_MAXTAPS];
+	int32_t div = kernel_div(k);
+	int shift = kernel_weights(k, wt);
+	bool hsym = kw % 2, vsym = kh % 2;
+	int x, y, i, c, kx, ky;
+
+	for (y = 0; y < kh; ++y)
+	for (x = 0; x < kw; ++x) {
+		hsym &= k->tap[y * kw + x] == k->tap[y * kw + kw - 1 - x];
+		vsym &= k->tap[y * kw + x] == k->tap[(kh - 1 - y) * kw + x];
+	}
+	DEBUG(1, "%dx%d div=%d bias=%d shift=%d hsym=%d vsym=%d",
+	      kw, kh, div, k->bias, shift, hsym, vsym);
+
+	for (c = 0; c < 3; ++c) {
+		memset(chan + c * pw, 0, ax * sizeof(int32_t));
+		memset(chan + c * pw + ax + w, 0, (kw - 1 - ax) * sizeof(int32_t));
+	}
+	for (y = 0; y < h; ++y) {
+		for (i = 0; i < 3 * w; ++i)
+			acc[i] = k->bias * (1 << shift) + (1 << (shift - 1));
+		for (ky = 0; ky < kh; ++ky) {
+			int my = vsym ? kh - 1 - ky : ky;
+			int sy = y + ky - ay, my_y = y + my - ay;
+			bool in = sy >= 0 && sy < h;
+			bool min = my != ky && my_y >= 0 && my_y < h;
+			const int32_t *rw = wt + ky * kw;
+
+			if (my < ky)
+				break;
+			for (kx = 0; kx < kw && !rw[kx]; ++kx)
+				;
+			if (kx == kw || (!in && !min))
+				continue;
+			if (in)
+				kernel_load(chan + ax, pw, img + (size_t)sy * w, w, false);
+			if (min)
+				kernel_load(chan + ax, pw, img + (size_t)my_y * w, w, in);
+
+			for (kx = 0; kx < kw; ++kx) {
+				int mx = hsym ? kw - 1 - kx : kx;
+				int32_t t = rw[kx];
+				if (mx < kx)
+					break;
+				if (!t)
+					continue;
+				for (c = 0; c < 3; ++c) {
+					int32_t *a = acc + c * w;
+					const int32_t *s = chan + c * pw;
+					if (mx != kx) {
+						for (x = 0; x < w; ++x)
+							a[x] += (s[x + kx] + s[x + mx]) * t;
+					} else {
+						for (x = 0; x < w; ++x)
+							a[x] += s[x + kx] * t;
+					}
+				}
+			}
+		}
+		for (x = 0; x < w; ++x) {
+			int32_t r = acc[x] >> shift;
+			int32_t g = acc[w + x] >> shift;
+			int32_t b = acc[2 * w + x] >> shift;
+			dst[(size_t)y * w + x] = MKRGB(r, g, b);
 		}
 	}
-	free(grey);
 }
 
+FILTERCHK(kernel) {
+	const struct kernel_t *k = param.k;
+	int32_t wt[KERNEL_MAXTAPS];
+	int i, len = k->w * k->h;
+	bool nonzero = false;
+
+	CHECK_PARAM(k->w >= 1 && k->h >= 1, "%dx%d: empty kernel", k->w, k->h);
+	if (k->w > 1 && k->h > 1) {
+		CHECK_PARAM(k->w <= KERNEL_MAXDIM && k->h <= KERNEL_MAXDIM,
+		            "%dx%d: 2-D kernels are at most %dx%d", k->w, k->h, KERNEL_MAXDIM, KERNEL_MAXDIM);
+	} else {
+		CHECK_PARAM(len <= KERNEL_MAXLEN, "%d taps: 1-D kernels have at most %d", len, KERNEL_MAXLEN);
+	}
+	for (i = 0; i < len; ++i) {
+		CHECK_PARAM(k->tap[i] >= -0xFFFF && k->tap[i] <= 0xFFFF, "tap=%d: too large", k->tap[i]);
+		nonzero |= k->tap[i] != 0;
+	}
+	CHECK_PARAM(nonzero, "%dx%d: all taps are zero", k->w, k->h);
+	CHECK_PARAM(k->div >= 0, "divisor=%d: must be positive", k->div);
+	CHECK_PARAM(k->bias >= -0xFF && k->bias <= 0xFF, "bias=%d: must be within ±255", k->bias);
+	CHECK_PARAM(kernel_weights(k, wt), "%dx%d: taps too large for divisor %d",
+	            k->w, k->h, kernel_div(k));
+}
+FILTERNEED(kernel) {
+	(void)h;
+	/* the accumulators and padded channels of the direct path */
+	return (struct need_t){
+		.alt = true,
+		.scratch = (3 * w + 3 * (w + param.k->w - 1)) * sizeof(int32_t),
+	};
+}
+FILTERFUNC(kernel) {
+	const struct kernel_t *k = param.k;
+	DEBUG(1, "img=%p w=%d h=%d kernel=%dx%d", (void*)img, w, h, k->w, k->h);
+	int32_t col[KERNEL_MAXDIM > KERNEL_MAXLEN ? KERNEL_MAXDIM : KERNEL_MAXLEN];
+	int32_t row[KERNEL_MAXDIM > KERNEL_MAXLEN ? KERNEL_MAXDIM : KERNEL_MAXLEN];
+	uint32_t div = kernel_div(k);
+	uint32_t rsum = 0, csum = 0;
+	struct conv_t conv;
+	int i;
+
+	/* a gain would scale up the rounding of the first pass */
+	if (!k->bias && kernel_factor(k, col, row)) {
+		for (i = 0; i < k->w; ++i)
+			rsum += row[i];
+		for (i = 0; i < k->h; ++i)
+			csum += col[i];
+	}
+	if (!rsum || div < (uint64_t)rsum * csum) {
+		kernel_direct(arena->alt, img, w, h, k, arena->scratch);
+		arena_swap(arena);
+		return;
+	}
+	DEBUG(1, "separable %dx%d", k->w, k->h);
+	if (k->h == 1) {
+		kernel_conv(&conv, row, k->w, col[0], div);
+		conv_rows(arena->alt, img, w, h, &conv);
+	} else if (k->w == 1) {
+		kernel_conv(&conv, col, k->h, row[0], div);
+		conv_cols(arena->alt, img, w, h, &conv);
+	} else {
+		kernel_conv(&conv, row, k->w, 1, rsum);
+		conv_rows(arena->alt, img, w, h, &conv);
+		kernel_conv(&conv, col, k->h, rsum, div);
+		conv_cols(img, arena->alt, w, h, &conv);
+		return;
+	}
+	arena_swap(arena);
+}
+FILTERDEF(kernel, 0);
+
 FILTERCHK(tile) {
 	CHECK_PARAM(param.us.u1 < 64, "htile=%u: Nonsensically large", param.us.u1);
 	CHECK_PARAM(param.us.u2 < 64, "vtile=%u: Nonsensically large", param.us.u2);
@@ -194,6 +1055,18 @@ FILTERCHK(tile) {
 	CHECK_PARAM(param.us.u1 != 1 || param.us.u2 != 1,
 	            "vtile=%u, htile=%u: Both cannot be one (1)", param.us.u1, param.us.u2);
 }
+/* the sums of a row of blocks go after the miniature, see walk_rows */
+static size_t
+tile_sums(int w, int h, union fparam_t param) {
+	return ROUNDUP((size_t)(w / param.us.u1) * (h / param.us.u2) * sizeof(uint32_t),
+	               sizeof(uint64_t));
+}
+FILTERNEED(tile) {
+	/* one XRGB miniature, or one channel plane of it at a time */
+	return (struct need_t){
+		.scratch = tile_sums(w, h, param) + (w / param.us.u1) * 3 * sizeof(uint64_t),
+	};
+}
 FILTERFUNC(tile) {
 	DEBUG(1, "img=%p w=%d w=%d Dx=%d Dy=%d", (void*)img, w, h, param.us.u1, param.us.u2);
 	int x, y, dx, dy;
@@ -202,22 +1075,41 @@ FILTERFUNC(tile) {
 	int sw = w / nw;
 	int sh = h / nh;
 	int n = nw * nh;
-	uint32_t *small = malloc(sw * sh * sizeof(uint32_t));
+	uint32_t *small = arena->scratch;
+	uint64_t *sum = (uint64_t*)((char*)arena->scratch + tile_sums(w, h, param));
+	bool rows = walk_rows();
 	uint32_t *p;
 
 	p = small;
-	for (y = 0; y <= h - nh; y += nh)
+	for (y = 0; rows && y <= h - nh; y += nh) {
+		memset(sum, 0, sw * 3 * sizeof(*sum));
+		for (dy = y; dy < y + nh; ++dy)
+			sum_blocks(sum, img + dy * w, sw, nw);
+		for (x = 0; x < sw; ++x)
+			*p++ = block_average(sum + x * 3, n);
+	}
+	for (y = 0; !rows && y <= h - nh; y += nh)
 	for (x = 0; x <= w - nw; x += nw) {
 		int64_t r = 0, g = 0, b = 0;
 		for (dy = y; dy < y + nh; ++dy) {
 			uint32_t *row = img + dy * w;
+			if (conf.linear) {
+				for (dx = x; dx < x + nw; ++dx) {
+					r += srgb_to_lin[CHANR(row[dx])];
+					g += srgb_to_lin[CHANG(row[dx])];
+					b += srgb_to_lin[CHANB(row[dx])];
+				}
+				continue;
+			}
 			for (dx = x; dx < x + nw; ++dx) {
 				r += CHANR(row[dx]);
 				g += CHANG(row[dx]);
 				b += CHANB(row[dx]);
 			}
 		}
-		*p++ = MKRGB(r / n, g / n, b / n);
+		*p++ = conf.linear
+		     ? (uint32_t)lin_to_srgb[r / n] << 16 | (uint32_t)lin_to_srgb[g / n] << 8 | lin_to_srgb[b / n]
+		     : MKRGB(r / n, g / n, b / n);
 	}
 
 	for (dy = y = 0; y < h; ++y) {
@@ -229,37 +1121,102 @@ FILTERFUNC(tile) {
 			if (++dx == sw) dx = 0;
 		}
 	}
+}
+FILTERPLANAR(tile) {
+	DEBUG(1, "img=%p w=%d w=%d Dx=%d Dy=%d", (void*)img, w, h, param.us.u1, param.us.u2);
+	int x, y, dx, dy, c;
+	int nw = param.us.u1;
+	int nh = param.us.u2;
+	int sw = w / nw;
+	int sh = h / nh;
+	int n = nw * nh;
+	uint16_t *small = arena->scratch;
+	uint64_t *sum = (uint64_t*)((char*)arena->scratch + tile_sums(w, h, param));
+	bool rows = walk_rows();
+	uint16_t *p;
+
+	for (c = 0; c < 3; ++c) {
+		uint16_t *chan = img + c * w * h;
+
+		p = small;
+		for (y = 0; rows && y <= h - nh; y += nh) {
+			memset(sum, 0, sw * sizeof(*sum));
+			for (dy = y; dy < y + nh; ++dy) {
+				const uint16_t *row = chan + dy * w;
+				for (x = 0, dx = 0; dx < sw; ++dx)
+				for (; x < (dx + 1) * nw; ++x)
+					sum[dx] += row[x];
+			}
+			for (dx = 0; dx < sw; ++dx)
+				*p++ = sum[dx] / n;
+		}
+		for (y = 0; !rows && y <= h - nh; y += nh)
+		for (x = 0; x <= w - nw; x += nw) {
+			uint64_t v = 0;
+			for (dy = y; dy < y + nh; ++dy)
+			for (dx = x; dx < x + nw; ++dx)
+				v += chan[dy * w + dx];
+			*p++ = v / n;
+		}
 
-	free(small);
-	
+		for (dy = y = 0; y < h; ++y) {
+			uint16_t *drow = chan + y * w;
+			uint16_t *srow = small + dy * sw;
+			if (++dy == sh) dy = 0;
+			for (dx = x = 0; x < w; ++x) {
+				drow[x] = srow[dx];
+				if (++dx == sw) dx = 0;
+			}
+		}
+	}
 }
+FILTERDEF_EXT(tile, FP_LINEAR | FP_REDUCE,
+              .planar = filter_planar_tile);
 
 FILTERCHK(flip) {
 	(void)param;
 }
+FILTERNEED(flip) {
+	(void)w;
+	(void)h;
+	(void)param;
+	return (struct need_t){ .alt = true };
+}
 FILTERFUNC(flip) {
 	DEBUG(1, "img=%p w=%d h=%d", (void*)img, w, h);
 	(void)param;
 	size_t len = w * sizeof(uint32_t);
-	uint32_t *ph = malloc(len);
-	uint32_t *hi, *lo;
 	int y;
-	for (y = 0; y < h / 2; ++y) {
-		hi = img + w * y;
-		lo = img + w * (h - y - 1);
-		memcpy(ph, hi, len);
-		memcpy(hi, lo, len);
-		memcpy(lo, ph, len);
+	for (y = 0; y < h; ++y) {
+		memcpy(arena->alt + w * y, img + w * (h - y - 1), len);
 	}
-	free(ph);
+	arena_swap(arena);
 }
+FILTERMONO(flip) {
+	DEBUG(1, "img=%p w=%d h=%d", (void*)img, w, h);
+	(void)param;
+	int y;
+	for (y = 0; y < h; ++y) {
+		memcpy(arena->greyalt + w * y, img + w * (h - y - 1), w);
+	}
+	arena_swap_grey(arena);
+}
+FILTERDEF_EXT(flip, FP_GEOMETRIC | FP_MIRROR | FP_INVOLUTION | FP_LINEAR,
+              .mono = filter_mono_flip);
 
 FILTERCHK(flop) {
 	(void)param;
 }
+FILTERNEED(flop) {
+	(void)w;
+	(void)h;
+	(void)param;
+	return (struct need_t){ 0 };
+}
 FILTERFUNC(flop) {
 	DEBUG(1, "img=%p w=%d h=%d", (void*)img, w, h);
 	(void)param;
+	(void)arena;
 	int y, x;
 	for (y = 0; y < h; ++y) {
 		uint32_t *row = img + w * y;
@@ -270,121 +1227,557 @@ FILTERFUNC(flop) {
 		}
 	}
 }
+FILTERMONO(flop) {
+	DEBUG(1, "img=%p w=%d h=%d", (void*)img, w, h);
+	(void)param;
+	(void)arena;
+	int y, x;
+	for (y = 0; y < h; ++y) {
+		uint8_t *row = img + w * y;
+		for (x = 0; x < w / 2; ++x) {
+			uint8_t tmp = row[x];
+			row[x] = row[w - x - 1];
+			row[w - x - 1] = tmp;
+		}
+	}
+}
+FILTERDEF_EXT(flop, FP_GEOMETRIC | FP_MIRROR | FP_INVOLUTION | FP_LINEAR,
+              .mono = filter_mono_flop);
 
 FILTERCHK(shift) {
 	CHECK_PARAM(param.u, "pixels=%u:Must be non-zero", param.u);
 }
+FILTERNEED(shift) {
+	(void)h;
+	(void)param;
+	return (struct need_t){ .scratch = w * sizeof(uint32_t) };
+}
 FILTERFUNC(shift) {
 	DEBUG(1, "img=%p w=%d w=%d n=%d", (void*)img, w, h, param.u);
-	int y, x;
-	int n = param.u;
-	uint32_t *tmp = malloc(w * sizeof(*tmp));
+	int y;
+	/* odd rows rotate left and even rows right, by n mod w pixels */
+	int n = ((int32_t)param.u % w + w) % w;
+	uint32_t *tmp = arena->scratch;
 
+	if (!n)
+		return;
 	for (y = 0; y < h; ++y) {
 		uint32_t *row = img + w * y;
 		if (y % 2) {
-			memcpy(tmp, row, n);
-			for (x = 0; x < w - n - 1; ++x)
-				row[x] = row[x + n];
-			memcpy(row + w - n, tmp, n);
+			memcpy(tmp, row, n * sizeof(*row));
+			memmove(row, row + n, (w - n) * sizeof(*row));
+			memcpy(row + w - n, tmp, n * sizeof(*row));
 		} else {
-			memcpy(tmp, row + w - n, n);
-			for (x = w - n - 1; x > n; --x)
-				row[x+n] = row[x];
-			memcpy(row, tmp, n);
+			memcpy(tmp, row + w - n, n * sizeof(*row));
+			memmove(row + n, row, (w - n) * sizeof(*row));
+			memcpy(row, tmp, n * sizeof(*row));
 		}
 	}
-	free(tmp);
 }
+FILTERDEF(shift, FP_GEOMETRIC | FP_LINEAR);
 
 FILTERCHK(null) {
 	(void)param;
 }
+FILTERNEED(null) {
+	(void)w;
+	(void)h;
+	(void)param;
+	return (struct need_t){ 0 };
+}
 FILTERFUNC(null) {
 	DEBUG(1, "img=%p w=%d w=%d", (void*)img, w, h);
+	(void)arena;
+	(void)img;
+	(void)w;
+	(void)h;
+	(void)param;
+}
+FILTERMONO(null) {
+	(void)arena;
 	(void)img;
 	(void)w;
 	(void)h;
 	(void)param;
 }
+FILTERDEF_EXT(null, FP_NOOP | FP_POINTWISE | FP_IDEMPOTENT,
+              .mono = filter_mono_null);
 
 FILTERCHK(colourise) {
 	(void)param;
 }
+FILTERNEED(colourise) {
+	(void)w;
+	(void)h;
+	(void)param;
+	return (struct need_t){ 0 };
+}
 FILTERFUNC(colourise) {
 	DEBUG(1, "img=%p w=%d w=%d color=%08x", (void*)img, w, h, param.u);
-	int x, y;
-	double aa = ((param.u >> 24) & 0xFF) / 255.0;
-	uint32_t rr = CHANR(param.u) * aa;
-	uint32_t gg = CHANG(param.u) * aa;
-	uint32_t bb = CHANB(param.u) * aa;
-
-	for (y = 0; y < h; ++y)
-	for (x = 0; x < w; ++x, ++img) {
-		int64_t r = CHANR(*img) * aa + rr;
-		int64_t g = CHANR(*img) * aa + gg;
-		int64_t b = CHANR(*img) * aa + bb;
-		
-		*img = MKRGB(r, g, b);
-	}
+	(void)arena;
+	POINTWISE(img, w, h, pix = px_colourise(pix, param););
 }
+FILTERDEF(colourise, FP_POINTWISE);
 
 FILTERCHK(invert) {
 	(void)param;
 }
+FILTERNEED(invert) {
+	(void)w;
+	(void)h;
+	(void)param;
+	return (struct need_t){ 0 };
+}
 FILTERFUNC(invert) {
 	DEBUG(1, "img=%p w=%d w=%d", (void*)img, w, h);
+	(void)arena;
+	POINTWISE(img, w, h, pix = px_invert(pix, param););
+}
+FILTERMONO(invert) {
+	DEBUG(1, "img=%p w=%d w=%d", (void*)img, w, h);
+	(void)arena;
 	(void)param;
-	int x, y;
-	for (y = 0; y < h; ++y)
-	for (x = 0; x < w; ++x, ++img) {
-		*img ^= 0xFFFFFF;
-	}
+	size_t i;
+	for (i = 0; i < (size_t)w * h; ++i)
+		img[i] = ~img[i];
+}
+FILTERPLANAR(invert) {
+	DEBUG(1, "img=%p w=%d w=%d", (void*)img, w, h);
+	(void)arena;
+	(void)param;
+	size_t i;
+	for (i = 0; i < 3 * (size_t)w * h; ++i)
+		img[i] = 0xFFFF - img[i];
 }
+FILTERDEF_EXT(invert, FP_POINTWISE | FP_INVOLUTION,
+              .mono = filter_mono_invert, .planar = filter_planar_invert);
 
 FILTERCHK(noise) {
 	CHECK_PARAM(param.u <= 0xFF, "noise=0x%04x:Must be <= 0xFF", param.u);
 }
+FILTERNEED(noise) {
+	(void)w;
+	(void)h;
+	(void)param;
+	return (struct need_t){ 0 };
+}
+/*
+ * With NOISE_LUT in the plan, the residues of the draws come from a
+ * table of v % n rather than from three divisions a pixel; the draws,
+ * and so the output, are the same.
+ */
+static const uint8_t *
+noise_table(uint8_t *mod, int n) {
+	int i;
+	if (conv_get_plan()->noise != NOISE_LUT)
+		return NULL;
+	for (i = 0; i < 256; ++i)
+		mod[i] = i % n;
+	return mod;
+}
+#define NOISE_MOD(v) (mod ? mod[v] : (v) % n)
+
 FILTERFUNC(noise) {
 	DEBUG(1, "img=%p w=%d w=%d level=%02x", (void*)img, w, h, param.u);
+	(void)arena;
+	uint8_t tab[256];
+	const uint8_t *mod = noise_table(tab, param.u);
+	if (mod) {
+		POINTWISE(img, w, h, pix = px_noise_lut(pix, mod););
+		return;
+	}
+	POINTWISE(img, w, h, pix = px_noise(pix, param););
+}
+/* on a grey frame, the noise is grey as well */
+FILTERMONO(noise) {
+	DEBUG(1, "img=%p w=%d w=%d level=%02x", (void*)img, w, h, param.u);
+	(void)arena;
 	int n = param.u;
-	int x, y;
-	for (y = 0; y < h; ++y)
-	for (x = 0; x < w; ++x, ++img) {
+	uint8_t tab[256];
+	const uint8_t *mod = noise_table(tab, n);
+	size_t i;
+	for (i = 0; i < (size_t)w * h; ++i) {
 		uint32_t base = rand();
-		int32_t r = CHANR(*img) + (CHANR(base) % n) * ((base & 0x01000000) ? 1 : -1);
-		int32_t g = CHANG(*img) + (CHANG(base) % n) * ((base & 0x02000000) ? 1 : -1);
-		int32_t b = CHANB(*img) + (CHANB(base) % n) * ((base & 0x04000000) ? 1 : -1);
-		*img = MKRGB(r, g, b);
+		int32_t v = img[i] + NOISE_MOD(CHANR(base)) * ((base & 0x01000000) ? 1 : -1);
+		img[i] = CLAMP(v);
 	}
 }
+/* the same draws as on XRGB, in steps of one 8-bit level */
+FILTERPLANAR(noise) {
+	DEBUG(1, "img=%p w=%d w=%d level=%02x", (void*)img, w, h, param.u);
+	(void)arena;
+	int n = param.u;
+	uint8_t tab[256];
+	const uint8_t *mod = noise_table(tab, n);
+	size_t i, len = (size_t)w * h;
+	uint16_t *r = img, *g = r + len, *b = g + len;
+	for (i = 0; i < len; ++i) {
+		uint32_t base = rand();
+		int32_t dr = NOISE_MOD(CHANR(base)) * ((base & 0x01000000) ? 257 : -257);
+		int32_t dg = NOISE_MOD(CHANG(base)) * ((base & 0x02000000) ? 257 : -257);
+		int32_t db = NOISE_MOD(CHANB(base)) * ((base & 0x04000000) ? 257 : -257);
+		r[i] = CLAMP16(r[i] + dr);
+		g[i] = CLAMP16(g[i] + dg);
+		b[i] = CLAMP16(b[i] + db);
+	}
+}
+FILTERDEF_EXT(noise, FP_POINTWISE,
+              .mono = filter_mono_noise, .planar = filter_planar_noise);
 
 FILTERCHK(greyscale) {
 	(void)param;
 }
+FILTERNEED(greyscale) {
+	(void)w;
+	(void)h;
+	(void)param;
+	return (struct need_t){ 0 };
+}
 FILTERFUNC(greyscale) {
 	DEBUG(1, "img=%p w=%d w=%d", (void*)img, w, h);
+	(void)arena;
+	POINTWISE(img, w, h, pix = px_greyscale(pix, param););
+}
+FILTERMONO(greyscale) {
+	DEBUG(1, "img=%p w=%d w=%d", (void*)img, w, h);
+	(void)arena;
 	(void)param;
-	int x, y;
+	size_t i;
+	for (i = 0; i < (size_t)w * h; ++i)
+		img[i] = luma(img[i] * 0x010101);
+}
+FILTERDEF_EXT(greyscale, FP_POINTWISE | FP_LINEAR | FP_IDEMPOTENT | FP_GREY,
+              .mono = filter_mono_greyscale);
+
+const struct matrix_t matrix_sepia = {{
+	{ .393, .769, .189, 0 },
+	{ .349, .686, .168, 0 },
+	{ .272, .534, .131, 0 },
+}};
+const struct matrix_t matrix_greyscale = {{
+	{ .30, .58, .12, 0 },
+	{ .30, .58, .12, 0 },
+	{ .30, .58, .12, 0 },
+}};
+const struct matrix_t matrix_invert = {{
+	{ -1,  0,  0, 0xFF },
+	{  0, -1,  0, 0xFF },
+	{  0,  0, -1, 0xFF },
+}};
+
+/* the matrix of a point-wise colour stage, or false if it has none */
+bool
+colour_matrix(const struct filter_t *f, struct matrix_t *m) {
+	if (f->def == &filterdef_matrix) {
+		*m = *f->param.m;
+	} else if (f->def == &filterdef_greyscale) {
+		*m = matrix_greyscale;
+	} else if (f->def == &filterdef_invert) {
+		*m = matrix_invert;
+	} else if (f->def == &filterdef_colourise) {
+		double aa = ((f->param.u >> 24) & 0xFF) / 255.0;
+		*m = (struct matrix_t){{
+			{ aa, 0, 0, (uint32_t)(CHANR(f->param.u) * aa) },
+			{ 0, aa, 0, (uint32_t)(CHANG(f->param.u) * aa) },
+			{ 0, 0, aa, (uint32_t)(CHANB(f->param.u) * aa) },
+		}};
+	} else {
+		return false;
+	}
+	return true;
+}
+
+FILTERCHK(matrix) {
+	const struct matrix_t *m = param.m;
+	int c, k;
+	for (c = 0; c < 3; ++c) {
+		for (k = 0; k < 3; ++k)
+			CHECK_PARAM(fabs(m->m[c][k]) <= MATRIX_MAXCOEF,
+			            "%g: coefficients must be within ±%g", m->m[c][k], MATRIX_MAXCOEF);
+		CHECK_PARAM(fabs(m->m[c][3]) <= MATRIX_MAXOFFSET,
+		            "%g: offsets must be within ±%g", m->m[c][3], MATRIX_MAXOFFSET);
+	}
+}
+FILTERNEED(matrix) {
+	(void)w;
+	(void)h;
+	(void)param;
+	return (struct need_t){ 0 };
+}
+FILTERFUNC(matrix) {
+	DEBUG(1, "img=%p w=%d w=%d", (void*)img, w, h);
+	(void)arena;
+	conv_matrix(img, (size_t)w * h, param.m);
+}
+FILTERDEF(matrix, FP_POINTWISE);
+
+/* a grey stage followed by one that can run on the luma plane, which
+ * is gamma encoded, so not in linear light */
+static bool
+grey_run(const struct filter_t *filters, int n, int i) {
+	return !conf.linear && (filters[i].def->flags & FP_GREY)
+	    && i + 1 < n && filters[i + 1].def && filters[i + 1].def->mono;
+}
+
+static bool
+spatial_planar(const struct filter_t *f) {
+	return f->def && f->def->planar && !(f->def->flags & FP_POINTWISE);
+}
+
+/* two or more spatial stages in a row that can run on the channel
+ * planes; a lone one converts only the rows it is working on, see
+ * gaussian. Pointwise stages with a planar function carry a run on,
+ * but do not start one */
+static bool
+planar_run(const struct filter_t *filters, int n, int i) {
+	return spatial_planar(&filters[i]) && i + 1 < n && spatial_planar(&filters[i + 1]);
+}
+
+/* whether a deep frame can be filtered on its planes, see apply_planar */
+bool
+planar_chain(const struct filter_t *filters, int n) {
+	int i;
+	if (conf.linear)
+		return false;
+	for (i = 0; i < n && filters[i].def; ++i) {
+		if (!filters[i].def->planar)
+			return false;
+	}
+	return true;
+}
+
+void
+arena_init(struct arena_t *arena, int w, int h, const struct filter_t *filters, int n) {
+	bool alt = false;
+	bool grey = false;
+	bool planar = false;
+	int i;
 
-	for (y = 0; y < h; ++y)
-	for (x = 0; x < w; ++x, ++img) {
-		int64_t pix = CLAMP(
-		      CHANR(*img) * .30
-		    + CHANG(*img) * .58
-		    + CHANB(*img) * .12
-		);
-		*img = MKRGB(pix, pix, pix);
+	arena->w = w;
+	arena->h = h;
+	arena->scratchlen = 0;
+	for (i = 0; i < n && filters[i].def; ++i) {
+		struct need_t need = filters[i].def->need(w, h, filters[i].param);
+		if (need.scratch > arena->scratchlen)
+			arena->scratchlen = need.scratch;
+		alt |= need.alt;
+		grey |= grey_run(filters, n, i);
+		planar |= planar_run(filters, n, i);
 	}
+	DEBUG(1, "w=%d h=%d alt=%d scratch=%zu grey=%d planar=%d",
+	      w, h, alt, arena->scratchlen, grey, planar);
+
+	arena->img = frame_alloc(w * h * sizeof(uint32_t));
+	arena->alt = alt ? frame_alloc(w * h * sizeof(uint32_t)) : NULL;
+	arena->scratch = arena->scratchlen ? frame_alloc(arena->scratchlen) : NULL;
+	arena->grey = grey ? frame_alloc(2 * w * h) : NULL;
+	arena->greyalt = grey ? arena->grey + w * h : NULL;
+	arena->plane = planar ? frame_alloc(4 * w * h * sizeof(uint16_t)) : NULL;
+}
+
+/* the channel planes, for a frame that comes as planes */
+void
+arena_planes(struct arena_t *arena) {
+	if (!arena->plane)
+		arena->plane = frame_alloc(4 * arena->w * arena->h * sizeof(uint16_t));
+}
+
+/* the returned frame is the caller's, to be released with frame_free */
+uint32_t *
+arena_finish(struct arena_t *arena) {
+	uint32_t *img = arena->img;
+	frame_free(arena->alt, arena->w * arena->h * sizeof(uint32_t));
+	frame_free(arena->scratch, arena->scratchlen);
+	frame_free(arena->grey < arena->greyalt ? arena->grey : arena->greyalt,
+	           2 * arena->w * arena->h);
+	arena->img = arena->alt = NULL;
+	arena->scratch = NULL;
+	frame_free(arena->plane, 4 * arena->w * arena->h * sizeof(uint16_t));
+	arena->grey = arena->greyalt = NULL;
+	arena->plane = NULL;
+	return img;
+}
+
+static int
+gcd(int a, int b) {
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+#define STRIP_MAXALIGN 64
+
+/*
+ * Rows at the edges of a strip that the chain gets wrong when run on
+ * the strip alone rather than on the whole frame, or -1 if some stage
+ * needs the whole frame. Strips, and the rows around them, must start
+ * on multiples of *align, for pixelate blocks and the odd rows of
+ * shift to fall where they would on the whole frame.
+ */
+int
+strip_halo(const struct filter_t *filters, int n, int *align) {
+	int i, halo = 0, a = 1;
+
+	for (i = 0; i < n && filters[i].def; ++i) {
+		const struct filterdef_t *def = filters[i].def;
+		int u1 = filters[i].param.us.u1;
+		int u2 = filters[i].param.us.u2;
+
+		if ((def->flags & FP_POINTWISE) || def == &filterdef_flop) {
+			continue;
+		} else if (def == &filterdef_shift) {
+			a = a / gcd(a, 2) * 2;
+		} else if (def == &filterdef_gaussian) {
+			halo += u1;
+		} else if (def == &filterdef_edge) {
+			halo += 1;
+		} else if (def == &filterdef_kernel) {
+			halo += filters[i].param.k->h - 1 - (filters[i].param.k->h - 1) / 2;
+		} else if (def == &filterdef_pixelate) {
+			a = a / gcd(a, u1) * u1;
+			halo = ROUNDUP(halo, u1);
+		} else if (def == &filterdef_blurpix) {
+			a = a / gcd(a, u2) * u2;
+			halo = ROUNDUP(halo + u1, u2);
+		} else {
+			return -1;
+		}
+		if (a > STRIP_MAXALIGN)
+			return -1;
+	}
+	*align = a;
+	return ROUNDUP(halo, a);
+}
+
+#define POINT(name, ...) \
+	pix = px_##name(pix, (union fparam_t){ __VA_ARGS__ });
+#define STAGE(name, ...) \
+	filter_##name(arena->img, w, h, (union fparam_t){ __VA_ARGS__ }, arena)
+
+#include "defchain.h"
+
+static void
+grey_pack(struct arena_t *arena) {
+	size_t i, n = (size_t)arena->w * arena->h;
+	for (i = 0; i < n; ++i)
+		arena->grey[i] = luma(arena->img[i]);
+}
+
+static void
+grey_expand(struct arena_t *arena) {
+	size_t i, n = (size_t)arena->w * arena->h;
+	for (i = 0; i < n; ++i)
+		arena->img[i] = arena->grey[i] * 0x010101;
 }
 
+static void
+planar_pack(struct arena_t *arena) {
+	size_t i, n = (size_t)arena->w * arena->h;
+	uint16_t *r = arena->plane, *g = r + n, *b = g + n;
+	if (conf.linear) {
+		for (i = 0; i < n; ++i) {
+			uint32_t pix = arena->img[i];
+			r[i] = srgb_to_lin[CHANR(pix)];
+			g[i] = srgb_to_lin[CHANG(pix)];
+			b[i] = srgb_to_lin[CHANB(pix)];
+		}
+		return;
+	}
+	for (i = 0; i < n; ++i) {
+		uint32_t pix = arena->img[i];
+		r[i] = CHANR(pix) * 257;
+		g[i] = CHANG(pix) * 257;
+		b[i] = CHANB(pix) * 257;
+	}
+}
+
+static void
+planar_unpack(struct arena_t *arena) {
+	size_t i, n = (size_t)arena->w * arena->h;
+	uint16_t *r = arena->plane, *g = r + n, *b = g + n;
+	if (conf.linear) {
+		for (i = 0; i < n; ++i)
+			arena->img[i] = (uint32_t)lin_to_srgb[r[i]] << 16
+			              | (uint32_t)lin_to_srgb[g[i]] << 8
+			              | lin_to_srgb[b[i]];
+		return;
+	}
+	for (i = 0; i < n; ++i)
+		arena->img[i] = (r[i] + 128) / 257 << 16
+		              | (g[i] + 128) / 257 << 8
+		              | (b[i] + 128) / 257;
+}
+
+/*
+ * Once a grey stage has run, the frame is carried as an 8-bit luma
+ * plane through the stages after it that have a mono function, and is
+ * expanded back to XRGB before the first one that has not, or at the
+ * end of the chain.
+ *
+ * Likewise, a run of two or more spatial stages works on three 16-bit
+ * channel planes, converted from XRGB once on entry and back once on
+ * exit, so chained blurs do not round to 8 bits after every pass; the
+ * result is within a level per stage of running the stages on XRGB.
+ * With --linear, the planes hold linear light, and the compiled default
+ * chain is not used.
+ */
 void
-apply_filters(uint32_t *img, int w, int h, struct filter_t *filters, int n) {
+apply_filters(struct arena_t *arena, const struct filter_t *filters, int n) {
+	bool grey = false;
+	bool planar = false;
 	int i;
+
+	if (conf.defchain && !conf.linear && filters == conf.filters) {
+		apply_default_filters(arena);
+		return;
+	}
 	for (i = 0; i < n; ++i) {
-		if (!filters[i].function)
+		const struct filterdef_t *def = filters[i].def;
+		if (!def)
 			break;
-		filters[i].function(img, w, h, filters[i].param);
+		if (grey && !def->mono) {
+			grey_expand(arena);
+			grey = false;
+		}
+		if (planar && !def->planar) {
+			planar_unpack(arena);
+			planar = false;
+		}
+		if (grey) {
+			def->mono(arena->grey, arena->w, arena->h, filters[i].param, arena);
+		} else if (planar) {
+			def->planar(arena->plane, arena->w, arena->h, filters[i].param, arena);
+		} else if (grey_run(filters, n, i)) {
+			grey_pack(arena);
+			grey = true;
+		} else if (planar_run(filters, n, i)) {
+			planar_pack(arena);
+			planar = true;
+			def->planar(arena->plane, arena->w, arena->h, filters[i].param, arena);
+		} else {
+			def->function(arena->img, arena->w, arena->h, filters[i].param, arena);
+		}
 	}
+	if (grey)
+		grey_expand(arena);
+	if (planar)
+		planar_unpack(arena);
 }
 
+/*
+ * A frame of more than 8 bits per channel, decoded straight into the
+ * 16-bit planes by format_decode16, runs the whole chain there, so
+ * its low bits are kept; planar_chain tells whether every stage can.
+ * The result is within an 8-bit level per stage, and one for the
+ * input, of the frame run through the stages at 8 bits. The default
+ * chain compiled in is not used.
+ */
+void
+apply_planar(struct arena_t *arena, const struct filter_t *filters, int n) {
+	int i;
+	for (i = 0; i < n && filters[i].def; ++i)
+		filters[i].def->planar(arena->plane, arena->w, arena->h, filters[i].param, arena);
+}
@@ -0,0 +1,372 @@
+/*
+ * Copyright © 2017 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "xbluck.h"
+
+/*
+ * The filters work on 32-bit XRGB. Everything the server may hand us
+ * in ZPixmap format is converted to and from that here, with one
+ * conversion kernel per known layout so that channel shifts and widths
+ * are compile time constants. Anything else goes through the generic
+ * kernel, which reads the layout from the masks at run time.
+ *
+ * Deep formats, 32 bits per pixel with wider channels than 8 bits, can
+ * also be converted to and from the 16-bit channel planes of
+ * apply_planar, keeping every bit of a 10-bit channel. Encoding them
+ * gives native words, which are uploaded as they are.
+ */
+
+#define LOAD8(p)      ((uint32_t)(p)[0])
+#define LOAD16(p)     ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8)
+#define LOAD24(p)     (LOAD16(p) | (uint32_t)(p)[2] << 16)
+#define LOAD32(p)     (LOAD24(p) | (uint32_t)(p)[3] << 24)
+#define STORE8(p, v)  do { (p)[0] = (v); } while (0)
+#define STORE16(p, v) do { STORE8(p, v); (p)[1] = (v) >> 8; } while (0)
+#define STORE24(p, v) do { STORE16(p, v); (p)[2] = (v) >> 16; } while (0)
+#define STORE32(p, v) do { STORE24(p, v); (p)[3] = (v) >> 24; } while (0)
+
+/* widen an n-bit channel value to 8 bits, and narrow it back */
+#define WIDEN(v, n)  ((n) >= 8 ? (v) >> ((n) - 8) : (v) * 0xFF / ((1u << (n)) - 1))
+#define NARROW(v, n) ((n) >= 8 ? ((v) << ((n) - 8)) | ((v) >> (16 - (n))) : (v) >> (8 - (n)))
+#define CHAN(pix, s, n) (((pix) >> (s)) & ((1u << (n)) - 1))
+
+#define DECODE_BODY(bytes, load, rs, rn, gs, gn, bs, bn) \
+	for (y = 0; y < h; ++y) { \
+		const uint8_t *p = src + y * stride; \
+		for (x = 0; x < w; ++x, p += (bytes)) { \
+			uint32_t pix = load(p); \
+			*dst++ = WIDEN(CHAN(pix, rs, rn), rn) << 16 \
+			       | WIDEN(CHAN(pix, gs, gn), gn) <<  8 \
+			       | WIDEN(CHAN(pix, bs, bn), bn) <<  0; \
+		} \
+	}
+
+#define ENCODE_BODY(bytes, store, rs, rn, gs, gn, bs, bn) \
+	for (y = 0; y < h; ++y) { \
+		uint8_t *p = dst + y * stride; \
+		for (x = 0; x < w; ++x, p += (bytes), ++src) { \
+			uint32_t pix = NARROW((*src >> 16) & 0xFF, rn) << (rs) \
+			             | NARROW((*src >>  8) & 0xFF, gn) << (gs) \
+			             | NARROW((*src >>  0) & 0xFF, bn) << (bs); \
+			store(p, pix); \
+		} \
+	}
+
+#define PIXFMT(name, bpp, rs, rn, gs, gn, bs, bn) \
+static void \
+decode_##name(uint32_t *dst, const uint8_t *src, size_t stride, int w, int h) { \
+	int x, y; \
+	DECODE_BODY(bpp / 8, LOAD##bpp, rs, rn, gs, gn, bs, bn) \
+} \
+static void \
+encode_##name(uint8_t *dst, const uint32_t *src, size_t stride, int w, int h) { \
+	int x, y; \
+	ENCODE_BODY(bpp / 8, STORE##bpp, rs, rn, gs, gn, bs, bn) \
+}
+
+PIXFMT(bgrx8888,    32,  0, 8,  8, 8, 16, 8)
+PIXFMT(xrgb2101010, 32, 20, 10, 10, 10, 0, 10)
+PIXFMT(rgb888,      24, 16, 8,  8, 8,  0, 8)
+PIXFMT(rgb565,      16, 11, 5,  5, 6,  0, 5)
+PIXFMT(rgb555,      16, 10, 5,  5, 5,  0, 5)
+
+/* an n-bit channel value to 16 bits and back, rounded to nearest */
+#define WIDEN16(v, n)  (((v) * 0xFFFF + ((1u << (n)) - 1) / 2) / ((1u << (n)) - 1))
+#define NARROW16(v, n) (((v) * ((1u << (n)) - 1) + 0x7FFF) / 0xFFFF)
+
+#define DECODE16_BODY(load, rs, rn, gs, gn, bs, bn) \
+	for (y = 0; y < h; ++y) { \
+		const uint8_t *p = src + y * stride; \
+		for (x = 0; x < w; ++x, p += 4, ++i) { \
+			uint32_t pix = load(p); \
+			r[i] = WIDEN16(CHAN(pix, rs, rn), rn); \
+			g[i] = WIDEN16(CHAN(pix, gs, gn), gn); \
+			b[i] = WIDEN16(CHAN(pix, bs, bn), bn); \
+		} \
+	}
+
+#define ENCODE16_BODY(store, rs, rn, gs, gn, bs, bn) \
+	for (i = 0; i < n; ++i) { \
+		uint32_t pix = NARROW16(r[i], rn) << (rs) \
+		             | NARROW16(g[i], gn) << (gs) \
+		             | NARROW16(b[i], bn) << (bs); \
+		store((uint8_t*)dst + 4 * i, pix); \
+	}
+
+static void
+decode16_xrgb2101010(uint16_t *r, uint16_t *g, uint16_t *b, const uint8_t *src, size_t stride,
+                     int w, int h) {
+	size_t i = 0;
+	int x, y;
+	DECODE16_BODY(LOAD32, 20, 10, 10, 10, 0, 10)
+}
+
+static void
+encode16_xrgb2101010(uint32_t *dst, const uint16_t *r, const uint16_t *g, const uint16_t *b,
+                     size_t n) {
+	size_t i;
+	ENCODE16_BODY(STORE32, 20, 10, 10, 10, 0, 10)
+}
+
+/* msb first byte order, only ever seen by the generic kernel */
+#define LOADMSB(p) (bytes == 4 ? (uint32_t)(p)[0] << 24 | (uint32_t)(p)[1] << 16 | (uint32_t)(p)[2] << 8 | (p)[3] \
+                  : bytes == 3 ? (uint32_t)(p)[0] << 16 | (uint32_t)(p)[1] << 8 | (p)[2] \
+                  : bytes == 2 ? (uint32_t)(p)[0] << 8 | (p)[1] : (p)[0])
+#define LOADLSB(p) (bytes == 4 ? LOAD32(p) : bytes == 3 ? LOAD24(p) : bytes == 2 ? LOAD16(p) : LOAD8(p))
+#define STOREMSB(p, v) do { \
+	int _i; \
+	for (_i = 0; _i < bytes; ++_i) (p)[_i] = (v) >> (8 * (bytes - _i - 1)); \
+} while (0)
+#define STORELSB(p, v) do { \
+	int _i; \
+	for (_i = 0; _i < bytes; ++_i) (p)[_i] = (v) >> (8 * _i); \
+} while (0)
+
+static void
+decode_generic(const struct pixfmt_t *fmt, uint32_t *dst, const uint8_t *src, size_t stride, int w, int h) {
+	const struct chan_t *c = fmt->chan;
+	int bytes = fmt->bpp / 8;
+	int x, y;
+	if (fmt->msb) {
+		DECODE_BODY(bytes, LOADMSB, c[0].s, c[0].n, c[1].s, c[1].n, c[2].s, c[2].n)
+	} else {
+		DECODE_BODY(bytes, LOADLSB, c[0].s, c[0].n, c[1].s, c[1].n, c[2].s, c[2].n)
+	}
+}
+
+static void
+encode_generic(const struct pixfmt_t *fmt, uint8_t *dst, const uint32_t *src, size_t stride, int w, int h) {
+	const struct chan_t *c = fmt->chan;
+	int bytes = fmt->bpp / 8;
+	int x, y;
+	if (fmt->msb) {
+		ENCODE_BODY(bytes, STOREMSB, c[0].s, c[0].n, c[1].s, c[1].n, c[2].s, c[2].n)
+	} else {
+		ENCODE_BODY(bytes, STORELSB, c[0].s, c[0].n, c[1].s, c[1].n, c[2].s, c[2].n)
+	}
+}
+
+static void
+decode16_generic(const struct pixfmt_t *fmt, uint16_t *r, uint16_t *g, uint16_t *b,
+                 const uint8_t *src, size_t stride, int w, int h) {
+	const struct chan_t *c = fmt->chan;
+	int bytes = 4;
+	size_t i = 0;
+	int x, y;
+	if (fmt->msb) {
+		DECODE16_BODY(LOADMSB, c[0].s, c[0].n, c[1].s, c[1].n, c[2].s, c[2].n)
+	} else {
+		DECODE16_BODY(LOADLSB, c[0].s, c[0].n, c[1].s, c[1].n, c[2].s, c[2].n)
+	}
+}
+
+static void
+encode16_generic(const struct pixfmt_t *fmt, uint32_t *dst, const uint16_t *r, const uint16_t *g,
+                 const uint16_t *b, size_t n) {
+	const struct chan_t *c = fmt->chan;
+	int bytes = 4;
+	size_t i;
+	if (fmt->msb) {
+		ENCODE16_BODY(STOREMSB, c[0].s, c[0].n, c[1].s, c[1].n, c[2].s, c[2].n)
+	} else {
+		ENCODE16_BODY(STORELSB, c[0].s, c[0].n, c[1].s, c[1].n, c[2].s, c[2].n)
+	}
+}
+
+enum {
+	FMT_GENERIC,
+	FMT_XRGB8888,
+	FMT_BGRX8888,
+	FMT_XRGB2101010,
+	FMT_RGB888,
+	FMT_RGB565,
+	FMT_RGB555,
+};
+
+static const struct {
+	int bpp;
+	uint32_t r, g, b;
+} known[] = {
+	[FMT_XRGB8888]    = { 32, 0xFF0000,   0x00FF00, 0x0000FF },
+	[FMT_BGRX8888]    = { 32, 0x0000FF,   0x00FF00, 0xFF0000 },
+	[FMT_XRGB2101010] = { 32, 0x3FF00000, 0x000FFC00, 0x000003FF },
+	[FMT_RGB888]      = { 24, 0xFF0000,   0x00FF00, 0x0000FF },
+	[FMT_RGB565]      = { 16, 0xF800,     0x07E0,   0x001F },
+	[FMT_RGB555]      = { 16, 0x7C00,     0x03E0,   0x001F },
+};
+
+static int
+mask_to_chan(uint32_t mask, struct chan_t *c) {
+	if (!mask)
+		return -1;
+	for (c->s = 0; !(mask & 1); mask >>= 1)
+		++c->s;
+	for (c->n = 0; mask & 1; mask >>= 1)
+		++c->n;
+	/* non-contiguous masks, or wider than the 16 bits NARROW copes with */
+	return mask || c->n > 16 ? -1 : 0;
+}
+
+int
+format_init(struct pixfmt_t *fmt, int depth, int bpp, int pad, bool msb,
+            uint32_t rmask, uint32_t gmask, uint32_t bmask) {
+	size_t i;
+
+	fmt->depth = depth;
+	fmt->bpp = bpp;
+	fmt->pad = pad;
+	fmt->msb = msb;
+	fmt->id = FMT_GENERIC;
+
+	if (bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32)
+		return -1;
+	if (pad % 8)
+		return -1;
+	if (mask_to_chan(rmask, &fmt->chan[0]) < 0
+	 || mask_to_chan(gmask, &fmt->chan[1]) < 0
+	 || mask_to_chan(bmask, &fmt->chan[2]) < 0)
+		return -1;
+
+	for (i = 1; i < LENGTH(known) && (!msb || bpp == 8); ++i) {
+		if (known[i].bpp == bpp
+		 && known[i].r == rmask
+		 && known[i].g == gmask
+		 && known[i].b == bmask) {
+			fmt->id = i;
+			break;
+		}
+	}
+	DEBUG(1, "depth=%d bpp=%d pad=%d msb=%d masks=%06x/%06x/%06x kernel=%d",
+	      depth, bpp, pad, msb, rmask, gmask, bmask, fmt->id);
+	return 0;
+}
+
+size_t
+format_stride(const struct pixfmt_t *fmt, int w) {
+	size_t bits = (size_t)w * fmt->bpp;
+	return (bits + fmt->pad - 1) / fmt->pad * fmt->pad / 8;
+}
+
+bool
+format_is_native(const struct pixfmt_t *fmt, int w) {
+	return fmt->id == FMT_XRGB8888 && format_stride(fmt, w) == w * sizeof(uint32_t);
+}
+
+/* more than 8 bits in a channel, in 32-bit words that rows never pad */
+bool
+format_is_deep(const struct pixfmt_t *fmt) {
+	return fmt->bpp == 32 && fmt->pad <= 32
+	    && (fmt->chan[0].n > 8 || fmt->chan[1].n > 8 || fmt->chan[2].n > 8);
+}
+
+/* into three w×h planes, for a deep format */
+void
+format_decode16(const struct pixfmt_t *fmt, uint16_t *planes, const uint8_t *src, int w, int h) {
+	size_t n = (size_t)w * h;
+
+	if (fmt->id == FMT_XRGB2101010)
+		decode16_xrgb2101010(planes, planes + n, planes + 2 * n, src, w * 4, w, h);
+	else
+		decode16_generic(fmt, planes, planes + n, planes + 2 * n, src, w * 4, w, h);
+}
+
+/* native words in the byte order of the server, to be uploaded as
+ * they are, for a deep format */
+void
+format_encode16(const struct pixfmt_t *fmt, uint32_t *dst, const uint16_t *planes, int w, int h) {
+	size_t n = (size_t)w * h;
+
+	if (fmt->id == FMT_XRGB2101010)
+		encode16_xrgb2101010(dst, planes, planes + n, planes + 2 * n, n);
+	else
+		encode16_generic(fmt, dst, planes, planes + n, planes + 2 * n, n);
+}
+
+void
+format_decode(const struct pixfmt_t *fmt, uint32_t *dst, const uint8_t *src, int w, int h) {
+	size_t stride = format_stride(fmt, w);
+
+	switch (fmt->id) {
+	case FMT_XRGB8888:
+		if (stride == w * sizeof(uint32_t)) {
+			memcpy(dst, src, stride * h);
+		} else {
+			int y;
+			for (y = 0; y < h; ++y)
+				memcpy(dst + y * w, src + y * stride, w * sizeof(uint32_t));
+		}
+		break;
+	case FMT_BGRX8888:
+		decode_bgrx8888(dst, src, stride, w, h);
+		break;
+	case FMT_XRGB2101010:
+		decode_xrgb2101010(dst, src, stride, w, h);
+		break;
+	case FMT_RGB888:
+		decode_rgb888(dst, src, stride, w, h);
+		break;
+	case FMT_RGB565:
+		decode_rgb565(dst, src, stride, w, h);
+		break;
+	case FMT_RGB555:
+		decode_rgb555(dst, src, stride, w, h);
+		break;
+	default:
+		decode_generic(fmt, dst, src, stride, w, h);
+	}
+}
+
+void
+format_encode(const struct pixfmt_t *fmt, uint8_t *dst, const uint32_t *src, int w, int h) {
+	size_t stride = format_stride(fmt, w);
+
+	if (stride * 8 != (size_t)w * fmt->bpp)
+		memset(dst, 0, stride * h);
+
+	switch (fmt->id) {
+	case FMT_XRGB8888:
+		if (stride == w * sizeof(uint32_t)) {
+			memcpy(dst, src, stride * h);
+		} else {
+			int y;
+			for (y = 0; y < h; ++y)
+				memcpy(dst + y * stride, src + y * w, w * sizeof(uint32_t));
+		}
+		break;
+	case FMT_BGRX8888:
+		encode_bgrx8888(dst, src, stride, w, h);
+		break;
+	case FMT_XRGB2101010:
+		encode_xrgb2101010(dst, src, stride, w, h);
+		break;
+	case FMT_RGB888:
+		encode_rgb888(dst, src, stride, w, h);
+		break;
+	case FMT_RGB565:
+		encode_rgb565(dst, src, stride, w, h);
+		break;
+	case FMT_RGB555:
+		encode_rgb555(dst, src, stride, w, h);
+		break;
+	default:
+		encode_generic(fmt, dst, src, stride, w, h);
+	}
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright © 2017 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xbluck.h"
+
+extern struct options_t conf;
+extern int state;
+
+/*
+ * Log lines are formatted on the caller's stack and queued in a fixed
+ * ring, which a writer thread drains to a descriptor it keeps open for
+ * the whole lock. The event loop only ever takes the lock to copy a
+ * line in: opening the logfile and writing to it, which can block for
+ * long on network file systems, happen on the writer thread. A line
+ * that does not fit in the ring is dropped and counted.
+ */
+
+#define LOG_RING 8192
+
+static struct {
+	bool enabled;
+	bool running;
+	bool done;
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	char ring[LOG_RING];
+	size_t head, tail;  /* read and write counters, mod LOG_RING */
+	size_t dropped;
+} lg = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.fd = -1,
+};
+
+static void
+write_all(const char *buf, size_t len) {
+	ssize_t ret;
+
+	while (len) {
+		if ((ret = write(lg.fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("write %s", conf.logfile);
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static void *
+writer(void *arg) {
+	char buf[LOG_RING];
+	size_t len;
+
+	(void)arg;
+	if (conf.logfile && conf.logfile[0]) {
+		lg.fd = open(conf.logfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+		if (lg.fd < 0)
+			warn("open %s", conf.logfile);
+	}
+	if (lg.fd < 0)
+		lg.fd = STDERR_FILENO;
+
+	pthread_mutex_lock(&lg.mutex);
+	for (;;) {
+		while (lg.head == lg.tail && !lg.done)
+			pthread_cond_wait(&lg.cond, &lg.mutex);
+		if (lg.head == lg.tail)
+			break;
+		for (len = 0; lg.head != lg.tail; ++lg.head)
+			buf[len++] = lg.ring[lg.head % LOG_RING];
+		pthread_mutex_unlock(&lg.mutex);
+		write_all(buf, len);
+		pthread_mutex_lock(&lg.mutex);
+	}
+	pthread_mutex_unlock(&lg.mutex);
+
+	if (lg.fd != STDERR_FILENO && close(lg.fd) < 0)
+		warn("close %s", conf.logfile);
+	return NULL;
+}
+
+void
+log_init() {
+	sigset_t all, old;
+	int ret;
+
+	lg.enabled = (conf.logfile && conf.logfile[0]) || conf.verbose;
+	if (!lg.enabled)
+		return;
+	/* localtime would otherwise read the zone file on the first line */
+	tzset();
+
+	/* signals are for the event loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&lg.thread, NULL, writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		errno = ret;
+		err(1, "pthread_create");
+	}
+	lg.running = true;
+}
+
+bool
+log_enabled() {
+	return lg.enabled;
+}
+
+void
+log_write(const char *buf, size_t len) {
+	size_t i;
+
+	if (!lg.running)
+		return;
+	pthread_mutex_lock(&lg.mutex);
+	if (len > LOG_RING - (lg.tail - lg.head)) {
+		++lg.dropped;
+	} else {
+		for (i = 0; i < len; ++i)
+			lg.ring[lg.tail++ % LOG_RING] = buf[i];
+		pthread_cond_signal(&lg.cond);
+	}
+	pthread_mutex_unlock(&lg.mutex);
+}
+
+/* flush what is queued and stop the writer */
+void
+log_finish() {
+	if (!lg.running)
+		return;
+	pthread_mutex_lock(&lg.mutex);
+	lg.done = true;
+	pthread_cond_signal(&lg.cond);
+	pthread_mutex_unlock(&lg.mutex);
+	pthread_join(lg.thread, NULL);
+	lg.running = false;
+	if (lg.dropped)
+		warnx("log queue full, dropped %zu lines", lg.dropped);
+}
+
+int
+log_state() {
+	char line[64];
+	struct tm tm;
+	time_t t;
+	int len;
+
+	if (!lg.enabled) {
+		return 0;
+	}
+
+	t = time(NULL);
+	if (localtime_r(&t, &tm) && (len = strftime(line, 20, "%Y-%m-%d %H:%M:%S", &tm))) {
+		line[len++] = ' ';
+	} else {
+		len = snprintf(line, sizeof(line), "%ld", (long)t);
+	}
+
+	switch (state) {
+	case STATE_FAILED:
+		len += snprintf(line + len, sizeof(line) - len, "failed attempt\n");
+		break;
+	case STATE_LOCKED:
+		len += snprintf(line + len, sizeof(line) - len, "locked\n");
+		break;
+	case STATE_UNLOCK:
+		len += snprintf(line + len, sizeof(line) - len, "unlock\n");
+		break;
+	}
+
+	log_write(line, len);
+	return len;
+}
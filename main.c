@@ -37,9 +37,10 @@ int state = STATE_LOCKED;
 int
 main(int argc, char **argv) {
 
+	bench_init();
 	parse_options(argc, argv);
 
-	if (conf.hash && conf.hash[0] != '\0' && crypt("", conf.hash)) {
+	if (conf.hash && conf.hash[0] != '\0' && hash_is_valid(conf.hash)) {
 		DEBUG(3, "HASH=%s", conf.hash);
 		auth.hash = conf.hash;
 	} else {
@@ -47,16 +48,21 @@ main(int argc, char **argv) {
 		if (init_auth() < 0) {
 			errx(1, "Unable to initialize auth");
 		}
-		if (!crypt("", auth.hash)) {
-			err(1, "crypt %s", auth.hash);
+		if (!hash_is_valid(auth.hash)) {
+			errx(1, "not a password hash crypt(3) can check");
 		}
 #endif
 	}
 	drop_priv();
+	log_init();
+	if (conf.daemon) {
+		xcb_daemon();
+	}
 	reset_input();
 	xcb_init();
 	mainloop();
 	xcb_close();
+	log_finish();
 	auth_destroy();
 
 	return 0;
@@ -30,18 +30,17 @@ struct options_t conf = { 0 };
 
 
 static void
-add_filter(void (*fn)(uint32_t *img, int w, int h, union fparam_t param),
-           void (*chk)(union fparam_t param),
-           union fparam_t param) {
+add_filter(const struct filterdef_t *def, union fparam_t param) {
 	conf.filters = realloc(conf.filters, (conf.nfilter + 1) * sizeof(struct filter_t));
-	conf.filters[conf.nfilter].function = fn;
-	conf.filters[conf.nfilter].checker = chk;
+	if (!conf.filters)
+		err(1, "realloc");
+	conf.filters[conf.nfilter].def = def;
 	conf.filters[conf.nfilter].param = param;
 	++conf.nfilter;
 }
 
-#define ADD_FILTER(name, param) \
-	add_filter(filter_##name, filter_check_##name, (union fparam_t) { param })
+#define ADD_FILTER(name, ...) \
+	add_filter(&filterdef_##name, (union fparam_t) { .us = { __VA_ARGS__ } })
 
 enum {
 	OPT_COL_LOCKED,
@@ -51,10 +50,15 @@ enum {
 	OPT_COL_UNLOCK,
 	OPT_GENHASH,
 	OPT_CONF_HASH,
+	OPT_CONF_VSYNC,
+	OPT_CONF_RENDER,
+	OPT_CONF_DAEMON,
+	OPT_CONF_LINEAR,
 	OPT_CONF_QUIET       = 'q',
 	OPT_CONF_TIMEOUT     = 'T',
 	OPT_CONF_BORDER      = 'B',
 	OPT_CONF_LOGFILE     = 'L',
+	OPT_CONF_WALLPAPER   = 'W',
 	OPT_CONF_DEBUG       = 'D',
 	OPT_SHOW_USAGE       = 'h',
 	OPT_FILTER_GAUSSIAN  = 'g',
@@ -69,13 +73,15 @@ enum {
 	OPT_FILTER_FLIP      = 'F',
 	OPT_FILTER_FLOP      = 'f',
 	OPT_FILTER_EDGE      = 'E',
+	OPT_FILTER_KERNEL    = 'K',
+	OPT_FILTER_MATRIX    = 'M',
 };
-static const char optstr[] = "B:L:D::g:p:n:c:t:iSZ:GFfhE";
+static const char optstr[] = "B:L:W:D::g:p:n:c:t:iSZ:GFfhEK:M:";
 
 static void
 usage(void) {
-	printf("usage: %s [-%c timeout] [-%c logfile] [-%c borderwidth] [--hash hash] [colours] [filters]\n",
-	       program_invocation_name, OPT_CONF_TIMEOUT, OPT_CONF_LOGFILE, OPT_CONF_BORDER);
+	printf("usage: %s [-%c timeout] [-%c logfile] [-%c borderwidth] [-%c wallpaper] [--hash hash] [colours] [filters]\n",
+	       program_invocation_name, OPT_CONF_TIMEOUT, OPT_CONF_LOGFILE, OPT_CONF_BORDER, OPT_CONF_WALLPAPER);
 	printf("Options:\n");
 	printf("\t--timeout <msec> : Timeout after successfully unlocking\n");
 	printf("\t                   default: %d\n", default_timeout);
@@ -86,6 +92,19 @@ usage(void) {
 	printf("\t                   user's default. See crypt(3).\n");
 	printf("\t--genhash[=salt] : Prompts for password and prints its hash.\n");
 	printf("\t--border <width> : Width of border. default: %d\n", default_border);
+	printf("\t--wallpaper <path>\n");
+	printf("\t                 : Lock over a farbfeld or PPM image instead of\n");
+	printf("\t                   the screen. The filtered result is cached\n");
+	printf("\t                   in $XDG_CACHE_HOME/xbluck.\n");
+	printf("\t--vsync          : Show state changes at vblank, at most once\n");
+	printf("\t                   a frame, using the Present extension.\n");
+	printf("\t--render         : Blur on the X server with the RENDER\n");
+	printf("\t                   extension, if the filters are only blurs.\n");
+	printf("\t--daemon         : Stay running unlocked, keeping the filtered\n");
+	printf("\t                   screen up to date with the DAMAGE extension,\n");
+	printf("\t                   and lock on SIGUSR2.\n");
+	printf("\t--linear         : Blur, pixelate and tile in linear light\n");
+	printf("\t                   rather than on sRGB values.\n");
 	printf("\t-D               : Enable debugging, may be given multiple times\n");
 	printf("\t                   At debug level 1, any three bytes is taken\n");
 	printf("\t                   to be a valid password.\n");
@@ -98,7 +117,8 @@ usage(void) {
 	printf("Filters: If any filter(s) is given on the command line, it\n");
 	printf("will be used instead of the filter(s) given at compile time.\n");
 	printf("Multiple filters can be chained and/or repeated in any order,\n");
-	printf("and will be applied as given on the command line.\n");
+	printf("and will be applied as given on the command line, less any\n");
+	printf("stages that cancel out or repeat. -D prints the resulting plan.\n");
 	printf("\t-%c|--blur <r>           : Gaußian blur by <r> radius.\n", OPT_FILTER_GAUSSIAN);
 	printf("\t-%c|--pixelate <s>       : Pixelation of <s>x<s>\n", OPT_FILTER_PIXELATE);
 	printf("\t-%c|--colourise <colour> : Colourise image with <colour>=#AARRGGBB\n", OPT_FILTER_COLOURISE);
@@ -112,6 +132,15 @@ usage(void) {
 	printf("\t-%c|--edge               : Edge-detection\n", OPT_FILTER_EDGE);
 	printf("\t-%c|--shift <n>          : Shift every line by ±<n> pixels\n", OPT_FILTER_SHIFT);
 	printf("\t-%c|--grey               : Convert to grey-scale\n", OPT_FILTER_GREY);
+	printf("\t-%c|--kernel <taps>      : Convolve with a kernel of comma separated\n", OPT_FILTER_KERNEL);
+	printf("\t                        : taps, rows separated by ';', at most %dx%d,\n", KERNEL_MAXDIM, KERNEL_MAXDIM);
+	printf("\t                        : or %d taps in one row or column. An\n", KERNEL_MAXLEN);
+	printf("\t                        : optional /<divisor> (default: the sum\n");
+	printf("\t                        : of taps) and ±<bias> may follow.\n");
+	printf("\t-%c|--matrix <m>         : Colour matrix of 9, 12 or 16 comma\n", OPT_FILTER_MATRIX);
+	printf("\t                        : separated coefficients, row by row,\n");
+	printf("\t                        : offsets last in rows of 4; or one of\n");
+	printf("\t                        : sepia, greyscale, invert, tint:#RRGGBB\n");
 	exit(1);
 }
 
@@ -122,16 +151,23 @@ static struct option long_opts[] = {
 	{ "colourise", 1, 0, OPT_FILTER_COLOURISE },
 	{ "noise", 1, 0, OPT_FILTER_NOISE },
 	{ "tile", 1, 0, OPT_FILTER_TILE },
+	{ "kernel", 1, 0, OPT_FILTER_KERNEL },
+	{ "matrix", 1, 0, OPT_FILTER_MATRIX },
 	{ "invert", 0, 0, OPT_FILTER_INVERT },
 	{ "null", 0, 0, OPT_FILTER_NULL },
 	{ "flip", 0, 0, OPT_FILTER_FLIP },
 	{ "flop", 0, 0, OPT_FILTER_FLOP },
 	{ "edge", 0, 0, OPT_FILTER_EDGE },
 	{ "shift", 1, 0, OPT_FILTER_SHIFT },
-	{ "grey", 1, 0, OPT_FILTER_SHIFT },
+	{ "grey", 0, 0, OPT_FILTER_GREY },
 	{ "border", 1, 0, OPT_CONF_BORDER },
 	{ "timeout", 1, 0, OPT_CONF_TIMEOUT },
 	{ "logfile", 1, 0, OPT_CONF_LOGFILE },
+	{ "wallpaper", 1, 0, OPT_CONF_WALLPAPER },
+	{ "vsync", 0, 0, OPT_CONF_VSYNC },
+	{ "render", 0, 0, OPT_CONF_RENDER },
+	{ "daemon", 0, 0, OPT_CONF_DAEMON },
+	{ "linear", 0, 0, OPT_CONF_LINEAR },
 	{ "hash", 1, 0, OPT_CONF_HASH },
 	{ "debug", 2, 0, OPT_CONF_DEBUG },
 	{ "quiet", 0, 0, OPT_CONF_QUIET },
@@ -157,6 +193,91 @@ mkfpus(const char *str, struct fpus_t *us) {
 		errx(1, "Invalid argument: %s is not comma separated", str);
 	us->u2 = estrtol(end + 1, 0);
 }
+
+static const struct kernel_t *
+mkkernel(const char *str) {
+	struct kernel_t *k;
+	const char *p = str;
+	char *end;
+	int n = 0, cols = 0;
+
+	if (!(k = calloc(1, sizeof(*k))))
+		err(1, "calloc");
+	for (;;) {
+		long v;
+		errno = 0;
+		v = strtol(p, &end, 0);
+		if (errno || end == p)
+			errx(1, "Invalid kernel: %s", str);
+		if (n == KERNEL_MAXTAPS)
+			errx(1, "Invalid kernel: %s has more than %d taps", str, KERNEL_MAXTAPS);
+		k->tap[n++] = v;
+		++cols;
+		if (*(p = end) == ',') {
+			++p;
+			continue;
+		}
+		if (k->h++ == 0)
+			k->w = cols;
+		else if (cols != k->w)
+			errx(1, "Invalid kernel: %s has rows of different lengths", str);
+		cols = 0;
+		if (*p != ';')
+			break;
+		++p;
+	}
+	if (*p == '/') {
+		k->div = strtol(p + 1, &end, 0);
+		p = end;
+	}
+	if (*p == '+' || *p == '-') {
+		k->bias = strtol(p, &end, 0);
+		p = end;
+	}
+	if (*p)
+		errx(1, "Invalid kernel: %s", str);
+	return k;
+}
+
+static const struct matrix_t *
+mkmatrix(const char *str) {
+	struct matrix_t *m;
+	double v[16];
+	const char *p = str;
+	char *end;
+	int n, c, k;
+
+	if (!strcmp(str, "sepia"))
+		return &matrix_sepia;
+	if (!strcmp(str, "greyscale"))
+		return &matrix_greyscale;
+	if (!strcmp(str, "invert"))
+		return &matrix_invert;
+	if (!(m = calloc(1, sizeof(*m))))
+		err(1, "calloc");
+	if (!strncmp(str, "tint:", 5)) {
+		uint32_t u = str[5] == '#' ? estrtol(str + 6, 16) : estrtol(str + 5, 0);
+		for (c = 0; c < 3; ++c)
+			m->m[c][c] = ((u >> (16 - 8 * c)) & 0xFF) / 255.0;
+		return m;
+	}
+	for (n = 0; ; ++p) {
+		errno = 0;
+		v[n++] = strtod(p, &end);
+		if (errno || end == p)
+			errx(1, "Invalid matrix: %s", str);
+		if (*(p = end) != ',' || n == (int)LENGTH(v))
+			break;
+	}
+	if (*p || (n != 9 && n != 12 && n != 16))
+		errx(1, "Invalid matrix: %s is not 9, 12 or 16 coefficients", str);
+	if (n == 16 && (v[12] || v[13] || v[14] || v[15] != 1))
+		errx(1, "Invalid matrix: %s: the last row must be 0,0,0,1", str);
+	for (c = 0; c < 3; ++c)
+		for (k = 0; k < (n == 9 ? 3 : 4); ++k)
+			m->m[c][k] = v[c * (n == 9 ? 3 : 4) + k];
+	return m;
+}
 	
 void
 parse_options(int argc, char **argv) {
@@ -224,6 +345,21 @@ parse_options(int argc, char **argv) {
 		case OPT_CONF_LOGFILE:
 			conf.logfile = optarg;
 			break;
+		case OPT_CONF_WALLPAPER:
+			conf.wallpaper = optarg;
+			break;
+		case OPT_CONF_VSYNC:
+			conf.vsync = true;
+			break;
+		case OPT_CONF_RENDER:
+			conf.render = true;
+			break;
+		case OPT_CONF_DAEMON:
+			conf.daemon = true;
+			break;
+		case OPT_CONF_LINEAR:
+			conf.linear = true;
+			break;
 
 		case OPT_FILTER_GAUSSIAN:
 			u = estrtol(optarg, 0);
@@ -247,11 +383,17 @@ parse_options(int argc, char **argv) {
 			break;
 		case OPT_FILTER_TILE:
 			mkfpus(optarg, &us);
-			ADD_FILTER(tile, .us = us);
+			ADD_FILTER(tile, us.u1, us.u2);
 			break;
 		case OPT_FILTER_EDGE:
 			ADD_FILTER(edge, 0);
 			break;
+		case OPT_FILTER_KERNEL:
+			add_filter(&filterdef_kernel, (union fparam_t){ .k = mkkernel(optarg) });
+			break;
+		case OPT_FILTER_MATRIX:
+			add_filter(&filterdef_matrix, (union fparam_t){ .m = mkmatrix(optarg) });
+			break;
 		case OPT_FILTER_GREY:
 			ADD_FILTER(greyscale, 0);
 			break;
@@ -278,9 +420,14 @@ parse_options(int argc, char **argv) {
 	if (!conf.filters) {
 		conf.filters = (struct filter_t*)default_filters;
 		conf.nfilter = LENGTH(default_filters);
+		conf.defchain = true;
 	}
 
 	for (i = 0; i < conf.nfilter; ++i) {
-		conf.filters[i].checker(conf.filters[i].param);
+		conf.filters[i].def->checker(conf.filters[i].param);
 	}
+	if (!conf.defchain)
+		conf.nfilter = plan_filters(conf.filters, conf.nfilter);
+	if (conf.linear)
+		linear_init();
 }
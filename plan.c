@@ -0,0 +1,325 @@
+/*
+ * Copyright © 2017 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+#include "xbluck.h"
+
+extern struct options_t conf;
+
+/*
+ * Rewrite a filter chain from the command line into a cheaper one with
+ * the same output, using the FP_* properties of each stage:
+ *
+ *  - no-ops are dropped;
+ *  - an involution followed by itself cancels out, as long as every
+ *    stage between the two commutes with it;
+ *  - an idempotent stage repeated back to back runs once;
+ *  - a linear stage with a fused form, such as blur, directly followed
+ *    by a linear, idempotent reduction, such as pixelate, is replaced
+ *    by the fused form, blurpix, which never writes the blurred frame,
+ *    when the cost model below says it pays. Its output is within ±2
+ *    per channel of the two stage chain. Not in linear light, as
+ *    blurpix averages sRGB codes;
+ *  - consecutive colour stages, that is matrix, greyscale, invert and
+ *    colourise, are multiplied into one matrix, as long as the first
+ *    keeps every colour within [0, 255], so that clamping it would do
+ *    nothing. The output is within ±2 per channel of the chain, which
+ *    rounds after every stage;
+ *  - such a colour stage, being affine, commutes with the linear
+ *    stages whose weights all sum to one: moves and averages of
+ *    blocks. Blurs skip the taps outside the frame and so fade its
+ *    edges, and only a colour stage without offsets, such as grey,
+ *    commutes with them. It is moved past them to a later colour
+ *    stage it can be multiplied with, and cancels with a later copy
+ *    of itself if it is an involution. Again within ±2 per channel,
+ *    and not in linear light, where those stages are not linear in
+ *    sRGB codes.
+ *
+ * Costs are rough per pixel estimates, only used to choose between
+ * rewrites and to print with the plan.
+ */
+
+static double
+stage_cost(const struct filter_t *f) {
+	const struct filterdef_t *def = f->def;
+
+	if (def->flags & FP_NOOP)
+		return 0;
+	if (def == &filterdef_gaussian)
+		return 2.0 * (2 * f->param.us.u1 + 1);
+	if (def == &filterdef_blurpix && (f->param.us.u1 < BLURPIX_MINRAD
+	                               || f->param.us.u1 > BLURPIX_MAXRAD))
+		return 2.0 * (2 * f->param.us.u1 + 1) + 2;
+	if (def == &filterdef_blurpix)
+		return 1.0 + 2.0 * f->param.us.u1 / f->param.us.u2;
+	if (def == &filterdef_edge)
+		return 10;
+	if (def == &filterdef_kernel)
+		return f->param.k->w * f->param.k->h;
+	if (def->flags & FP_POINTWISE)
+		return 1;
+	return 2;
+}
+
+static double
+chain_cost(const struct filter_t *filters, size_t n) {
+	double cost = 0;
+	size_t i;
+	for (i = 0; i < n; ++i)
+		cost += stage_cost(&filters[i]);
+	return cost;
+}
+
+static bool
+same_stage(const struct filter_t *a, const struct filter_t *b) {
+	return a->def == b->def
+	    && a->param.us.u1 == b->param.us.u1
+	    && a->param.us.u2 == b->param.us.u2;
+}
+
+static bool matrix_in_range(const struct matrix_t *);
+
+/*
+ * a colour stage that never clips, and a linear stage that is not;
+ * past one that fades the edges, only if it has no offsets
+ */
+static bool
+affine_linear(const struct filter_t *a, const struct filter_t *b) {
+	struct matrix_t m;
+	if (conf.linear || !(b->def->flags & FP_LINEAR)
+	 || (b->def->flags & FP_POINTWISE)
+	 || !colour_matrix(a, &m) || !matrix_in_range(&m))
+		return false;
+	return !(b->def->flags & FP_FADES)
+	    || (m.m[0][3] == 0 && m.m[1][3] == 0 && m.m[2][3] == 0);
+}
+
+static bool
+commutes(const struct filter_t *fa, const struct filter_t *fb) {
+	unsigned a = fa->def->flags, b = fb->def->flags;
+
+	if (affine_linear(fa, fb) || affine_linear(fb, fa))
+		return true;
+	if ((a | b) & FP_NOOP)
+		return true;
+	if ((a & FP_MIRROR) && (b & (FP_MIRROR | FP_SYMMETRIC | FP_POINTWISE)))
+		return true;
+	if ((b & FP_MIRROR) && (a & (FP_MIRROR | FP_SYMMETRIC | FP_POINTWISE)))
+		return true;
+	if ((a & FP_GEOMETRIC) && (b & FP_POINTWISE))
+		return true;
+	if ((b & FP_GEOMETRIC) && (a & FP_POINTWISE))
+		return true;
+	return false;
+}
+
+static void
+remove_stage(struct filter_t *filters, size_t *n, size_t i) {
+	memmove(filters + i, filters + i + 1, (*n - i - 1) * sizeof(*filters));
+	--*n;
+}
+
+/* b after a */
+static void
+matrix_mul(struct matrix_t *ba, const struct matrix_t *b, const struct matrix_t *a) {
+	int c, k, j;
+	for (c = 0; c < 3; ++c) {
+		for (k = 0; k < 4; ++k) {
+			ba->m[c][k] = k == 3 ? b->m[c][3] : 0;
+			for (j = 0; j < 3; ++j)
+				ba->m[c][k] += b->m[c][j] * a->m[j][k];
+		}
+	}
+}
+
+static bool
+matrix_in_range(const struct matrix_t *a) {
+	int c, k;
+	for (c = 0; c < 3; ++c) {
+		double lo = a->m[c][3], hi = a->m[c][3];
+		for (k = 0; k < 3; ++k) {
+			if (a->m[c][k] < 0)
+				lo += a->m[c][k] * 0xFF;
+			else
+				hi += a->m[c][k] * 0xFF;
+		}
+		if (lo < -0.5 || hi > 0xFF + 0.5)
+			return false;
+	}
+	return true;
+}
+
+static bool
+matrix_fits(const struct matrix_t *a) {
+	int c, k;
+	for (c = 0; c < 3; ++c) {
+		for (k = 0; k < 3; ++k) {
+			if (a->m[c][k] < -MATRIX_MAXCOEF || a->m[c][k] > MATRIX_MAXCOEF)
+				return false;
+		}
+		if (a->m[c][3] < -MATRIX_MAXOFFSET || a->m[c][3] > MATRIX_MAXOFFSET)
+			return false;
+	}
+	return true;
+}
+
+static void
+print_plan(const char *what, const struct filter_t *filters, size_t n) {
+	char buf[1024];
+	size_t i, len = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < n && len < sizeof(buf); ++i) {
+		const struct filter_t *f = &filters[i];
+		int ret = f->def == &filterdef_matrix
+		    ? snprintf(buf + len, sizeof(buf) - len, " %s", f->def->name)
+		    : f->def == &filterdef_kernel
+		    ? snprintf(buf + len, sizeof(buf) - len, " %s(%dx%d)",
+		               f->def->name, f->param.k->w, f->param.k->h)
+		    : f->param.us.u2
+		    ? snprintf(buf + len, sizeof(buf) - len, " %s(%u,%u)",
+		               f->def->name, f->param.us.u1, f->param.us.u2)
+		    : snprintf(buf + len, sizeof(buf) - len, " %s(%u)",
+		               f->def->name, f->param.us.u1);
+		if (ret < 0)
+			break;
+		len += ret;
+	}
+	DEBUG(1, "plan: %s cost=%.1f:%s", what, chain_cost(filters, n), buf);
+}
+
+/* the stages and their parameters, for cache keys */
+uint64_t
+chain_hash(uint64_t hash, const struct filter_t *filters, int n) {
+	uint32_t version = FILTER_VERSION;
+	int i;
+
+	hash = fnv1a(hash, &version, sizeof(version));
+	for (i = 0; i < n && filters[i].def; ++i) {
+		hash = fnv1a(hash, filters[i].def->name, strlen(filters[i].def->name) + 1);
+		if (filters[i].def == &filterdef_kernel)
+			hash = fnv1a(hash, filters[i].param.k, sizeof(*filters[i].param.k));
+		else if (filters[i].def == &filterdef_matrix)
+			hash = fnv1a(hash, filters[i].param.m, sizeof(*filters[i].param.m));
+		else
+			hash = fnv1a(hash, &filters[i].param.us, sizeof(filters[i].param.us));
+	}
+	if (conf.linear)
+		hash = fnv1a(hash, "linear", sizeof("linear"));
+	return hash;
+}
+
+size_t
+plan_filters(struct filter_t *filters, size_t n) {
+	struct matrix_t a, b, ba;
+	size_t i, j;
+	bool changed;
+
+	print_plan("given", filters, n);
+
+	do {
+		changed = false;
+		for (i = 0; i < n; ++i) {
+			const struct filterdef_t *def = filters[i].def;
+
+			if (def->flags & FP_NOOP) {
+				remove_stage(filters, &n, i);
+				changed = true;
+				break;
+			}
+
+			if (i + 1 < n && (def->flags & FP_IDEMPOTENT)
+			 && same_stage(&filters[i], &filters[i + 1])) {
+				remove_stage(filters, &n, i + 1);
+				changed = true;
+				break;
+			}
+
+			if (def->flags & FP_INVOLUTION) {
+				for (j = i + 1; j < n; ++j) {
+					if (same_stage(&filters[i], &filters[j]))
+						break;
+					if (!commutes(&filters[i], &filters[j]))
+						break;
+				}
+				if (j < n && same_stage(&filters[i], &filters[j])) {
+					remove_stage(filters, &n, j);
+					remove_stage(filters, &n, i);
+					changed = true;
+					break;
+				}
+			}
+
+			if (!conf.linear && i + 1 < n && def->fused
+			 && (filters[i + 1].def->flags & (FP_LINEAR | FP_REDUCE | FP_IDEMPOTENT))
+			 == (FP_LINEAR | FP_REDUCE | FP_IDEMPOTENT)) {
+				struct filter_t fused = {
+					def->fused,
+					{ .us = { filters[i].param.u, filters[i + 1].param.u } },
+				};
+				if (stage_cost(&fused) < chain_cost(filters + i, 2)) {
+					filters[i] = fused;
+					remove_stage(filters, &n, i + 1);
+					changed = true;
+					break;
+				}
+			}
+
+			if (colour_matrix(&filters[i], &a) && matrix_in_range(&a)) {
+				for (j = i + 1; j < n; ++j) {
+					if (colour_matrix(&filters[j], &b))
+						break;
+					if (!commutes(&filters[i], &filters[j]))
+						break;
+				}
+				if (j > i + 1 && j < n && colour_matrix(&filters[j], &b)) {
+					struct filter_t f = filters[i];
+					matrix_mul(&ba, &b, &a);
+					if (matrix_fits(&ba)) {
+						memmove(filters + i, filters + i + 1,
+						        (j - i - 1) * sizeof(*filters));
+						filters[j - 1] = f;
+						changed = true;
+						break;
+					}
+				}
+			}
+
+			if (i + 1 < n && colour_matrix(&filters[i], &a)
+			 && colour_matrix(&filters[i + 1], &b) && matrix_in_range(&a)) {
+				struct matrix_t *m;
+				matrix_mul(&ba, &b, &a);
+				if (matrix_fits(&ba)) {
+					if (!(m = malloc(sizeof(*m))))
+						err(1, "malloc");
+					*m = ba;
+					filters[i] = (struct filter_t){ &filterdef_matrix, { .m = m } };
+					remove_stage(filters, &n, i + 1);
+					changed = true;
+					break;
+				}
+			}
+		}
+	} while (changed);
+
+	print_plan("planned", filters, n);
+	return n;
+}
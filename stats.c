@@ -0,0 +1,157 @@
+/*
+ * Copyright © 2017 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "xbluck.h"
+
+/*
+ * Counters of the locked event loop, dumped to the log, or stderr if
+ * there is none, on SIGUSR1. SIGUSR1 is blocked outside of the wait
+ * in mainloop, so a dump never lands in the middle of an event.
+ */
+
+struct stats_t stats;
+
+static volatile sig_atomic_t requested;
+static uint64_t started;
+
+static const char *event_names[] = {
+	"error", "reply", "key_press", "key_release", "button_press",
+	"button_release", "motion", "enter", "leave", "focus_in",
+	"focus_out", "keymap", "expose", "graphics_expose", "no_expose",
+	"visibility", "create", "destroy", "unmap", "map", "map_request",
+	"reparent", "configure", "configure_request", "gravity",
+	"resize_request", "circulate", "circulate_request", "property",
+	"selection_clear", "selection_request", "selection", "colormap",
+	"client_message", "mapping", "generic",
+};
+
+static void
+on_usr1(int sig) {
+	(void)sig;
+	requested = 1;
+}
+
+void
+stats_init(sigset_t *waitmask) {
+	struct sigaction sa;
+	sigset_t block;
+
+	started = now_us();
+	sa.sa_handler = on_usr1;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR1, &sa, NULL) < 0)
+		warn("sigaction SIGUSR1");
+
+	sigemptyset(&block);
+	sigaddset(&block, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &block, waitmask) < 0)
+		warn("sigprocmask");
+	sigdelset(waitmask, SIGUSR1);
+}
+
+/* buckets are powers of two µs */
+void
+hist_add(struct hist_t *hist, uint64_t us) {
+	int b = 0;
+
+	while (b < HIST_BUCKETS - 1 && us >= (uint64_t)1 << b)
+		++b;
+	++hist->bucket[b];
+	++hist->n;
+	hist->sum += us;
+	if (us > hist->max)
+		hist->max = us;
+}
+
+static void
+hist_dump(FILE *fp, const char *name, const struct hist_t *hist) {
+	int b;
+
+	fprintf(fp, "  %s: n=%llu", name, (unsigned long long)hist->n);
+	if (!hist->n) {
+		fprintf(fp, "\n");
+		return;
+	}
+	fprintf(fp, " avg=%lluus max=%lluus",
+	        (unsigned long long)(hist->sum / hist->n),
+	        (unsigned long long)hist->max);
+	for (b = 0; b < HIST_BUCKETS; ++b) {
+		if (!hist->bucket[b])
+			continue;
+		if (b == HIST_BUCKETS - 1)
+			fprintf(fp, " rest=%llu", (unsigned long long)hist->bucket[b]);
+		else
+			fprintf(fp, " <%lluus=%llu", 1ULL << b, (unsigned long long)hist->bucket[b]);
+	}
+	fprintf(fp, "\n");
+}
+
+/* formatted in memory, so it goes to the log as a single entry */
+static void
+stats_dump(void) {
+	FILE *fp;
+	char *buf;
+	size_t len, i;
+
+	if (!(fp = open_memstream(&buf, &len))) {
+		warn("open_memstream");
+		return;
+	}
+
+	fprintf(fp, "stats after %llus:\n", (unsigned long long)((now_us() - started) / 1000000));
+	fprintf(fp, "  events:");
+	for (i = 0; i < LENGTH(stats.events); ++i) {
+		if (!stats.events[i])
+			continue;
+		if (i < LENGTH(event_names))
+			fprintf(fp, " %s=%llu", event_names[i], (unsigned long long)stats.events[i]);
+		else
+			fprintf(fp, " %zu=%llu", i, (unsigned long long)stats.events[i]);
+	}
+	fprintf(fp, "\n");
+	fprintf(fp, "  exposed: %llu px\n", (unsigned long long)stats.exposed);
+	fprintf(fp, "  put_image: n=%llu bytes=%llu\n",
+	        (unsigned long long)stats.puts, (unsigned long long)stats.putbytes);
+	fprintf(fp, "  set_border: n=%llu\n", (unsigned long long)stats.borders);
+	hist_dump(fp, "key_press", &stats.key);
+	hist_dump(fp, "crypt", &stats.crypt);
+	hist_dump(fp, "input-to-vblank", &stats.vblank);
+
+	if (fclose(fp)) {
+		warn("open_memstream");
+		return;
+	}
+	if (log_enabled())
+		log_write(buf, len);
+	else
+		fwrite(buf, 1, len, stderr);
+	free(buf);
+}
+
+void
+stats_poll(void) {
+	if (requested) {
+		requested = 0;
+		stats_dump();
+	}
+}
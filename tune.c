@@ -0,0 +1,241 @@
+/*
+ * Copyright © 2017 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "xbluck.h"
+
+/*
+ * The convolution core has variants that give the same output at
+ * different speeds, see conv.c: the SIMD width, which is not always
+ * fastest at its widest, and the width of the column tiles of the
+ * vertical passes, which decides whether the rows under a large kernel
+ * stay in cache; the tiles are also the strips of the blur on a grey
+ * frame. So have the stages around it: whether pixelate, tile, blurpix
+ * and edge walk the frame a block or a row at a time, and whether the
+ * noise draws are brought into range by division or by table, see
+ * filter.c. Which one wins depends on the CPU, the geometry and the
+ * chain. So the first time a host runs a chain on a geometry, on XRGB
+ * or on the planes of a deep screen, each variant that the chain has a
+ * stage for is timed on a frame of that width, and the winner is
+ * appended to $XDG_CACHE_HOME/xbluck/tune as a "key simd tile walk
+ * noise" line. Later runs read the plan back without timing anything.
+ * Chains of stages without variants, such as flips and colour stages,
+ * keep the default plan.
+ */
+
+#define TUNE_RUNS 2      /* the best of which counts */
+#define TUNE_MAXROWS 256 /* the cost per row does not depend on the height */
+
+static const int tiles[] = { 0, 512, 128 };
+
+/* the members of the plan that some stage of the chain reads */
+enum { TUNE_CORE = 1, TUNE_WALK = 2, TUNE_NOISE = 4 };
+
+static int
+tunable(const struct filter_t *filters, int n) {
+	int i, knobs = 0;
+	for (i = 0; i < n && filters[i].def; ++i) {
+		const struct filterdef_t *def = filters[i].def;
+		if (def == &filterdef_gaussian || def == &filterdef_kernel
+		 || def == &filterdef_matrix || def == &filterdef_blurpix)
+			knobs |= TUNE_CORE;
+		if (def == &filterdef_pixelate || def == &filterdef_tile
+		 || def == &filterdef_blurpix || def == &filterdef_edge)
+			knobs |= TUNE_WALK;
+		if (def == &filterdef_noise)
+			knobs |= TUNE_NOISE;
+	}
+	return knobs;
+}
+
+/* per host, as a home directory may be shared between several */
+static uint64_t
+tune_key(int w, int h, const struct filter_t *filters, int n, bool planar) {
+	uint32_t geom[4] = { w, h, conv_simd_max(), planar };
+	uint64_t hash = FNV_BASIS;
+	char host[256] = "";
+
+	gethostname(host, sizeof(host) - 1);
+	hash = fnv1a(hash, host, strlen(host) + 1);
+	hash = fnv1a(hash, geom, sizeof(geom));
+	return chain_hash(hash, filters, n);
+}
+
+/* the last plan stored for key; lines of older versions are skipped */
+static bool
+tune_read(const char *path, uint64_t key, struct conv_plan_t *plan) {
+	unsigned long long k;
+	bool found = false;
+	int simd, tile, walk, noise;
+	char line[128];
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r")))
+		return false;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%llx %d %d %d %d", &k, &simd, &tile, &walk, &noise) != 5)
+			continue;
+		if (k != key || simd < CONV_SCALAR || simd > conv_simd_max() || tile < 0
+		 || walk < WALK_BLOCKS || walk > WALK_ROWS || noise < NOISE_DIV || noise > NOISE_LUT)
+			continue;
+		plan->simd = simd;
+		plan->tile = tile;
+		plan->walk = walk;
+		plan->noise = noise;
+		found = true;
+	}
+	fclose(fp);
+	return found;
+}
+
+static void
+tune_write(const char *path, uint64_t key, const struct conv_plan_t *plan) {
+	FILE *fp;
+
+	if (!(fp = fopen(path, "a"))) {
+		warn("fopen %s", path);
+		return;
+	}
+	fprintf(fp, "%016llx %d %d %d %d\n", (unsigned long long)key,
+	        plan->simd, plan->tile, plan->walk, plan->noise);
+	if (fclose(fp))
+		warn("fclose %s", path);
+}
+
+/* a variant well behind the fastest so far runs only once */
+static uint64_t
+tune_time(struct arena_t *arena, const void *src, const struct filter_t *filters,
+          int n, bool planar, const struct conv_plan_t *plan, uint64_t fastest) {
+	size_t len = (size_t)arena->w * arena->h;
+	uint64_t t, best = UINT64_MAX;
+	int i;
+
+	conv_set_plan(plan);
+	for (i = 0; i < TUNE_RUNS; ++i) {
+		if (planar)
+			memcpy(arena->plane, src, 3 * len * sizeof(uint16_t));
+		else
+			memcpy(arena->img, src, len * sizeof(uint32_t));
+		t = now_us();
+		if (planar)
+			apply_planar(arena, filters, n);
+		else
+			apply_filters(arena, filters, n);
+		t = now_us() - t;
+		best = t < best ? t : best;
+		if (best / 3 > fastest / 2)
+			break;
+	}
+	DEBUG(1, "tune: simd=%s tile=%d walk=%d noise=%d %lluus",
+	      conv_simd_name[plan->simd], plan->tile, plan->walk, plan->noise,
+	      (unsigned long long)best);
+	return best;
+}
+
+/* times p, and keeps it in plan if it is the fastest so far */
+static void
+tune_try(struct arena_t *arena, const void *src, const struct filter_t *filters, int n,
+         bool planar, const struct conv_plan_t *p, struct conv_plan_t *plan, uint64_t *best) {
+	uint64_t t = tune_time(arena, src, filters, n, planar, p, *best);
+	if (t < *best) {
+		*best = t;
+		*plan = *p;
+	}
+}
+
+/*
+ * Set the plan for running filters on w×h frames, XRGB or, if planar,
+ * the planes of a deep screen, see apply_planar: the one stored for
+ * this host, chain and geometry, or the fastest one found by timing
+ * the variants of each member in turn, the others kept at the fastest
+ * found so far.
+ */
+void
+tune_filters(int w, int h, const struct filter_t *filters, int n, bool planar) {
+	static uint64_t last;
+	struct conv_plan_t plan = { conv_simd_max(), 0, WALK_BLOCKS, NOISE_DIV }, p;
+	struct arena_t arena;
+	char path[PATH_MAX];
+	uint32_t seed = 1;
+	void *src;
+	uint64_t key, best = UINT64_MAX;
+	int th = h < TUNE_MAXROWS ? h : TUNE_MAXROWS;
+	size_t i, len = (size_t)w * th;
+	size_t srclen = planar ? 3 * len * sizeof(uint16_t) : len * sizeof(uint32_t);
+	int knobs;
+	bool cached;
+
+	if (!(knobs = tunable(filters, n)))
+		return;
+	if ((key = tune_key(w, h, filters, n, planar)) == last)
+		return;
+	last = key;
+
+	cached = cache_dir(path, sizeof(path) - 8) == 0;
+	if (cached)
+		strcat(path, "/tune");
+	if (cached && tune_read(path, key, &plan)) {
+		conv_set_plan(&plan);
+		DEBUG(1, "tune: %dx%d stored plan simd=%s tile=%d walk=%d noise=%d",
+		      w, h, conv_simd_name[plan.simd], plan.tile, plan.walk, plan.noise);
+		return;
+	}
+
+	src = frame_alloc(srclen);
+	for (i = 0; i < srclen / sizeof(uint16_t); ++i) {
+		seed = seed * 1103515245 + 12345;
+		((uint16_t*)src)[i] = seed >> 8;
+	}
+	arena_init(&arena, w, th, filters, n);
+	if (planar)
+		arena_planes(&arena);
+
+	/* the SIMD width on whole rows, then tiles at the fastest width,
+	 * then the walk and the noise at the fastest of those */
+	tune_try(&arena, src, filters, n, planar, &plan, &plan, &best);
+	for (p = plan, p.simd = conv_simd_max() - 1; (knobs & TUNE_CORE) && p.simd >= CONV_SCALAR; --p.simd)
+		tune_try(&arena, src, filters, n, planar, &p, &plan, &best);
+	for (p = plan, i = 1; (knobs & TUNE_CORE) && i < LENGTH(tiles); ++i) {
+		if ((p.tile = tiles[i]) < w)
+			tune_try(&arena, src, filters, n, planar, &p, &plan, &best);
+	}
+	if (knobs & TUNE_WALK) {
+		p = plan;
+		p.walk = WALK_ROWS;
+		tune_try(&arena, src, filters, n, planar, &p, &plan, &best);
+	}
+	if (knobs & TUNE_NOISE) {
+		p = plan;
+		p.noise = NOISE_LUT;
+		tune_try(&arena, src, filters, n, planar, &p, &plan, &best);
+	}
+	frame_free(arena_finish(&arena), len * sizeof(uint32_t));
+	frame_free(src, srclen);
+
+	conv_set_plan(&plan);
+	DEBUG(1, "tune: %dx%d timed plan simd=%s tile=%d walk=%d noise=%d %lluus",
+	      w, h, conv_simd_name[plan.simd], plan.tile, plan.walk, plan.noise,
+	      (unsigned long long)best);
+	if (cached)
+		tune_write(path, key, &plan);
+}
@@ -24,11 +24,13 @@
 #include <string.h>
 #include <time.h>
 #include <err.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "xbluck.h"
 
 extern struct options_t conf;
-extern int state;
 
 void
 debugprint(int level, const char *fmt, ...) {
@@ -40,49 +42,159 @@ debugprint(int level, const char *fmt, ...) {
 	}
 }
 
-int
-log_state() {
-	char timestr[20];
-	time_t t;
-	struct tm *tmp;
-	int ret = 0;
-	FILE *fp = NULL;
-
-	if (conf.logfile && conf.logfile[0]) {
-		if (!(fp = fopen(conf.logfile, "a"))) {
-			warn("fopen %s", conf.logfile);
-		}
-	} else if (!conf.verbose) {
-		return 0;
+#define HUGEPAGE (2 << 20)
+
+static size_t
+page_round(size_t len) {
+	size_t pg = sysconf(_SC_PAGESIZE);
+	return (len + pg - 1) / pg * pg;
+}
+
+static void
+prefault(uint8_t *p, size_t len) {
+	size_t pg = sysconf(_SC_PAGESIZE);
+	size_t i;
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(p, len, MADV_POPULATE_WRITE))
+		return;
+#endif
+	for (i = 0; i < len; i += pg)
+		((volatile uint8_t*)p)[i] = 0;
+}
+
+/*
+ * Frame sized buffers are touched in full by the first filter pass, so
+ * fault them in up front, and on huge pages where the kernel lets us.
+ * The mapping is over-allocated to get a huge page aligned start, and
+ * populated only after madvise, as MAP_POPULATE would fault it in with
+ * small pages before the advice is given.
+ */
+void *
+frame_alloc(size_t len) {
+	uint8_t *p, *q;
+	size_t map;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	len = page_round(len);
+	if (len < HUGEPAGE) {
+#ifdef MAP_POPULATE
+		flags |= MAP_POPULATE;
+#endif
+		if ((p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0)) == MAP_FAILED)
+			err(1, "mmap %zu", len);
+		return p;
 	}
 
-	if (!fp) {
-		fp = stderr;
+	map = len + HUGEPAGE;
+	if ((p = mmap(NULL, map, PROT_READ | PROT_WRITE, flags, -1, 0)) == MAP_FAILED)
+		err(1, "mmap %zu", map);
+	q = (uint8_t*)(((uintptr_t)p + HUGEPAGE - 1) & ~(uintptr_t)(HUGEPAGE - 1));
+	if (q > p)
+		munmap(p, q - p);
+	if (q + len < p + map)
+		munmap(q + len, p + map - (q + len));
+#ifdef MADV_HUGEPAGE
+	madvise(q, len, MADV_HUGEPAGE);
+#endif
+	prefault(q, len);
+	return q;
+}
+
+void
+frame_free(void *p, size_t len) {
+	if (p && munmap(p, page_round(len)) < 0)
+		warn("munmap");
+}
+
+uint64_t
+fnv1a(uint64_t hash, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
 	}
+	return hash;
+}
+
+/* $XDG_CACHE_HOME/xbluck, created if need be */
+int
+cache_dir(char *buf, size_t len) {
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int ret;
 
-	t = time(NULL);
-	if ((tmp = localtime(&t)) && strftime(timestr, 20, "%Y-%m-%d %H:%M:%S", tmp)) {
-		ret += fprintf(fp, "%s ", timestr);
+	if (xdg && xdg[0]) {
+		ret = snprintf(buf, len, "%s", xdg);
+	} else if (home && home[0]) {
+		ret = snprintf(buf, len, "%s/.cache", home);
 	} else {
-		ret += fprintf(fp, "%ld", t);
+		return -1;
 	}
-
-	switch (state) {
-	case STATE_FAILED:
-		ret += fprintf(fp, "failed attempt\n");
-		break;
-	case STATE_LOCKED:
-		ret += fprintf(fp, "locked\n");
-		break;
-	case STATE_UNLOCK:
-		ret += fprintf(fp, "unlock\n");
-		break;
+	if (ret < 0 || ret >= (int)len - 8)
+		return -1;
+	mkdir(buf, 0700);
+	strcat(buf, "/xbluck");
+	if (mkdir(buf, 0700) < 0 && errno != EEXIST) {
+		warn("mkdir %s", buf);
+		return -1;
 	}
+	return 0;
+}
 
-	if (fp != stderr)
-		fclose(fp);
+uint64_t
+now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	return ret;
+/*
+ * With XBLUCK_BENCH set, milestones of the lock are appended to that
+ * file as "event,µs since start" lines, for e2e-bench.sh. The file is
+ * opened on the first mark, after privileges are dropped.
+ */
+static struct {
+	const char *path;
+	FILE *fp;
+	uint64_t t0;
+} bench;
+
+static void
+bench_close(void) {
+	if (bench.fp && fclose(bench.fp))
+		warn("fclose %s", bench.path);
+}
+
+void
+bench_init(void) {
+	bench.t0 = now_us();
+	bench.path = getenv("XBLUCK_BENCH");
+	if (bench.path && !bench.path[0])
+		bench.path = NULL;
+}
+
+bool
+bench_active(void) {
+	return bench.path != NULL;
+}
+
+void
+bench_mark(const char *what) {
+	uint64_t t = now_us();
+
+	if (!bench.path)
+		return;
+	if (!bench.fp) {
+		if (!(bench.fp = fopen(bench.path, "a"))) {
+			warn("fopen %s", bench.path);
+			bench.path = NULL;
+			return;
+		}
+		/* the bench script waits on marks while we run */
+		setvbuf(bench.fp, NULL, _IOLBF, 0);
+		atexit(bench_close);
+	}
+	fprintf(bench.fp, "%s,%llu\n", what, (unsigned long long)(t - bench.t0));
 }
 
 long
@@ -0,0 +1,343 @@
+/*
+ * Copyright © 2017 Lars Lindqvist <lars.lindqvist at yandex.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xbluck.h"
+
+extern struct options_t conf;
+
+/*
+ * A wallpaper is decoded, stretched to the screen and filtered once,
+ * and the result written to a cache file named after a hash of the
+ * source contents, the geometry and the filter chain. Later locks map
+ * that file and use it as the frame as it is.
+ *
+ * So that a lock does not have to read the source to find its frame,
+ * the cache file is also linked under a hash of the source's path,
+ * device, inode, size and modification time. Only when that name is
+ * missing is the source read and its contents hashed, which finds the
+ * frame again for a file that was only touched, copied or moved.
+ */
+
+#define CACHE_MAGIC "xbluck\0\1"
+
+struct cache_hdr_t {
+	char magic[8];
+	uint32_t w, h;
+};
+
+struct src_t {
+	uint32_t *px;
+	int w, h;
+};
+
+static uint64_t
+cache_key(const uint8_t *file, size_t len, int w, int h,
+          const struct filter_t *filters, int n) {
+	uint64_t hash = FNV_BASIS;
+	uint32_t geom[2] = { w, h };
+
+	hash = fnv1a(hash, file, len);
+	hash = fnv1a(hash, geom, sizeof(geom));
+	return chain_hash(hash, filters, n);
+}
+
+/* as cache_key, from what stat says about the source instead */
+static uint64_t
+stat_key(const char *path, const struct stat *st, int w, int h,
+         const struct filter_t *filters, int n) {
+	uint64_t hash = FNV_BASIS;
+	uint64_t id[6] = {
+		st->st_dev, st->st_ino, st->st_size,
+		st->st_mtim.tv_sec, st->st_mtim.tv_nsec, (uint64_t)w << 32 | (uint32_t)h,
+	};
+
+	hash = fnv1a(hash, "stat", sizeof("stat"));
+	hash = fnv1a(hash, path, strlen(path) + 1);
+	hash = fnv1a(hash, id, sizeof(id));
+	return chain_hash(hash, filters, n);
+}
+
+/* name as another link to the cache file at path */
+static void
+cache_link(const char *path, const char *name) {
+	char tmp[PATH_MAX];
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%ld", name, (long)getpid()) >= (int)sizeof(tmp))
+		return;
+	unlink(tmp);
+	if (link(path, tmp) < 0) {
+		warn("link %s", tmp);
+		return;
+	}
+	if (rename(tmp, name) < 0) {
+		warn("rename %s", tmp);
+		unlink(tmp);
+	}
+}
+
+static uint32_t *
+cache_map(const char *path, int w, int h, void **base, size_t *maplen) {
+	struct cache_hdr_t *hdr;
+	struct stat st;
+	size_t len = sizeof(*hdr) + (size_t)w * h * sizeof(uint32_t);
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != len) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic))
+	 || hdr->w != (uint32_t)w || hdr->h != (uint32_t)h) {
+		munmap(map, len);
+		return NULL;
+	}
+	*base = map;
+	*maplen = len;
+	return (uint32_t*)(hdr + 1);
+}
+
+static int
+cache_store(const char *path, const uint32_t *img, int w, int h) {
+	struct cache_hdr_t hdr;
+	char tmp[PATH_MAX];
+	size_t len = (size_t)w * h * sizeof(uint32_t);
+	FILE *fp;
+	int fd;
+
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.w = w;
+	hdr.h = h;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+		return -1;
+	if ((fd = mkstemp(tmp)) < 0) {
+		warn("mkstemp %s", tmp);
+		return -1;
+	}
+	if (!(fp = fdopen(fd, "w"))) {
+		warn("fdopen %s", tmp);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+	 || fwrite(img, len, 1, fp) != 1
+	 || fclose(fp)) {
+		warn("write %s", tmp);
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, path) < 0) {
+		warn("rename %s", tmp);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static uint8_t *
+read_file(const char *path, size_t *len) {
+	struct stat st;
+	uint8_t *buf;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		err(1, "open %s", path);
+	if (fstat(fd, &st) < 0)
+		err(1, "fstat %s", path);
+	if (!(buf = malloc(st.st_size ? st.st_size : 1)))
+		err(1, "malloc");
+	if (read(fd, buf, st.st_size) != st.st_size)
+		err(1, "read %s", path);
+	close(fd);
+	*len = st.st_size;
+	return buf;
+}
+
+static uint32_t
+be32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int
+decode_farbfeld(const uint8_t *buf, size_t len, struct src_t *src) {
+	const uint8_t *p;
+	size_t i, n;
+
+	if (len < 16 || memcmp(buf, "farbfeld", 8))
+		return -1;
+	src->w = be32(buf + 8);
+	src->h = be32(buf + 12);
+	n = (size_t)src->w * src->h;
+	if (!n || src->w > 0x7FFF || src->h > 0x7FFF || len - 16 < n * 8)
+		return -1;
+	if (!(src->px = malloc(n * sizeof(uint32_t))))
+		err(1, "malloc");
+
+	for (p = buf + 16, i = 0; i < n; ++i, p += 8) {
+		/* composite over black */
+		uint32_t a = p[6] << 8 | p[7];
+		uint32_t r = (p[0] << 8 | p[1]) * a / 0xFFFF >> 8;
+		uint32_t g = (p[2] << 8 | p[3]) * a / 0xFFFF >> 8;
+		uint32_t b = (p[4] << 8 | p[5]) * a / 0xFFFF >> 8;
+		src->px[i] = r << 16 | g << 8 | b;
+	}
+	return 0;
+}
+
+static const uint8_t *
+ppm_field(const uint8_t *p, const uint8_t *end, long *val) {
+	while (p < end) {
+		if (*p == '#') {
+			while (p < end && *p != '\n')
+				++p;
+		} else if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			++p;
+		} else {
+			break;
+		}
+	}
+	for (*val = -1; p < end && *p >= '0' && *p <= '9'; ++p) {
+		*val = (*val < 0 ? 0 : *val * 10) + (*p - '0');
+		if (*val > 0xFFFF)
+			return NULL;
+	}
+	return *val < 0 ? NULL : p;
+}
+
+static int
+decode_ppm(const uint8_t *buf, size_t len, struct src_t *src) {
+	const uint8_t *p, *end = buf + len;
+	long w, h, max;
+	size_t i, n, bpc;
+
+	if (len < 2 || memcmp(buf, "P6", 2))
+		return -1;
+	if (!(p = ppm_field(buf + 2, end, &w))
+	 || !(p = ppm_field(p, end, &h))
+	 || !(p = ppm_field(p, end, &max)))
+		return -1;
+	if (!w || !h || !max || p == end)
+		return -1;
+	++p;
+
+	n = (size_t)w * h;
+	bpc = max > 0xFF ? 2 : 1;
+	if ((size_t)(end - p) < n * 3 * bpc)
+		return -1;
+	src->w = w;
+	src->h = h;
+	if (!(src->px = malloc(n * sizeof(uint32_t))))
+		err(1, "malloc");
+
+	for (i = 0; i < n; ++i) {
+		uint32_t c[3];
+		int k;
+		for (k = 0; k < 3; ++k, p += bpc) {
+			uint32_t v = bpc == 2 ? (uint32_t)p[0] << 8 | p[1] : p[0];
+			c[k] = (v > (uint32_t)max ? (uint32_t)max : v) * 0xFF / max;
+		}
+		src->px[i] = c[0] << 16 | c[1] << 8 | c[2];
+	}
+	return 0;
+}
+
+static void
+stretch(uint32_t *dst, int w, int h, const struct src_t *src) {
+	int x, y;
+	for (y = 0; y < h; ++y) {
+		const uint32_t *row = src->px + (size_t)(y * (int64_t)src->h / h) * src->w;
+		for (x = 0; x < w; ++x)
+			*dst++ = row[x * (int64_t)src->w / w];
+	}
+}
+
+uint32_t *
+wallpaper_load(const char *path, int w, int h,
+               const struct filter_t *filters, int n, void **map, size_t *maplen) {
+	struct arena_t arena;
+	struct src_t src;
+	struct stat st;
+	char dir[PATH_MAX - 32];
+	char cache[PATH_MAX];
+	char quick[PATH_MAX];
+	uint32_t *img;
+	uint8_t *file;
+	size_t len;
+	bool cached;
+
+	if (stat(path, &st) < 0)
+		err(1, "stat %s", path);
+	cached = cache_dir(dir, sizeof(dir)) == 0;
+	if (cached) {
+		snprintf(quick, sizeof(quick), "%s/%016llx", dir,
+		         (unsigned long long)stat_key(path, &st, w, h, filters, n));
+		if ((img = cache_map(quick, w, h, map, maplen))) {
+			DEBUG(1, "cache hit %s", quick);
+			return img;
+		}
+	}
+
+	file = read_file(path, &len);
+	if (cached) {
+		snprintf(cache, sizeof(cache), "%s/%016llx", dir,
+		         (unsigned long long)cache_key(file, len, w, h, filters, n));
+		if ((img = cache_map(cache, w, h, map, maplen))) {
+			DEBUG(1, "cache hit %s by contents", cache);
+			cache_link(cache, quick);
+			free(file);
+			return img;
+		}
+		DEBUG(1, "cache miss %s", cache);
+	}
+
+	if (decode_farbfeld(file, len, &src) < 0 && decode_ppm(file, len, &src) < 0)
+		errx(1, "%s: not a farbfeld or binary PPM image", path);
+	free(file);
+
+	arena_init(&arena, w, h, filters, n);
+	stretch(arena.img, w, h, &src);
+	free(src.px);
+	apply_filters(&arena, filters, n);
+	img = arena_finish(&arena);
+
+	if (cached && cache_store(cache, img, w, h) == 0)
+		cache_link(cache, quick);
+	*map = img;
+	*maplen = (size_t)w * h * sizeof(uint32_t);
+	return img;
+}
@@ -1,6 +1,9 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <signal.h>
 
 struct auth_t {
 	const char *hash;
@@ -11,6 +14,7 @@ struct auth_t {
 int init_auth();
 void auth_destroy();
 bool password_is_valid();
+bool hash_is_valid(const char *);
 void reset_input();
 void drop_priv();
 
@@ -29,9 +33,45 @@ void debugprint(int, const char *, ...);
 } while (0)
 
 #define LENGTH(x) (sizeof(x) / sizeof(*x))
+#define ROUNDUP(x, a) (((x) + (a) - 1) / (a) * (a))
 
+void log_init();
+bool log_enabled();
+void log_write(const char *, size_t);
+void log_finish();
 int log_state();
 long estrtol(const char *, int);
+void *frame_alloc(size_t);
+void frame_free(void *, size_t);
+uint64_t now_us(void);
+#define FNV_BASIS 0xcbf29ce484222325ULL
+uint64_t fnv1a(uint64_t hash, const void *buf, size_t len);
+int cache_dir(char *buf, size_t len);
+void bench_init(void);
+bool bench_active(void);
+void bench_mark(const char *);
+
+#define HIST_BUCKETS 24
+
+struct hist_t {
+	uint64_t n, sum, max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+struct stats_t {
+	uint64_t events[128];  /* by response type */
+	uint64_t exposed;      /* pixels */
+	uint64_t puts, putbytes;
+	uint64_t borders;
+	struct hist_t key;     /* handle_key_press */
+	struct hist_t crypt;   /* password_is_valid */
+	struct hist_t vblank;  /* input-to-vblank, with --vsync */
+};
+
+extern struct stats_t stats;
+void stats_init(sigset_t *waitmask);
+void stats_poll(void);
+void hist_add(struct hist_t *, uint64_t us);
 void drop_privs(const char *user, const char *group);
 const char *get_hash();
 
@@ -44,23 +84,72 @@ union fparam_t {
 	uint32_t u;
 	struct fpus_t us;
 	double d;
+	const struct kernel_t *k;
+	const struct matrix_t *m;
 };
 
-struct filter_t {
-	void (*function)(uint32_t*, int, int, union fparam_t);
+struct need_t {
+	size_t scratch;
+	bool alt;
+};
+
+struct arena_t {
+	int w, h;
+	uint32_t *img;
+	uint32_t *alt;
+	void *scratch;
+	size_t scratchlen;
+	uint8_t *grey;    /* luma plane and its alt, for a grey run */
+	uint8_t *greyalt;
+	uint16_t *plane;  /* R, G and B planes, and one for temporaries */
+};
+
+enum {
+	FP_NOOP       = 1 << 0, /* leaves the frame as it is */
+	FP_POINTWISE  = 1 << 1, /* each pixel depends only on itself */
+	FP_GEOMETRIC  = 1 << 2, /* moves pixels without changing them */
+	FP_MIRROR     = 1 << 3, /* a reflection: flip or flop */
+	FP_SYMMETRIC  = 1 << 4, /* commutes with reflections */
+	FP_INVOLUTION = 1 << 5, /* applying it twice is a no-op */
+	FP_IDEMPOTENT = 1 << 6, /* applying it twice is applying it once */
+	FP_LINEAR     = 1 << 7, /* linear in the channel values */
+	FP_REDUCE     = 1 << 8, /* discards resolution */
+	FP_GREY       = 1 << 9, /* leaves the luma of its input */
+	FP_FADES      = 1 << 10, /* weighs pixels near the edges down */
+};
+
+struct filterdef_t {
+	const char *name;
+	void (*function)(uint32_t*, int, int, union fparam_t, struct arena_t*);
 	void (*checker)(union fparam_t);
+	struct need_t (*need)(int, int, union fparam_t);
+	void (*mono)(uint8_t*, int, int, union fparam_t, struct arena_t*);
+	void (*planar)(uint16_t*, int, int, union fparam_t, struct arena_t*);
+	unsigned flags;
+	/* a stage that does the work of this one followed by an
+	 * idempotent reduction, taking both parameters, see plan_filters */
+	const struct filterdef_t *fused;
+};
+
+struct filter_t {
+	const struct filterdef_t *def;
 	union fparam_t param;
 };
 
 #define FILTERFUNC(name) \
-void filter_##name(uint32_t *img, int w, int h, union fparam_t param)
+void filter_##name(uint32_t *img, int w, int h, union fparam_t param, struct arena_t *arena)
 
 #define FILTERCHK(name) \
 void filter_check_##name(union fparam_t param)
 
+#define FILTERNEED(name) \
+struct need_t filter_need_##name(int w, int h, union fparam_t param)
+
 #define FILTERPROT(name) \
 FILTERFUNC(name); \
-FILTERCHK(name)
+FILTERCHK(name); \
+FILTERNEED(name); \
+extern const struct filterdef_t filterdef_##name
 
 FILTERPROT(flip);
 FILTERPROT(flop);
@@ -69,22 +158,137 @@ FILTERPROT(invert);
 FILTERPROT(colourise);
 FILTERPROT(shift);
 FILTERPROT(gaussian);
+int gaussian_weights(double *wt, unsigned rad);
 FILTERPROT(pixelate);
+FILTERPROT(blurpix);
+#define BLURPIX_MINRAD 4  /* radii blurpix fuses, the rest run gaussian */
+#define BLURPIX_MAXRAD 12
 FILTERPROT(noise);
 FILTERPROT(tile);
 FILTERPROT(greyscale);
 FILTERPROT(edge);
-void apply_filters(uint32_t *img, int w, int h, struct filter_t *filters, int n);
+FILTERPROT(kernel);
+FILTERPROT(matrix);
+void arena_init(struct arena_t *, int w, int h, const struct filter_t *filters, int n);
+void arena_planes(struct arena_t *);
+uint32_t *arena_finish(struct arena_t *);
+int strip_halo(const struct filter_t *filters, int n, int *align);
+void apply_filters(struct arena_t *, const struct filter_t *filters, int n);
+bool planar_chain(const struct filter_t *filters, int n);
+void apply_planar(struct arena_t *, const struct filter_t *filters, int n);
+void linear_init(void);
+size_t plan_filters(struct filter_t *filters, size_t n);
+uint64_t chain_hash(uint64_t hash, const struct filter_t *filters, int n);
+/* part of every chain_hash: bump it whenever the output of a filter
+ * changes, so that frames cached by the old code are not served */
+#define FILTER_VERSION 4
+
+#define CONV_MAXRAD 29
+
+struct conv_t {
+	int rad;
+	int shift;
+	uint32_t wt[2 * CONV_MAXRAD + 1];
+};
+
+#define KERNEL_MAXDIM 9                     /* side of a 2-D kernel */
+#define KERNEL_MAXLEN (2 * CONV_MAXRAD + 1) /* length of a 1-D one */
+#define KERNEL_MAXTAPS (KERNEL_MAXLEN > KERNEL_MAXDIM * KERNEL_MAXDIM \
+                        ? KERNEL_MAXLEN : KERNEL_MAXDIM * KERNEL_MAXDIM)
+
+/* taps row by row, anchored at ((w - 1) / 2, (h - 1) / 2) */
+struct kernel_t {
+	int w, h;
+	int32_t div;   /* 0 for the sum of the taps, or 1 if that is not positive */
+	int32_t bias;  /* added to every channel after dividing */
+	int32_t tap[KERNEL_MAXTAPS];
+};
+
+/*
+ * An affine colour matrix: the 4×4 matrix whose last row is (0, 0, 0, 1),
+ * applied to (r, g, b, 1) with channels in [0, 255]. The fixed-point
+ * pass limits the coefficients and offsets to these.
+ */
+struct matrix_t {
+	double m[3][4];
+};
+#define MATRIX_MAXCOEF 7.99
+#define MATRIX_MAXOFFSET 2000.0
+
+extern const struct matrix_t matrix_sepia, matrix_greyscale, matrix_invert;
+bool colour_matrix(const struct filter_t *, struct matrix_t *);
+
+enum { CONV_SCALAR, CONV_SSE2, CONV_AVX2 };
+enum { WALK_BLOCKS, WALK_ROWS };
+enum { NOISE_DIV, NOISE_LUT };
+
+/* variants of the core and of the stages around it with the same
+ * output; tile is the columns per tile of the vertical passes, or 0
+ * for the whole width; walk is how pixelate, tile, blurpix and edge
+ * go over the frame; noise is how the draws are brought into range */
+struct conv_plan_t {
+	int simd;
+	int tile;
+	int walk;
+	int noise;
+};
+
+extern const char *const conv_simd_name[];
+int conv_simd_max(void);
+void conv_set_plan(const struct conv_plan_t *);
+const struct conv_plan_t *conv_get_plan(void);
+void tune_filters(int w, int h, const struct filter_t *filters, int n, bool planar);
+void conv_init(struct conv_t *, const uint32_t *kern, int klen, uint32_t div);
+void conv_rows(uint32_t *dst, const uint32_t *src, int w, int h, const struct conv_t *);
+void conv_cols(uint32_t *dst, const uint32_t *src, int w, int h, const struct conv_t *);
+void conv_init16(struct conv_t *, const uint32_t *kern, int klen, uint32_t div);
+void conv_rows16(uint16_t *dst, const uint16_t *src, int w, int h, const struct conv_t *);
+void conv_cols16(uint16_t *dst, const uint16_t *src, int w, int h, const struct conv_t *);
+void conv_init15(struct conv_t *, const uint32_t *kern, int klen, uint32_t div);
+void conv_rows_lut(uint16_t *tmp, const uint32_t *src, int w, int h, const struct conv_t *,
+                   const uint16_t *lut, uint16_t *buf);
+void conv_cols_lut(uint32_t *dst, const uint16_t *tmp, int w, int h, const struct conv_t *,
+                   const uint8_t *lut, uint16_t *buf);
+void conv_matrix(uint32_t *img, size_t n, const struct matrix_t *);
+
+struct chan_t {
+	int s, n;
+};
+
+struct pixfmt_t {
+	int depth;
+	int bpp;
+	int pad;
+	bool msb;
+	int id;
+	struct chan_t chan[3];
+};
+
+int format_init(struct pixfmt_t *, int depth, int bpp, int pad, bool msb,
+                uint32_t rmask, uint32_t gmask, uint32_t bmask);
+size_t format_stride(const struct pixfmt_t *, int w);
+bool format_is_native(const struct pixfmt_t *, int w);
+void format_decode(const struct pixfmt_t *, uint32_t *dst, const uint8_t *src, int w, int h);
+void format_encode(const struct pixfmt_t *, uint8_t *dst, const uint32_t *src, int w, int h);
+bool format_is_deep(const struct pixfmt_t *);
+void format_decode16(const struct pixfmt_t *, uint16_t *planes, const uint8_t *src, int w, int h);
+void format_encode16(const struct pixfmt_t *, uint32_t *dst, const uint16_t *planes, int w, int h);
 
 struct options_t {
 	int timeout;
 	int border;
 	struct filter_t *filters;
 	size_t nfilter;
+	bool defchain;
+	bool vsync;
+	bool render;
+	bool daemon;
+	bool linear;
 
 	int debug;
 	int verbose;
 	bool invert;
+	const char *wallpaper;
 	const char *logfile;
 	const char *hash;
 	const char *colors[STATE_NUM];
@@ -93,6 +297,10 @@ struct options_t {
 
 void parse_options(int argc, char **argv);
 
+uint32_t *wallpaper_load(const char *path, int w, int h,
+                         const struct filter_t *filters, int n, void **map, size_t *maplen);
+
 void xcb_init();
 void xcb_close();
+void xcb_daemon();
 void mainloop();
@@ -19,6 +19,9 @@
 #include <xkbcommon/xkbcommon-keysyms.h>
 #include <xkbcommon/xkbcommon.h>
 #include <xcb/randr.h>
+#include <xcb/present.h>
+#include <xcb/render.h>
+#include <xcb/damage.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -27,6 +30,11 @@
 #include <string.h>
 #include <ctype.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "xbluck.h"
 
@@ -40,14 +48,21 @@ struct screen_t {
 	xcb_gcontext_t gc;
 	xcb_colormap_t cmap;
 	xcb_pixmap_t pix;
+	xcb_pixmap_t blk;
+	struct pixfmt_t fmt;
+	bool deep;  /* frames are filtered on planes and kept as native words */
 	struct {
 		int w, h;
 		uint32_t len;
-		uint32_t *data;
+		uint8_t *data;
+		void *map;
+		size_t maplen;
 	} img;
 
 	struct rect_t *mons;
 	int nmon;
+	struct rect_t *regs;  /* what is filtered, see set_regions */
+	int nreg;
 
 	uint32_t colors[STATE_NUM];
 	uint32_t border[STATE_NUM];
@@ -59,6 +74,98 @@ struct rect_t {
 
 static int rrbase = -1;
 
+/*
+ * With --vsync, each screen's image and border live in a pixmap that
+ * is presented to the window at vblank. State changes are drawn into
+ * the pixmaps and presented at most once per frame: while a present is
+ * in flight, further changes only mark the borders dirty, and are
+ * presented together when it completes.
+ */
+static struct {
+	bool enabled;
+	uint8_t opcode;
+	uint32_t serial;
+	int pending;        /* screens yet to complete the current present */
+	bool dirty;         /* state changed since the current present */
+	uint64_t input;     /* µs, first input not yet presented */
+	uint64_t shown;     /* µs, first input in the current present */
+} present;
+
+/*
+ * With --render, a chain of blurs runs on the server: the root is
+ * copied to the screen's pixmap and blurred there by composites with
+ * RENDER's convolution filter, one per pass, so no pixels cross the
+ * connection. The pixmap is then the image, and img.data is NULL.
+ */
+static bool render;
+
+/*
+ * Unless the chain needs the whole frame, the root is captured,
+ * filtered and uploaded in strips: the request for strip n+1 is in
+ * flight while strip n is filtered, and strip n-1 is being sent. Each
+ * strip is fetched with the rows around it that the chain reads
+ * (halo), and uploaded to the screen's pixmap, as drawing on the
+ * window would show up in the strips captured after it. Only a strip
+ * and its halo are ever held on the client, and no single request
+ * outgrows the server's maximum request length.
+ */
+#define STRIP_ROWS 256
+
+static struct {
+	bool enabled;
+	int halo, align;
+} strips;
+
+/*
+ * A frame that ends in a pixelate of s carries one pixel of
+ * information per s×s block. Only that pixel is uploaded, to a pixmap
+ * of w/s × h/s blocks, and RENDER scales it up into the screen's pixmap
+ * with the nearest filter, so exposes are redrawn from the server as
+ * well. The columns and rows that pixelate leaves unblocked, right of
+ * and below the last whole block, are uploaded as they are.
+ */
+#define BLOCKS_MAXSIZ 128
+
+static int blocksiz;  /* 0 when not in use */
+
+/*
+ * With --daemon, xbluck stays up unlocked and keeps a filtered frame
+ * of each screen warm. DAMAGE reports which rows of the root changed,
+ * and a worker thread at idle priority refilters them, at most once
+ * every WARM_INTERVAL ms: with the halo around them when the chain can
+ * be run in strips, or the whole frame when not. SIGUSR2 locks over
+ * the warm frames, after filtering only what was damaged since the
+ * last refresh. A RANDR screen change makes the warm frame anew.
+ */
+#define WARM_INTERVAL 1000
+
+struct warm_t {
+	struct screen_t screen;  /* only the root and its format */
+	xcb_damage_damage_t damage;
+	uint32_t *frame;
+	int w, h;
+	int top, bot;            /* damaged rows, none when top >= bot */
+};
+
+static struct {
+	bool enabled;
+	uint8_t base;            /* first DAMAGE event */
+	struct warm_t *screens;
+	int nscreens;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool busy;               /* worker is refiltering */
+	bool hold;               /* locked: worker must not start */
+	int wake[2];             /* worker to event loop, after a refresh */
+} warm = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.wake = { -1, -1 },
+};
+
+static volatile sig_atomic_t lock_requested;
+
 static struct screen_t **screens = NULL;
 static int nscreens = 0;
 static xcb_connection_t *conn;
@@ -86,33 +193,63 @@ set_fg(xcb_gcontext_t gc, uint32_t val) {
 	check_xcb_cookie(cookie, "could not change gc foreground to 0x%08x", val);
 }
 
+/* a round trip, so that what was sent has been drawn when marked */
+static void
+bench_sync(const char *what) {
+	if (bench_active()) {
+		free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+		bench_mark(what);
+	}
+}
+
+/* the image is kept in a pixmap on the server */
+static bool
+server_image() {
+	return present.enabled || render || strips.enabled || blocksiz;
+}
+
+/* where the image and borders are drawn */
+static xcb_drawable_t
+target(struct screen_t *screen) {
+	return present.enabled ? screen->pix : screen->win;
+}
+
 static void
 put_image(struct screen_t *screen) {
 	xcb_void_cookie_t cookie;
-	cookie = xcb_put_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, screen->win,
-	                       screen->gc, screen->img.w, screen->img.h, 0, 0, 0,
-	                       screen->screen->root_depth,
-	                       screen->img.len, (uint8_t*)screen->img.data);
+	if (screen->img.data) {
+		cookie = xcb_put_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, target(screen),
+		                       screen->gc, screen->img.w, screen->img.h, 0, 0, 0,
+		                       screen->screen->root_depth,
+		                       screen->img.len, screen->img.data);
+		check_xcb_cookie(cookie, "could not put image");
+		++stats.puts;
+		stats.putbytes += screen->img.len;
+	} else if (target(screen) != screen->pix) {
+		/* the image was made on the server */
+		xcb_copy_area(conn, screen->pix, screen->win, screen->gc,
+		              0, 0, 0, 0, screen->img.w, screen->img.h);
+	}
 	if (conf.debug > 2) {
 		xcb_rectangle_t r = { 50, 50, 50, 50 };
 		int i;
 		for (i = 0; i < STATE_NUM; ++i, r.x += 100) {
 			r.y = 50;
 			set_fg(screen->gc, screen->colors[i]);
-			xcb_poly_fill_rectangle(conn, screen->win, screen->gc, 1, &r);
+			xcb_poly_fill_rectangle(conn, target(screen), screen->gc, 1, &r);
 			r.y = 150;
 
 			set_fg(screen->gc, screen->border[i]);
-			xcb_poly_fill_rectangle(conn, screen->win, screen->gc, 1, &r);
+			xcb_poly_fill_rectangle(conn, target(screen), screen->gc, 1, &r);
 		}
 	}
-	check_xcb_cookie(cookie, "could not put image");
 }
 
 static void
 set_border(struct screen_t *screen) {
 	int i;
 	int b = conf.border;
+	++stats.borders;
 	for (i = 0; i < screen->nmon; ++i) {
 		int x = screen->mons[i].x;
 		int y = screen->mons[i].y;
@@ -134,9 +271,9 @@ set_border(struct screen_t *screen) {
 		};
 
 		set_fg(screen->gc, screen->colors[state]);
-		xcb_poly_fill_rectangle(conn, screen->win, screen->gc, 4, rs);
+		xcb_poly_fill_rectangle(conn, target(screen), screen->gc, 4, rs);
 		set_fg(screen->gc, screen->border[state]);
-		xcb_poly_rectangle(conn, screen->win, screen->gc, 2, ro);
+		xcb_poly_rectangle(conn, target(screen), screen->gc, 2, ro);
 	}
 }
 
@@ -148,6 +285,118 @@ set_borders() {
 	}
 }
 
+static void
+present_borders() {
+	int i;
+
+	set_borders();
+	++present.serial;
+	for (i = 0; i < nscreens; i++) {
+		xcb_present_pixmap(conn, screens[i]->win, screens[i]->pix, present.serial,
+		                   XCB_NONE, XCB_NONE, 0, 0, XCB_NONE, XCB_NONE, XCB_NONE,
+		                   XCB_PRESENT_OPTION_NONE, 0, 0, 0, 0, NULL);
+	}
+	present.pending = nscreens;
+	present.dirty = false;
+	present.shown = present.input;
+	present.input = 0;
+	xcb_flush(conn);
+}
+
+/* redraw the borders for a new state */
+static void
+update_borders() {
+	if (!present.enabled) {
+		set_borders();
+		xcb_flush(conn);
+		return;
+	}
+	if (!present.input)
+		present.input = now_us();
+	present.dirty = true;
+	if (!present.pending)
+		present_borders();
+}
+
+static bool
+overlap(const struct rect_t *a, const struct rect_t *b) {
+	return a->x < b->x + b->w && b->x < a->x + a->w
+	    && a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+/* the whole root, as one region */
+static bool
+whole_root(const struct screen_t *screen) {
+	return screen->nreg == 1
+	    && screen->regs[0].w == screen->screen->width_in_pixels
+	    && screen->regs[0].h == screen->screen->height_in_pixels;
+}
+
+/*
+ * The regions of the root that the filters run over, each once.
+ * Monitors that overlap, as cloned and mirrored ones do, are merged
+ * into their bounding box. When the regions make up the whole root,
+ * as they do for a single monitor or monitors side by side, the root
+ * is filtered as one frame, as without RANDR. Otherwise each region is
+ * filtered as a frame of its own, and what no monitor shows is left
+ * black.
+ */
+static void
+set_regions(struct screen_t *screen) {
+	int rw = screen->screen->width_in_pixels;
+	int rh = screen->screen->height_in_pixels;
+	int64_t area = 0;
+	bool merged;
+	int i, j;
+
+	free(screen->regs);
+	if (!(screen->regs = malloc((screen->nmon + 1) * sizeof(struct rect_t)))) {
+		err(1, "malloc");
+	}
+	screen->nreg = 0;
+	for (i = 0; i < screen->nmon; ++i) {
+		struct rect_t r = screen->mons[i];
+		int x1 = r.x + r.w < rw ? r.x + r.w : rw;
+		int y1 = r.y + r.h < rh ? r.y + r.h : rh;
+		r.x = r.x > 0 ? r.x : 0;
+		r.y = r.y > 0 ? r.y : 0;
+		r.w = x1 - r.x;
+		r.h = y1 - r.y;
+		if (r.w > 0 && r.h > 0)
+			screen->regs[screen->nreg++] = r;
+	}
+	do {
+		merged = false;
+		for (i = 0; i < screen->nreg; ++i)
+		for (j = i + 1; j < screen->nreg; ++j) {
+			struct rect_t *a = &screen->regs[i], *b = &screen->regs[j];
+			int x1, y1;
+			if (!overlap(a, b))
+				continue;
+			x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+			y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+			a->x = a->x < b->x ? a->x : b->x;
+			a->y = a->y < b->y ? a->y : b->y;
+			a->w = x1 - a->x;
+			a->h = y1 - a->y;
+			*b = screen->regs[--screen->nreg];
+			merged = true;
+		}
+	} while (merged);
+
+	for (i = 0; i < screen->nreg; ++i)
+		area += (int64_t)screen->regs[i].w * screen->regs[i].h;
+	if (!screen->nreg || area == (int64_t)rw * rh) {
+		screen->regs[0] = (struct rect_t){ 0, 0, rw, rh };
+		screen->nreg = 1;
+	}
+	DEBUG(1, "screen=%p nmon=%d nreg=%d whole=%d", (void*)screen,
+	      screen->nmon, screen->nreg, whole_root(screen));
+	for (i = 0; i < screen->nreg && !whole_root(screen); ++i)
+		DEBUG(1, "region x=%d y=%d w=%d h=%d", screen->regs[i].x,
+		      screen->regs[i].y, screen->regs[i].w, screen->regs[i].h);
+}
+
 static void
 set_monitors(struct screen_t *screen) {
 	free(screen->mons);
@@ -196,6 +445,7 @@ set_monitors(struct screen_t *screen) {
 		screen->mons[0].w = screen->screen->width_in_pixels;
 		screen->mons[0].h = screen->screen->height_in_pixels;
 	}
+	set_regions(screen);
 }
 
 static struct screen_t *
@@ -214,11 +464,17 @@ static void
 handle_map_notify(xcb_map_notify_event_t *ev) {
 	struct screen_t *screen = find_screen_by_window(ev->window, false);
 	DEBUG(2, "XCB_MAP_NOTIFY:win=%d (screen=%p)", ev->window, (void*)screen);
-	if (screen) {
+	if (screen && present.enabled) {
+		set_border(screen);
+		xcb_copy_area(conn, screen->pix, screen->win, screen->gc,
+		              0, 0, 0, 0, screen->img.w, screen->img.h);
+		xcb_flush(conn);
+	} else if (screen) {
 		put_image(screen);
 		set_border(screen);
 		xcb_flush(conn);
 	}
+	bench_sync("frame");
 	if (conf.debug > 5) {
 		exit(0);
 	}
@@ -229,7 +485,12 @@ handle_expose(xcb_expose_event_t *ev) {
 	struct screen_t *screen = find_screen_by_window(ev->window, false);
 	DEBUG(2, "XCB_EXPOSE:x=%d y=%d w=%d h=%d (screen=%p)",
 	      ev->x, ev->y, ev->width, ev->height, (void*)screen);
-	if (screen) {
+	stats.exposed += (uint64_t)ev->width * ev->height;
+	if (screen && present.enabled) {
+		xcb_copy_area(conn, screen->pix, screen->win, screen->gc,
+		              ev->x, ev->y, ev->x, ev->y, ev->width, ev->height);
+		xcb_flush(conn);
+	} else if (screen) {
 		put_image(screen);
 		set_border(screen);
 		xcb_flush(conn);
@@ -259,6 +520,9 @@ handle_configure_notify(xcb_configure_notify_event_t *ev) {
 		vals[1] = ev->height;
 		xcb_configure_window(conn, screen->win, mask, vals);
 		set_border(screen);
+		if (present.enabled)
+			xcb_copy_area(conn, screen->pix, screen->win, screen->gc,
+			              0, 0, 0, 0, screen->img.w, screen->img.h);
 		xcb_flush(conn);
 	}
 }
@@ -270,6 +534,7 @@ handle_key_press(xcb_key_press_event_t *ev) {
 	char buf[32];
 	int len;
 
+	bench_mark("key");
 	ksym = xcb_key_press_lookup_keysym(ksyms, ev, ev->state);
 	DEBUG(2, "XCB_KEY_PRESS:keycode=0x%04x state=0x%04x (ksym=0x%04x)", ev->detail, ev->state, ksym);
 
@@ -330,6 +595,28 @@ handle_key_press(xcb_key_press_event_t *ev) {
 	}
 }
 
+/*
+ * The server's UST is CLOCK_MONOTONIC in µs, so the time from the
+ * first input of a present to its vblank is the input-to-photon delay.
+ */
+static void
+handle_present_complete(xcb_present_complete_notify_event_t *ev) {
+	DEBUG(2, "XCB_PRESENT_COMPLETE_NOTIFY:kind=%d mode=%d serial=%u ust=%llu msc=%llu",
+	      ev->kind, ev->mode, ev->serial,
+	      (unsigned long long)ev->ust, (unsigned long long)ev->msc);
+	if (ev->kind != XCB_PRESENT_COMPLETE_KIND_PIXMAP || ev->serial != present.serial)
+		return;
+	if (--present.pending > 0)
+		return;
+	if (present.shown && ev->ust > present.shown) {
+		uint64_t lat = ev->ust - present.shown;
+		hist_add(&stats.vblank, lat);
+		DEBUG(1, "input-to-vblank=%lluus", (unsigned long long)lat);
+	}
+	if (present.dirty)
+		present_borders();
+}
+
 static void
 handle_screen_change(xcb_randr_screen_change_notify_event_t *ev) {
 	struct screen_t *screen = find_screen_by_window(ev->root, true);
@@ -344,15 +631,28 @@ handle_screen_change(xcb_randr_screen_change_notify_event_t *ev) {
 void
 mainloop() {
 	struct pollfd pfd;
+	sigset_t waitmask;
 
 	pfd.fd = xcb_get_file_descriptor(conn);
 	pfd.events = POLLIN;
 
 	log_state();
+	stats_init(&waitmask);
 
-	while (state != STATE_UNLOCK && poll(&pfd, 1, -1) == 1) {
+	while (state != STATE_UNLOCK) {
 		xcb_generic_event_t *ev;
 		int old = state;
+		int ret;
+
+		/* SIGUSR1 is only let through while waiting */
+		ret = ppoll(&pfd, 1, NULL, &waitmask);
+		if (ret < 0 && errno == EINTR) {
+			stats_poll();
+			continue;
+		}
+		if (ret != 1) {
+			break;
+		}
 
 		if (pfd.revents & ~POLLIN) {
 			errx(1, "poll %d: revents=%04x", pfd.fd, pfd.revents);
@@ -361,6 +661,7 @@ mainloop() {
 		xcb_flush(conn);
 		while ((ev = xcb_poll_for_event(conn))) {
 			int type = ev->response_type & 0x7f;
+			++stats.events[type];
 			if (type == XCB_MAP_NOTIFY) {
 				handle_map_notify((xcb_map_notify_event_t*)ev);
 			} else if (type == XCB_EXPOSE) {
@@ -368,21 +669,31 @@ mainloop() {
 			} else if (type == XCB_KEY_RELEASE) {
 				handle_key_release((xcb_key_release_event_t*)ev);
 			} else if (type == XCB_KEY_PRESS) {
+				uint64_t t = now_us();
 				handle_key_press((xcb_key_press_event_t*)ev);
+				hist_add(&stats.key, now_us() - t);
 			} else if (type == XCB_CONFIGURE_NOTIFY) {
 				handle_configure_notify((xcb_configure_notify_event_t*)ev);
 			} else if (rrbase >= 0 && type == rrbase + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
 				handle_screen_change((xcb_randr_screen_change_notify_event_t*)ev);
+			} else if (present.enabled && type == XCB_GE_GENERIC
+			        && ((xcb_ge_generic_event_t*)ev)->extension == present.opcode
+			        && ((xcb_ge_generic_event_t*)ev)->event_type == XCB_PRESENT_COMPLETE_NOTIFY) {
+				handle_present_complete((xcb_present_complete_notify_event_t*)ev);
 			} else {
 				DEBUG(2, "Unhandled event=%d", type);
 			}
 			free(ev);
 		}
 		if (state != old) {
-			set_borders();
-			xcb_flush(conn);
+			update_borders();
+			bench_sync("border");
 		}
 	}
+	/* the final state is shown without waiting for the frame before */
+	if (present.dirty)
+		present_borders();
+	bench_sync("unlock");
 	usleep(conf.timeout * 1000);
 }
 
@@ -434,6 +745,7 @@ grab_inputs(xcb_screen_t *screen, int attempts) {
 		}
 		if (pg && kg) {
 			DEBUG(2, "attemps left=%d", attempts);
+			bench_mark("grab");
 			return 0;
 		}
 		usleep(1000);
@@ -510,36 +822,580 @@ init_colors(struct screen_t *screen) {
 }
 
 static void
-create_image(struct screen_t *screen) {
-	uint32_t *tmp, *src;
-	size_t len;
-	int w, h;
+init_format(struct screen_t *screen) {
+	const xcb_setup_t *setup = xcb_get_setup(conn);
+	xcb_visualtype_t *visual = NULL;
+	xcb_format_t *pf = NULL;
+
+	xcb_format_iterator_t fi;
+	for (fi = xcb_setup_pixmap_formats_iterator(setup); fi.rem; xcb_format_next(&fi)) {
+		if (fi.data->depth == screen->screen->root_depth) {
+			pf = fi.data;
+			break;
+		}
+	}
 
-	screen->img.w = w = screen->screen->width_in_pixels;
-	screen->img.h = h = screen->screen->height_in_pixels;
+	xcb_depth_iterator_t di;
+	for (di = xcb_screen_allowed_depths_iterator(screen->screen); di.rem && !visual; xcb_depth_next(&di)) {
+		xcb_visualtype_iterator_t vi;
+		for (vi = xcb_depth_visuals_iterator(di.data); vi.rem; xcb_visualtype_next(&vi)) {
+			if (vi.data->visual_id == screen->screen->root_visual) {
+				visual = vi.data;
+				break;
+			}
+		}
+	}
+
+	if (!pf || !visual) {
+		errx(1, "no pixmap format for root depth %d", screen->screen->root_depth);
+	}
+	if (visual->_class != XCB_VISUAL_CLASS_TRUE_COLOR
+	 && visual->_class != XCB_VISUAL_CLASS_DIRECT_COLOR) {
+		errx(1, "unsupported root visual class %d", visual->_class);
+	}
+	if (format_init(&screen->fmt, pf->depth, pf->bits_per_pixel, pf->scanline_pad,
+	                setup->image_byte_order == XCB_IMAGE_ORDER_MSB_FIRST,
+	                visual->red_mask, visual->green_mask, visual->blue_mask) < 0) {
+		errx(1, "unsupported pixel format: depth=%d bpp=%d pad=%d",
+		     pf->depth, pf->bits_per_pixel, pf->scanline_pad);
+	}
+	screen->deep = format_is_deep(&screen->fmt) && !render && !conf.wallpaper
+	            && planar_chain(conf.filters, conf.nfilter);
+	DEBUG(1, "deep=%d", screen->deep);
+}
+
+/*
+ * Decode a captured image into the arena and filter it. On a deep
+ * screen, the frame is decoded into the channel planes and filtered
+ * there, and arena->img gets native words, see apply_planar.
+ */
+static void
+filter_image(struct screen_t *screen, struct arena_t *arena, const uint8_t *data) {
+	if (screen->deep) {
+		arena_planes(arena);
+		format_decode16(&screen->fmt, arena->plane, data, arena->w, arena->h);
+		apply_planar(arena, conf.filters, conf.nfilter);
+		format_encode16(&screen->fmt, arena->img, arena->plane, arena->w, arena->h);
+		return;
+	}
+	format_decode(&screen->fmt, arena->img, data, arena->w, arena->h);
+	apply_filters(arena, conf.filters, conf.nfilter);
+}
+
+/* each region filtered as a frame of its own, see set_regions */
+static uint32_t *
+capture_regions(struct screen_t *screen, int w, int h) {
+	xcb_get_image_cookie_t cookie[screen->nreg];
+	uint32_t *img = frame_alloc((size_t)w * h * sizeof(uint32_t));
+	int i, y;
+
+	for (i = 0; i < screen->nreg; ++i) {
+		const struct rect_t *r = &screen->regs[i];
+		cookie[i] = xcb_get_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, screen->screen->root,
+		                          r->x, r->y, r->w, r->h, -1);
+	}
+	for (i = 0; i < screen->nreg; ++i) {
+		const struct rect_t *r = &screen->regs[i];
+		struct arena_t arena;
+		xcb_get_image_reply_t *imgrep;
+		xcb_generic_error_t *imgerr;
+		size_t len = format_stride(&screen->fmt, r->w) * r->h;
+
+		imgrep = xcb_get_image_reply(conn, cookie[i], &imgerr);
+		if (imgerr || !imgrep) {
+			errx(1, "unable to get image %d", imgerr ? imgerr->error_code : 0);
+		}
+		if ((size_t)xcb_get_image_data_length(imgrep) < len) {
+			errx(1, "short image: %d < %zu", xcb_get_image_data_length(imgrep), len);
+		}
+		arena_init(&arena, r->w, r->h, conf.filters, conf.nfilter);
+		filter_image(screen, &arena, xcb_get_image_data(imgrep));
+		free(imgrep);
+
+		for (y = 0; y < r->h; ++y)
+			memcpy(img + (size_t)(r->y + y) * w + r->x, arena.img + (size_t)y * r->w,
+			       r->w * sizeof(uint32_t));
+		frame_free(arena_finish(&arena), (size_t)r->w * r->h * sizeof(uint32_t));
+	}
+	return img;
+}
+
+static uint32_t *
+capture_root(struct screen_t *screen, int w, int h) {
+	struct arena_t arena;
+	struct rusage ru[3];
+	uint32_t *img;
+	size_t len;
 
 	xcb_get_image_cookie_t cookie;
 	xcb_get_image_reply_t *imgrep;
 	xcb_generic_error_t *imgerr;
 
+	if (!whole_root(screen))
+		return capture_regions(screen, w, h);
+
 	cookie = xcb_get_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, screen->screen->root, 0, 0, w, h, -1);
 	imgrep = xcb_get_image_reply(conn, cookie, &imgerr);
 	if (imgerr || !imgrep) {
 		err(1, "unable to get image %d", imgerr->error_code);
 	}
 
-	len = xcb_get_image_data_length(imgrep);
-	tmp = malloc(len);
+	len = format_stride(&screen->fmt, w) * h;
+	if ((size_t)xcb_get_image_data_length(imgrep) < len) {
+		errx(1, "short image: %d < %zu", xcb_get_image_data_length(imgrep), len);
+	}
+	getrusage(RUSAGE_SELF, &ru[0]);
+	arena_init(&arena, w, h, conf.filters, conf.nfilter);
+	getrusage(RUSAGE_SELF, &ru[1]);
+
+	filter_image(screen, &arena, xcb_get_image_data(imgrep));
+	free(imgrep);
+
+	img = arena_finish(&arena);
+	getrusage(RUSAGE_SELF, &ru[2]);
+	DEBUG(1, "page faults: arena=%ld/%ld filters=%ld/%ld (minor/major)",
+	      ru[1].ru_minflt - ru[0].ru_minflt, ru[1].ru_majflt - ru[0].ru_majflt,
+	      ru[2].ru_minflt - ru[1].ru_minflt, ru[2].ru_majflt - ru[1].ru_majflt);
+	return img;
+}
+
+static xcb_render_pictformat_t
+root_pictformat(struct screen_t *screen) {
+	xcb_render_query_pict_formats_cookie_t cookie;
+	xcb_render_query_pict_formats_reply_t *reply;
+	xcb_render_pictformat_t fmt = XCB_NONE;
+
+	cookie = xcb_render_query_pict_formats(conn);
+	if (!(reply = xcb_render_query_pict_formats_reply(conn, cookie, NULL))) {
+		errx(1, "unable to query render picture formats");
+	}
+
+	xcb_render_pictscreen_iterator_t si;
+	for (si = xcb_render_query_pict_formats_screens_iterator(reply); si.rem && !fmt; xcb_render_pictscreen_next(&si)) {
+		xcb_render_pictdepth_iterator_t di;
+		for (di = xcb_render_pictscreen_depths_iterator(si.data); di.rem && !fmt; xcb_render_pictdepth_next(&di)) {
+			xcb_render_pictvisual_iterator_t vi;
+			for (vi = xcb_render_pictdepth_visuals_iterator(di.data); vi.rem; xcb_render_pictvisual_next(&vi)) {
+				if (vi.data->visual == screen->screen->root_visual) {
+					fmt = vi.data->format;
+					break;
+				}
+			}
+		}
+	}
+	free(reply);
+
+	if (!fmt) {
+		errx(1, "no render picture format for the root visual");
+	}
+	return fmt;
+}
+
+/*
+ * Each pass convolves with a 1-D kernel in 16.16 fixed point. Outside
+ * the picture is transparent black, which weighs the edges down the
+ * way the client side blur does; the result is within two levels of
+ * filter_gaussian's, see check_render.
+ */
+static void
+render_root(struct screen_t *screen, int w, int h) {
+	xcb_render_pictformat_t fmt = root_pictformat(screen);
+	xcb_render_picture_t pic[2];
+	xcb_void_cookie_t cookie;
+	xcb_gcontext_t gc;
+	xcb_pixmap_t tmp;
+	uint32_t val;
+	size_t i;
+	int pass, k;
+
+	val = XCB_SUBWINDOW_MODE_INCLUDE_INFERIORS;
+	gc = xcb_generate_id(conn);
+	xcb_create_gc(conn, gc, screen->screen->root, XCB_GC_SUBWINDOW_MODE, &val);
+	xcb_copy_area(conn, screen->screen->root, screen->pix, gc, 0, 0, 0, 0, w, h);
+	xcb_free_gc(conn, gc);
+
+	tmp = xcb_generate_id(conn);
+	cookie = xcb_create_pixmap_checked(conn, screen->screen->root_depth, tmp,
+	                                   screen->win, w, h);
+	check_xcb_cookie(cookie, "could not create pixmap");
+
+	pic[0] = xcb_generate_id(conn);
+	pic[1] = xcb_generate_id(conn);
+	cookie = xcb_render_create_picture_checked(conn, pic[0], screen->pix, fmt, 0, NULL);
+	check_xcb_cookie(cookie, "could not create picture");
+	cookie = xcb_render_create_picture_checked(conn, pic[1], tmp, fmt, 0, NULL);
+	check_xcb_cookie(cookie, "could not create picture");
+
+	for (i = 0; i < conf.nfilter; ++i) {
+		double wt[2 * CONV_MAXRAD + 1];
+		xcb_render_fixed_t vals[2 + 2 * CONV_MAXRAD + 1];
+		int klen = gaussian_weights(wt, conf.filters[i].param.u);
+
+		DEBUG(1, "render: gaussian r=%u", conf.filters[i].param.u);
+		for (k = 0; k < klen; ++k)
+			vals[2 + k] = wt[k] * 65536 + 0.5;
+		for (pass = 0; pass < 2; ++pass) {
+			vals[0] = (pass ? 1 : klen) << 16;
+			vals[1] = (pass ? klen : 1) << 16;
+			xcb_render_set_picture_filter(conn, pic[pass], strlen("convolution"),
+			                              "convolution", klen + 2, vals);
+			cookie = xcb_render_composite_checked(conn, XCB_RENDER_PICT_OP_SRC,
+			                                      pic[pass], XCB_NONE, pic[!pass],
+			                                      0, 0, 0, 0, 0, 0, w, h);
+			check_xcb_cookie(cookie, "could not composite");
+		}
+	}
+
+	xcb_render_free_picture(conn, pic[0]);
+	xcb_render_free_picture(conn, pic[1]);
+	xcb_free_pixmap(conn, tmp);
+}
+
+/* put w×h pixels of img, rows pitch apart, at x, y in chunks that fit a
+ * request; on a deep screen, img holds native words */
+static void
+put_rows(struct screen_t *screen, xcb_drawable_t dst, const uint32_t *img,
+         int pitch, int x, int y, int w, int h) {
+	size_t stride = format_stride(&screen->fmt, w);
+	size_t maxreq = (size_t)xcb_get_maximum_request_length(conn) * 4;
+	uint32_t *tmp = NULL;
+	uint8_t *buf;
+	int rows, i, r;
+
+	if (!w || !h)
+		return;
+	if ((rows = (maxreq - 64) / stride) <= 0) {
+		errx(1, "a row of %d pixels does not fit a request", w);
+	}
+	if (rows > h)
+		rows = h;
+	if (pitch != w && !(tmp = malloc((size_t)w * rows * sizeof(uint32_t)))) {
+		err(1, "malloc");
+	}
+	if (!(buf = malloc(stride * rows))) {
+		err(1, "malloc");
+	}
+
+	for (i = 0; i < h; i += rows) {
+		const uint32_t *src = img + (size_t)i * pitch;
+		int n = rows < h - i ? rows : h - i;
+		if (tmp) {
+			for (r = 0; r < n; ++r)
+				memcpy(tmp + (size_t)r * w, src + (size_t)r * pitch, w * sizeof(uint32_t));
+			src = tmp;
+		}
+		if (screen->deep)
+			memcpy(buf, src, stride * n);
+		else
+			format_encode(&screen->fmt, buf, src, w, n);
+		xcb_put_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, dst, screen->gc,
+		              w, n, x, y + i, 0, screen->screen->root_depth, stride * n, buf);
+		stats.putbytes += stride * n;
+	}
+	free(tmp);
+	free(buf);
+}
+
+/* upload rows y..y+n of the filtered frame, img being row y */
+static void
+upload_rows(struct screen_t *screen, const uint32_t *img, int y, int n) {
+	int w = screen->img.w;
+	int s = screen->blk ? blocksiz : 0;
+	int nbx = s ? w / s : 0;
+	int nby = s ? screen->img.h / s : 0;
+	int by0, by1, bx, by, full;
+	uint32_t *blk;
+
+	if (!nbx || !nby) {
+		put_rows(screen, screen->pix, img, w, 0, y, w, n);
+		return;
+	}
+
+	/* y is on a block boundary: strips are aligned to pixelate */
+	by0 = y / s;
+	by1 = (y + n) / s < nby ? (y + n) / s : nby;
+	full = y > by1 * s ? y : by1 * s;
+	if (by1 > by0) {
+		if (!(blk = malloc((size_t)nbx * (by1 - by0) * sizeof(uint32_t)))) {
+			err(1, "malloc");
+		}
+		for (by = by0; by < by1; ++by)
+		for (bx = 0; bx < nbx; ++bx)
+			blk[(size_t)(by - by0) * nbx + bx] = img[(size_t)(by * s - y) * w + bx * s];
+		put_rows(screen, screen->blk, blk, nbx, 0, by0, nbx, by1 - by0);
+		free(blk);
+		put_rows(screen, screen->pix, img + nbx * s, w,
+		         nbx * s, y, w - nbx * s, (by1 - by0) * s);
+	}
+	put_rows(screen, screen->pix, img + (size_t)(full - y) * w, w, 0, full, w, y + n - full);
+}
+
+static void
+create_blocks(struct screen_t *screen) {
+	xcb_void_cookie_t cookie;
+	int nbx = screen->img.w / blocksiz;
+	int nby = screen->img.h / blocksiz;
+
+	screen->blk = XCB_NONE;
+	if (!nbx || !nby)
+		return;
+	screen->blk = xcb_generate_id(conn);
+	cookie = xcb_create_pixmap_checked(conn, screen->screen->root_depth, screen->blk,
+	                                   screen->win, nbx, nby);
+	check_xcb_cookie(cookie, "could not create pixmap");
+}
+
+/* rows per strip, long enough that the halo is not most of the work */
+static int
+strip_rows() {
+	int rows = STRIP_ROWS > 8 * strips.halo ? STRIP_ROWS : 8 * strips.halo;
+	return ROUNDUP(rows, strips.align);
+}
+
+/* the rows of the strip at y, and its halo */
+static void
+strip_span(int y, int rows, int h, int *top, int *bot) {
+	*top = y - strips.halo > 0 ? y - strips.halo : 0;
+	*bot = y + rows + strips.halo < h ? y + rows + strips.halo : h;
+}
+
+/* the strip at row y of region r, and its halo */
+static xcb_get_image_cookie_t
+request_strip(struct screen_t *screen, const struct rect_t *r, int y, int rows) {
+	int top, bot;
+	strip_span(y, rows, r->h, &top, &bot);
+	return xcb_get_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, screen->screen->root,
+	                     r->x, r->y + top, r->w, bot - top, -1);
+}
+
+static void
+capture_strips(struct screen_t *screen, const struct rect_t *r) {
+	struct arena_t arena;
+	struct rusage ru[3];
+	long flt[2][2] = { { 0, 0 }, { 0, 0 } };  /* arena and filters, minor and major */
+	xcb_get_image_cookie_t cookie[2];
+	size_t stride = format_stride(&screen->fmt, r->w);
+	int w = r->w, h = r->h;
+	int rows, y, cur = 0;
+
+	rows = strip_rows();
+	DEBUG(1, "rows=%d halo=%d align=%d", rows, strips.halo, strips.align);
+
+	arena.img = NULL;
+
+	cookie[cur] = request_strip(screen, r, 0, rows);
+	for (y = 0; y < h; y += rows, cur = !cur) {
+		int n = rows < h - y ? rows : h - y;
+		int top, bot;
+		xcb_get_image_reply_t *imgrep;
+		xcb_generic_error_t *imgerr;
+
+		if (y + rows < h)
+			cookie[!cur] = request_strip(screen, r, y + rows, rows);
+		imgrep = xcb_get_image_reply(conn, cookie[cur], &imgerr);
+		if (imgerr || !imgrep) {
+			errx(1, "unable to get image %d", imgerr ? imgerr->error_code : 0);
+		}
+
+		/* what a filter needs depends on the height, which changes
+		 * only for the first and last strips */
+		strip_span(y, rows, h, &top, &bot);
+		getrusage(RUSAGE_SELF, &ru[0]);
+		if (!arena.img || arena.h != bot - top) {
+			if (arena.img)
+				frame_free(arena_finish(&arena), (size_t)w * arena.h * sizeof(uint32_t));
+			arena_init(&arena, w, bot - top, conf.filters, conf.nfilter);
+		}
+		getrusage(RUSAGE_SELF, &ru[1]);
+		if ((size_t)xcb_get_image_data_length(imgrep) < stride * arena.h) {
+			errx(1, "short image: %d < %zu",
+			     xcb_get_image_data_length(imgrep), stride * arena.h);
+		}
+		filter_image(screen, &arena, xcb_get_image_data(imgrep));
+		free(imgrep);
+		getrusage(RUSAGE_SELF, &ru[2]);
+		flt[0][0] += ru[1].ru_minflt - ru[0].ru_minflt;
+		flt[0][1] += ru[1].ru_majflt - ru[0].ru_majflt;
+		flt[1][0] += ru[2].ru_minflt - ru[1].ru_minflt;
+		flt[1][1] += ru[2].ru_majflt - ru[1].ru_majflt;
+
+		if (whole_root(screen))
+			upload_rows(screen, arena.img + (size_t)(y - top) * w, y, n);
+		else
+			put_rows(screen, screen->pix, arena.img + (size_t)(y - top) * w, w,
+			         r->x, r->y + y, w, n);
+	}
+	++stats.puts;
+	DEBUG(1, "page faults: arena=%ld/%ld filters=%ld/%ld (minor/major)",
+	      flt[0][0], flt[0][1], flt[1][0], flt[1][1]);
+
+	frame_free(arena_finish(&arena), (size_t)w * arena.h * sizeof(uint32_t));
+}
+
+/*
+ * The transform maps the screen's pixmap back to the blocks. Scaling
+ * by 1/s in 16.16 is inexact, so it is set per tile, each starting on
+ * a block, and tiles are kept small enough that the error stays well
+ * within a block: under 0.125/s of a pixel, where the nearest filter
+ * would pick the wrong block at 0.5/s.
+ */
+static void
+expand_blocks(struct screen_t *screen) {
+	xcb_render_pictformat_t fmt;
+	xcb_render_picture_t src, dst;
+	xcb_void_cookie_t cookie;
+	int s = blocksiz;
+	int bw = screen->img.w / s * s;
+	int bh = screen->img.h / s * s;
+	int tile = 16384 / s / s * s;
+	int32_t scale = (65536 + s / 2) / s;
+	int tx, ty;
+
+	if (!screen->blk)
+		return;
+	fmt = root_pictformat(screen);
+	src = xcb_generate_id(conn);
+	dst = xcb_generate_id(conn);
+	cookie = xcb_render_create_picture_checked(conn, src, screen->blk, fmt, 0, NULL);
+	check_xcb_cookie(cookie, "could not create picture");
+	cookie = xcb_render_create_picture_checked(conn, dst, screen->pix, fmt, 0, NULL);
+	check_xcb_cookie(cookie, "could not create picture");
+	xcb_render_set_picture_filter(conn, src, strlen("nearest"), "nearest", 0, NULL);
+
+	for (ty = 0; ty < bh; ty += tile)
+	for (tx = 0; tx < bw; tx += tile) {
+		xcb_render_transform_t m = {
+			scale, 0, (tx / s) << 16,
+			0, scale, (ty / s) << 16,
+			0, 0, 1 << 16,
+		};
+		xcb_render_set_picture_transform(conn, src, m);
+		xcb_render_composite(conn, XCB_RENDER_PICT_OP_SRC, src, XCB_NONE, dst,
+		                     0, 0, 0, 0, tx, ty,
+		                     tile < bw - tx ? tile : bw - tx,
+		                     tile < bh - ty ? tile : bh - ty);
+	}
+	cookie = xcb_render_free_picture_checked(conn, src);
+	check_xcb_cookie(cookie, "could not expand blocks");
+	xcb_render_free_picture(conn, dst);
+	xcb_free_pixmap(conn, screen->blk);
+	screen->blk = XCB_NONE;
+}
+
+/* the plan tuned for the largest frame the chain runs on for screen,
+ * on XRGB or on the planes of a deep one */
+static void
+tune_screen(struct screen_t *screen) {
+	const struct rect_t *r = &screen->regs[0];
+	int i, h;
+
+	if (render || conf.wallpaper)
+		return;
+	for (i = 1; i < screen->nreg; ++i) {
+		if ((int64_t)screen->regs[i].w * screen->regs[i].h > (int64_t)r->w * r->h)
+			r = &screen->regs[i];
+	}
+	h = r->h;
+	if (strips.enabled && strip_rows() + 2 * strips.halo < h)
+		h = strip_rows() + 2 * strips.halo;
+	tune_filters(r->w, h, conf.filters, conf.nfilter, screen->deep);
+}
+
+static uint32_t *
+warm_frame(struct screen_t *screen, int w, int h) {
+	int i;
+	for (i = 0; i < warm.nscreens; ++i) {
+		struct warm_t *ws = &warm.screens[i];
+		if (ws->screen.screen->root != screen->screen->root)
+			continue;
+		/* monitors may have changed since it was last refreshed */
+		if (ws->w != w || ws->h != h || ws->screen.nreg != screen->nreg
+		 || memcmp(ws->screen.regs, screen->regs, screen->nreg * sizeof(struct rect_t)))
+			return NULL;
+		return ws->frame;
+	}
+	return NULL;
+}
 
-	src = (uint32_t*)xcb_get_image_data(imgrep);
-	memcpy(tmp, src, len);
+/*
+ * The filtered frame to lock over. A warm frame stays with the daemon,
+ * so map is NULL then.
+ */
+static uint32_t *
+get_frame(struct screen_t *screen, int w, int h, void **map, size_t *maplen) {
+	uint32_t *img;
+
+	if ((img = warm_frame(screen, w, h))) {
+		*map = NULL;
+		*maplen = 0;
+		return img;
+	}
+	if (conf.wallpaper)
+		return wallpaper_load(conf.wallpaper, w, h, conf.filters, conf.nfilter, map, maplen);
+	*map = img = capture_root(screen, w, h);
+	*maplen = (size_t)w * h * sizeof(uint32_t);
+	return img;
+}
 
-	apply_filters(tmp, w, h, conf.filters, conf.nfilter);
+static void
+create_image(struct screen_t *screen) {
+	uint32_t *tmp;
+	void *map;
+	size_t len, maplen;
+	int w, h, i;
 
-	screen->img.data = tmp;
+	screen->img.w = w = screen->screen->width_in_pixels;
+	screen->img.h = h = screen->screen->height_in_pixels;
+	tune_screen(screen);
+
+	/* blocks are laid out on the root, not on the regions */
+	screen->blk = XCB_NONE;
+	if (blocksiz && whole_root(screen))
+		create_blocks(screen);
+
+	if (render || strips.enabled || blocksiz) {
+		if (render) {
+			render_root(screen, w, h);
+		} else if (strips.enabled && !warm_frame(screen, w, h)) {
+			if (!whole_root(screen)) {
+				xcb_rectangle_t all = { 0, 0, w, h };
+				set_fg(screen->gc, screen->screen->black_pixel);
+				xcb_poly_fill_rectangle(conn, screen->pix, screen->gc, 1, &all);
+			}
+			for (i = 0; i < screen->nreg; ++i)
+				capture_strips(screen, &screen->regs[i]);
+		} else {
+			tmp = get_frame(screen, w, h, &map, &maplen);
+			upload_rows(screen, tmp, 0, h);
+			++stats.puts;
+			frame_free(map, maplen);
+		}
+		if (blocksiz)
+			expand_blocks(screen);
+		screen->img.data = NULL;
+		screen->img.map = NULL;
+		screen->img.maplen = 0;
+		screen->img.len = 0;
+		put_image(screen);
+		return;
+	}
+
+	tmp = get_frame(screen, w, h, &map, &maplen);
+
+	len = format_stride(&screen->fmt, w) * h;
+	if (screen->deep || format_is_native(&screen->fmt, w)) {
+		screen->img.data = (uint8_t*)tmp;
+		screen->img.map = map;
+		screen->img.maplen = maplen;
+	} else {
+		screen->img.data = frame_alloc(len);
+		screen->img.map = screen->img.data;
+		screen->img.maplen = len;
+		format_encode(&screen->fmt, screen->img.data, tmp, w, h);
+		frame_free(map, maplen);
+	}
 	screen->img.len = len;
 
-	free(imgrep);
 	put_image(screen);
 }
 
@@ -557,12 +1413,15 @@ init_screen(xcb_screen_t *xscreen) {
 	screen->screen = xscreen;
 	screen->mons = NULL;
 	screen->nmon = 0;
+	screen->regs = NULL;
+	screen->nreg = 0;
 
 	if (grab_inputs(screen->screen, 100) < 0) {
 		errx(1, "failed to grab input devices");
 	}
 	
 	set_monitors(screen);
+	init_format(screen);
 
 	xcb_change_window_attributes(conn, screen->screen->root, XCB_CW_EVENT_MASK,
                                      (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
@@ -615,6 +1474,22 @@ init_screen(xcb_screen_t *xscreen) {
 
 	init_colors(screen);
 
+	if (server_image()) {
+		screen->pix = xcb_generate_id(conn);
+		cookie = xcb_create_pixmap_checked(conn,
+		                                   screen->screen->root_depth,
+		                                   screen->pix,
+		                                   screen->win,
+		                                   screen->screen->width_in_pixels,
+		                                   screen->screen->height_in_pixels);
+		check_xcb_cookie(cookie, "could not create pixmap");
+	}
+	if (present.enabled) {
+		cookie = xcb_present_select_input_checked(conn, xcb_generate_id(conn), screen->win,
+		                                          XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY);
+		check_xcb_cookie(cookie, "could not select present input");
+	}
+
 	if (rrbase >= 0) {
 		mask = XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE;
 		xcb_randr_select_input(conn, screen->screen->root, mask);
@@ -622,16 +1497,106 @@ init_screen(xcb_screen_t *xscreen) {
 
 	cookie = xcb_map_window_checked(conn, screen->win);
 	check_xcb_cookie(cookie, "could not map window");
+	bench_mark("map");
 
 	create_image(screen);
 
-	ksyms = xcb_key_symbols_alloc(conn);
+	if (!ksyms)
+		ksyms = xcb_key_symbols_alloc(conn);
 
 	return screen;
 }
 
-void
-xcb_init() {
+static void
+init_present() {
+	const xcb_query_extension_reply_t *ext;
+	xcb_present_query_version_cookie_t cookie;
+	xcb_present_query_version_reply_t *reply;
+
+	ext = xcb_get_extension_data(conn, &xcb_present_id);
+	if (!ext || !ext->present) {
+		warnx("no Present extension, drawing borders immediately");
+		return;
+	}
+	cookie = xcb_present_query_version(conn, 1, 0);
+	if (!(reply = xcb_present_query_version_reply(conn, cookie, NULL))) {
+		warnx("Present version query failed, drawing borders immediately");
+		return;
+	}
+	DEBUG(1, "present %u.%u", reply->major_version, reply->minor_version);
+	free(reply);
+	present.enabled = true;
+	present.opcode = ext->major_opcode;
+}
+
+/* picture filters and transforms are 0.6 */
+static bool
+render_supported() {
+	const xcb_query_extension_reply_t *ext;
+	xcb_render_query_version_cookie_t cookie;
+	xcb_render_query_version_reply_t *reply;
+	bool ok;
+
+	ext = xcb_get_extension_data(conn, &xcb_render_id);
+	if (!ext || !ext->present) {
+		return false;
+	}
+	cookie = xcb_render_query_version(conn, 0, 11);
+	if (!(reply = xcb_render_query_version_reply(conn, cookie, NULL))) {
+		return false;
+	}
+	DEBUG(1, "render %u.%u", reply->major_version, reply->minor_version);
+	ok = reply->major_version > 0 || reply->minor_version >= 6;
+	free(reply);
+	return ok;
+}
+
+/* only a chain of blurs has a server side equivalent */
+static void
+init_render() {
+	size_t i;
+
+	if (conf.wallpaper) {
+		warnx("--render does not apply to a wallpaper, filtering on the client");
+		return;
+	}
+	if (conf.linear) {
+		warnx("--render blurs sRGB, not linear light, filtering on the client");
+		return;
+	}
+	for (i = 0; i < conf.nfilter; ++i) {
+		if (conf.filters[i].def != &filterdef_gaussian) {
+			warnx("--render only does blurs, filtering on the client");
+			return;
+		}
+	}
+	if (!(render = render_supported())) {
+		warnx("no RENDER 0.6 or later, filtering on the client");
+	}
+}
+
+/* a final pixelate, or gaussian and pixelate fused into blurpix */
+static void
+init_blocks() {
+	const struct filter_t *last;
+	int siz;
+
+	if (!conf.nfilter)
+		return;
+	last = &conf.filters[conf.nfilter - 1];
+	if (last->def == &filterdef_pixelate)
+		siz = last->param.us.u1;
+	else if (last->def == &filterdef_blurpix)
+		siz = last->param.us.u2;
+	else
+		return;
+	if (siz <= BLOCKS_MAXSIZ && render_supported())
+		blocksiz = siz;
+	DEBUG(1, "blocks=%d", blocksiz);
+}
+
+static void
+open_display() {
 	if (!(conn = xcb_connect(NULL, NULL))) {
 		errx(1, "could not connect to X server");
 	}
@@ -641,7 +1606,23 @@ xcb_init() {
 	if (ext->present) {
 		rrbase = ext->first_event;
 	}
+	if (conf.vsync) {
+		init_present();
+	}
+	if (conf.render) {
+		init_render();
+	}
+	if (!conf.wallpaper && !render) {
+		strips.halo = strip_halo(conf.filters, conf.nfilter, &strips.align);
+		strips.enabled = strips.halo >= 0;
+	}
+	if (!render) {
+		init_blocks();
+	}
+}
 
+static void
+lock_screens() {
 	xcb_screen_iterator_t iter;
 	for (nscreens = 0, iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
 	     iter.rem;
@@ -655,16 +1636,448 @@ xcb_init() {
 	}
 }
 
-void
-xcb_close() {
+static void
+unlock_screens() {
 	int i;
 	for (i = 0; i < nscreens; i++) {
+		if (server_image())
+			xcb_free_pixmap(conn, screens[i]->pix);
+		xcb_destroy_window(conn, screens[i]->win);
+		xcb_free_gc(conn, screens[i]->gc);
+		xcb_free_colormap(conn, screens[i]->cmap);
 		free(screens[i]->mons);
-		free(screens[i]->img.data);
+		free(screens[i]->regs);
+		frame_free(screens[i]->img.map, screens[i]->img.maplen);
 		free(screens[i]);
 	}
 	free(screens);
+	screens = NULL;
+	nscreens = 0;
 
+	xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+	xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
 	xcb_key_symbols_free(ksyms);
+	ksyms = NULL;
+	present.pending = 0;
+	present.dirty = false;
+	xcb_flush(conn);
+}
+
+void
+xcb_init() {
+	open_display();
+	lock_screens();
+}
+
+void
+xcb_close() {
+	if (stats.vblank.n) {
+		DEBUG(1, "input-to-vblank: n=%llu avg=%lluus max=%lluus",
+		      (unsigned long long)stats.vblank.n,
+		      (unsigned long long)(stats.vblank.sum / stats.vblank.n),
+		      (unsigned long long)stats.vblank.max);
+	}
+	unlock_screens();
 	xcb_disconnect(conn);
 }
+
+/* refilter rows top..bot of the warm frame, region by region */
+static void
+refresh_warm(struct warm_t *ws, int top, int bot) {
+	struct arena_t arena;
+	uint64_t t = now_us();
+	int w = ws->w, h = ws->h;
+	int rows, y, i, k;
+
+	if (!strips.enabled) {
+		frame_free(ws->frame, (size_t)w * h * sizeof(uint32_t));
+		ws->frame = capture_root(&ws->screen, w, h);
+		DEBUG(1, "refreshed %dx%d in %lluus", w, h, (unsigned long long)(now_us() - t));
+		return;
+	}
+
+	rows = strip_rows();
+	for (i = 0; i < ws->screen.nreg; ++i) {
+		const struct rect_t *r = &ws->screen.regs[i];
+		size_t stride = format_stride(&ws->screen.fmt, r->w);
+		int rtop = top - r->y > 0 ? top - r->y : 0;
+		int rbot = bot - r->y < r->h ? bot - r->y : r->h;
+
+		if (rtop >= rbot)
+			continue;
+		rtop -= rtop % strips.align;
+		rbot = ROUNDUP(rbot, strips.align) < r->h ? ROUNDUP(rbot, strips.align) : r->h;
+
+		for (y = rtop; y < rbot; y += rows) {
+			int n = rows < rbot - y ? rows : rbot - y;
+			int stop, sbot;
+			xcb_get_image_reply_t *imgrep;
+			xcb_generic_error_t *imgerr;
+
+			imgrep = xcb_get_image_reply(conn, request_strip(&ws->screen, r, y, n), &imgerr);
+			if (imgerr || !imgrep) {
+				errx(1, "unable to get image %d", imgerr ? imgerr->error_code : 0);
+			}
+			strip_span(y, n, r->h, &stop, &sbot);
+			arena_init(&arena, r->w, sbot - stop, conf.filters, conf.nfilter);
+			if ((size_t)xcb_get_image_data_length(imgrep) < stride * arena.h) {
+				errx(1, "short image: %d < %zu",
+				     xcb_get_image_data_length(imgrep), stride * arena.h);
+			}
+			filter_image(&ws->screen, &arena, xcb_get_image_data(imgrep));
+			free(imgrep);
+
+			for (k = 0; k < n; ++k)
+				memcpy(ws->frame + (size_t)(r->y + y + k) * w + r->x,
+				       arena.img + (size_t)(y - stop + k) * r->w, r->w * sizeof(uint32_t));
+			frame_free(arena_finish(&arena), (size_t)r->w * arena.h * sizeof(uint32_t));
+		}
+	}
+	DEBUG(1, "refreshed rows %d-%d of %dx%d in %lluus", top, bot, w, h,
+	      (unsigned long long)(now_us() - t));
+}
+
+static struct warm_t *
+next_damaged() {
+	int i;
+	for (i = 0; i < warm.nscreens; ++i) {
+		if (warm.screens[i].top < warm.screens[i].bot)
+			return &warm.screens[i];
+	}
+	return NULL;
+}
+
+static void *
+warm_worker(void *arg) {
+	struct timespec ts;
+	(void)arg;
+
+#ifdef SCHED_IDLE
+	struct sched_param sp = { 0 };
+	if ((errno = pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp)))
+		warn("SCHED_IDLE");
+#endif
+
+	pthread_mutex_lock(&warm.mutex);
+	for (;;) {
+		struct warm_t *ws;
+		int top, bot;
+
+		while (warm.hold || !(ws = next_damaged()))
+			pthread_cond_wait(&warm.cond, &warm.mutex);
+		top = ws->top;
+		bot = ws->bot;
+		ws->top = ws->h;
+		ws->bot = 0;
+		warm.busy = true;
+		pthread_mutex_unlock(&warm.mutex);
+
+		refresh_warm(ws, top, bot);
+
+		/* replies read for the refresh may have queued events on
+		 * the connection that ppoll in the event loop won't see */
+		if (write(warm.wake[1], "", 1) < 0 && errno != EAGAIN)
+			warn("write");
+
+		pthread_mutex_lock(&warm.mutex);
+		warm.busy = false;
+		pthread_cond_broadcast(&warm.cond);
+
+		/* damage only accumulates until the interval is up */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += WARM_INTERVAL % 1000 * 1000000L;
+		ts.tv_sec += WARM_INTERVAL / 1000 + ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		while (!warm.hold && pthread_cond_timedwait(&warm.cond, &warm.mutex, &ts) != ETIMEDOUT)
+			;
+	}
+	return NULL;
+}
+
+static void
+damage_all() {
+	int i;
+	pthread_mutex_lock(&warm.mutex);
+	for (i = 0; i < warm.nscreens; ++i) {
+		warm.screens[i].top = 0;
+		warm.screens[i].bot = warm.screens[i].h;
+		xcb_damage_subtract(conn, warm.screens[i].damage, XCB_NONE, XCB_NONE);
+	}
+	pthread_cond_broadcast(&warm.cond);
+	pthread_mutex_unlock(&warm.mutex);
+}
+
+/* keeps the worker off the warm frames until release_warm */
+static void
+hold_warm() {
+	pthread_mutex_lock(&warm.mutex);
+	warm.hold = true;
+	while (warm.busy)
+		pthread_cond_wait(&warm.cond, &warm.mutex);
+	pthread_mutex_unlock(&warm.mutex);
+}
+
+static void
+release_warm() {
+	pthread_mutex_lock(&warm.mutex);
+	warm.hold = false;
+	pthread_cond_broadcast(&warm.cond);
+	pthread_mutex_unlock(&warm.mutex);
+}
+
+/*
+ * (Re)makes the frame for the root's current size and monitors; the
+ * worker must be held or not yet started. The setup data does not
+ * follow the size of a root by itself, so it is asked for and written
+ * back there, for the lock screens to be made at that size too.
+ */
+static void
+resize_warm(struct warm_t *ws) {
+	xcb_screen_t *root = ws->screen.screen;
+	xcb_get_geometry_reply_t *geom;
+
+	geom = xcb_get_geometry_reply(conn, xcb_get_geometry(conn, root->root), NULL);
+	if (geom) {
+		root->width_in_pixels = geom->width;
+		root->height_in_pixels = geom->height;
+		free(geom);
+	}
+	set_monitors(&ws->screen);
+	if (ws->frame && (ws->w != root->width_in_pixels || ws->h != root->height_in_pixels)) {
+		DEBUG(1, "warm screen %dx%d -> %dx%d", ws->w, ws->h,
+		      root->width_in_pixels, root->height_in_pixels);
+		frame_free(ws->frame, (size_t)ws->w * ws->h * sizeof(uint32_t));
+		ws->frame = NULL;
+	}
+	if (!ws->frame) {
+		ws->w = root->width_in_pixels;
+		ws->h = root->height_in_pixels;
+		ws->frame = frame_alloc((size_t)ws->w * ws->h * sizeof(uint32_t));
+		tune_screen(&ws->screen);
+	}
+	ws->top = 0;
+	ws->bot = ws->h;
+}
+
+static void
+init_warm() {
+	const xcb_query_extension_reply_t *ext;
+	xcb_damage_query_version_reply_t *ver;
+	xcb_screen_iterator_t iter;
+	xcb_void_cookie_t cookie;
+	sigset_t all, old;
+	int ret;
+
+	if (conf.wallpaper || render) {
+		DEBUG(1, "no frame to keep warm: wallpaper=%d render=%d", !!conf.wallpaper, render);
+		return;
+	}
+	ext = xcb_get_extension_data(conn, &xcb_damage_id);
+	if (!ext || !ext->present) {
+		warnx("no DAMAGE extension, the screen is captured at lock");
+		return;
+	}
+	/* DAMAGE requests fail until the version is agreed on */
+	ver = xcb_damage_query_version_reply(conn, xcb_damage_query_version(conn, 1, 1), NULL);
+	if (!ver) {
+		warnx("DAMAGE version query failed, the screen is captured at lock");
+		return;
+	}
+	free(ver);
+	warm.base = ext->first_event;
+
+	for (iter = xcb_setup_roots_iterator(xcb_get_setup(conn)); iter.rem; xcb_screen_next(&iter)) {
+		struct warm_t *ws;
+
+		if (!(warm.screens = realloc(warm.screens, (warm.nscreens + 1) * sizeof(*warm.screens)))) {
+			err(1, "realloc");
+		}
+		ws = &warm.screens[warm.nscreens++];
+		memset(ws, 0, sizeof(*ws));
+		ws->screen.screen = iter.data;
+		init_format(&ws->screen);
+		resize_warm(ws);
+		ws->damage = xcb_generate_id(conn);
+		cookie = xcb_damage_create_checked(conn, ws->damage, iter.data->root,
+		                                   XCB_DAMAGE_REPORT_LEVEL_BOUNDING_BOX);
+		check_xcb_cookie(cookie, "could not create damage");
+		if (rrbase >= 0)
+			xcb_randr_select_input(conn, iter.data->root,
+			                       XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE);
+	}
+	damage_all();
+
+	if (pipe2(warm.wake, O_NONBLOCK | O_CLOEXEC) < 0)
+		err(1, "pipe2");
+
+	/* signals are for the event loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&warm.thread, NULL, warm_worker, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		errno = ret;
+		err(1, "pthread_create");
+	}
+	warm.enabled = true;
+}
+
+static void
+handle_damage_notify(xcb_damage_notify_event_t *ev) {
+	int i;
+
+	/* with a bounding box report level, the next notify comes when
+	 * damage grows past the box, so the region is emptied each time */
+	xcb_damage_subtract(conn, ev->damage, XCB_NONE, XCB_NONE);
+
+	pthread_mutex_lock(&warm.mutex);
+	for (i = 0; i < warm.nscreens; ++i) {
+		struct warm_t *ws = &warm.screens[i];
+		int top = ev->area.y, bot = ev->area.y + ev->area.height;
+
+		if (ws->damage != ev->damage)
+			continue;
+		top = top > 0 ? top : 0;
+		bot = bot < ws->h ? bot : ws->h;
+		ws->top = top < ws->top ? top : ws->top;
+		ws->bot = bot > ws->bot ? bot : ws->bot;
+	}
+	pthread_cond_broadcast(&warm.cond);
+	pthread_mutex_unlock(&warm.mutex);
+}
+
+static void
+handle_warm_screen_change(xcb_randr_screen_change_notify_event_t *ev) {
+	int i;
+
+	DEBUG(2, "XCB_RANDR_SCREEN_CHANGE_NOTIFY:w=%d h=%d", ev->width, ev->height);
+	hold_warm();
+	for (i = 0; i < warm.nscreens; ++i) {
+		if (warm.screens[i].screen.screen->root == ev->root)
+			resize_warm(&warm.screens[i]);
+	}
+	release_warm();
+}
+
+static void
+handle_daemon_events() {
+	xcb_generic_event_t *ev;
+
+	while ((ev = xcb_poll_for_event(conn))) {
+		int type = ev->response_type & 0x7f;
+		++stats.events[type];
+		if (warm.enabled && type == warm.base + XCB_DAMAGE_NOTIFY) {
+			handle_damage_notify((xcb_damage_notify_event_t*)ev);
+		} else if (warm.enabled && rrbase >= 0 &&
+		           type == rrbase + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+			handle_warm_screen_change((xcb_randr_screen_change_notify_event_t*)ev);
+		} else {
+			DEBUG(2, "Unhandled event=%d", type);
+		}
+		free(ev);
+	}
+	xcb_flush(conn);
+}
+
+static void
+request_lock(int sig) {
+	(void)sig;
+	lock_requested = 1;
+}
+
+static void
+lock_warm() {
+	struct sigaction sa;
+	int i;
+
+	/* the worker may have read events off the connection */
+	handle_daemon_events();
+
+	hold_warm();
+
+	/* what is left is refiltered here, at the locker's priority */
+	for (i = 0; i < warm.nscreens; ++i) {
+		struct warm_t *ws = &warm.screens[i];
+		if (ws->top < ws->bot)
+			refresh_warm(ws, ws->top, ws->bot);
+		ws->top = ws->h;
+		ws->bot = 0;
+	}
+
+	state = STATE_LOCKED;
+	reset_input();
+	lock_screens();
+	mainloop();
+	unlock_screens();
+
+	/* the lock window covered everything, and damage was not taken
+	 * off the region while locked; the size and monitors may have
+	 * changed as well */
+	for (i = 0; i < warm.nscreens; ++i)
+		resize_warm(&warm.screens[i]);
+	release_warm();
+	damage_all();
+	xcb_flush(conn);
+
+	/* a SIGUSR2 that came while locked is discarded, not another lock */
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGUSR2, &sa, NULL);
+	sa.sa_handler = request_lock;
+	sigaction(SIGUSR2, &sa, NULL);
+	lock_requested = 0;
+}
+
+void
+xcb_daemon() {
+	struct sigaction sa;
+	struct pollfd pfd[2];
+	sigset_t waitmask, usr2;
+	char buf[64];
+
+	open_display();
+	init_warm();
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = request_lock;
+	sigaction(SIGUSR2, &sa, NULL);
+	stats_init(&waitmask);
+	sigemptyset(&usr2);
+	sigaddset(&usr2, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &usr2, NULL);
+	sigdelset(&waitmask, SIGUSR2);
+
+	/* the wake pipe is -1, which ppoll skips, without a worker */
+	pfd[0].fd = xcb_get_file_descriptor(conn);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = warm.wake[0];
+	pfd[1].events = POLLIN;
+
+	DEBUG(1, "unlocked, %d warm screen(s), SIGUSR2 locks", warm.nscreens);
+	for (;;) {
+		int ret;
+
+		handle_daemon_events();
+
+		/* SIGUSR1 and SIGUSR2 are only let through while waiting */
+		ret = ppoll(pfd, 2, NULL, &waitmask);
+		if (ret < 0 && errno == EINTR) {
+			stats_poll();
+			if (lock_requested)
+				lock_warm();
+			continue;
+		}
+		if (ret < 1) {
+			err(1, "ppoll");
+		}
+		if (pfd[0].revents & ~POLLIN) {
+			errx(1, "poll %d: revents=%04x", pfd[0].fd, pfd[0].revents);
+		}
+		if (pfd[1].revents & POLLIN) {
+			while (read(pfd[1].fd, buf, sizeof(buf)) > 0)
+				;
+		}
+	}
+}